@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2008  Kristian Høgsberg <krh@redhat.com>
+ * Copyright (C) 2008  Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "razor-internal.h"
+#include "razor.h"
+
+static uint32_t
+checksum_string(uint32_t crc, const char *s)
+{
+	return razor_crc32c(crc, s, strlen(s) + 1);
+}
+
+/* Checksum the full path of every entry below dir into sums, indexed
+ * like the file entries.  The checksum of a path continues from that
+ * of its directory, so each name is only checksummed once. */
+static void
+checksum_dir(struct razor_set *set, struct razor_file_name_cursor *cursor,
+	     uint32_t *sums, struct razor_entry *dir, uint32_t crc)
+{
+	struct razor_entry *e, *entries;
+	const char *name;
+
+	if (dir->start == 0)
+		return;
+
+	entries = set->files.data;
+	e = entries + dir->start;
+	do {
+		name = razor_file_name_cursor_get(cursor, e->name);
+		sums[e - entries] =
+			razor_crc32c(razor_crc32c(crc, "/", 1),
+				     name, strlen(name));
+	} while (!((e++)->flags & RAZOR_ENTRY_LAST));
+
+	e = entries + dir->start;
+	do
+		checksum_dir(set, cursor, sums, e, sums[e - entries]);
+	while (!((e++)->flags & RAZOR_ENTRY_LAST));
+}
+
+/* Returns the path checksums of the file entries of set, or NULL if
+ * it has no files or they are corrupt. */
+static uint32_t *
+file_checksums(struct razor_set *set)
+{
+	struct razor_file_name_cursor cursor;
+	uint32_t *sums, count;
+
+	if (razor_set_bind_files(set) < 0)
+		return NULL;
+	count = set->files.size / sizeof (struct razor_entry);
+	if (count == 0)
+		return NULL;
+
+	sums = zalloc(count * sizeof *sums);
+	razor_file_name_cursor_init(&cursor, set);
+	checksum_dir(set, &cursor, sums, set->files.data, 0);
+	razor_file_name_cursor_release(&cursor);
+
+	return sums;
+}
+
+/* The checksum of a package covers its name, version, arch, details,
+ * properties and files.  The property and file checksums are summed,
+ * so the order of the lists doesn't matter.  file_sums is what
+ * file_checksums() returned for set. */
+static uint32_t
+package_checksum(struct razor_set *set, struct razor_package *package,
+		 uint32_t *file_sums)
+{
+	struct razor_property *property, *properties;
+	const char *pool = set->string_pool.data;
+	const char *summary, *description, *url, *license;
+	struct list_iterator li;
+	struct list *r;
+	uint32_t crc, sums[2], file;
+
+	properties = set->properties.data;
+	sums[0] = 0;
+	r = list_first(&package->properties, &set->property_pool);
+	while (r) {
+		property = &properties[r->data];
+		crc = razor_crc32c(0, &property->flags, sizeof property->flags);
+		crc = checksum_string(crc, &pool[property->name]);
+		crc = checksum_string(crc, &pool[property->version]);
+		sums[0] += crc;
+		r = list_next(r);
+	}
+
+	sums[1] = 0;
+	if (file_sums != NULL) {
+		list_iterator_init(&li, &package->files, &set->file_pool);
+		while (list_iterator_next(&li, &file))
+			sums[1] += file_sums[file];
+	}
+
+	razor_package_get_details(set, package,
+				  RAZOR_DETAIL_SUMMARY, &summary,
+				  RAZOR_DETAIL_DESCRIPTION, &description,
+				  RAZOR_DETAIL_URL, &url,
+				  RAZOR_DETAIL_LICENSE, &license,
+				  RAZOR_DETAIL_LAST);
+
+	crc = checksum_string(0, &pool[package->name]);
+	crc = checksum_string(crc, &pool[package->version]);
+	crc = checksum_string(crc, &pool[package->arch]);
+	crc = checksum_string(crc, summary);
+	crc = checksum_string(crc, description);
+	crc = checksum_string(crc, url);
+	crc = checksum_string(crc, license);
+
+	return razor_crc32c(crc, sums, sizeof sums);
+}
+
+/**
+ * razor_set_get_checksum:
+ * @set: a %razor_set
+ *
+ * Compute a checksum of the packages in @set with their details,
+ * properties and files.  Unlike a checksum of the file, this doesn't
+ * depend on how the set was built or laid out, so a set created with
+ * razor_set_apply_delta() has the same checksum as the set the delta
+ * was made from.  Details and files only count if @set has them, so
+ * a set opened without its details or files file has a different
+ * checksum.
+ *
+ * Returns: the checksum.
+ **/
+RAZOR_EXPORT uint32_t
+razor_set_get_checksum(struct razor_set *set)
+{
+	struct razor_package *p, *end;
+	uint32_t sums[2], *file_sums;
+
+	assert (set != NULL);
+
+	file_sums = file_checksums(set);
+	sums[0] = set->packages.size / sizeof *p;
+	sums[1] = 0;
+	end = set->packages.data + set->packages.size;
+	for (p = set->packages.data; p < end; p++)
+		sums[1] += package_checksum(set, p, file_sums);
+	free(file_sums);
+
+	return razor_crc32c(0, sums, sizeof sums);
+}
+
+/* Order packages by name, version and arch.  Sets sort their
+ * packages by name and version only, so packages that differ only in
+ * arch may come in any order; the walks below are still correct
+ * then, they may just see a package as removed and added again. */
+static int
+compare_packages(struct razor_version_cache *versions,
+		 struct razor_set *set1, struct razor_package *p1,
+		 struct razor_set *set2, struct razor_package *p2)
+{
+	const char *pool1 = set1->string_pool.data;
+	const char *pool2 = set2->string_pool.data;
+	int res;
+
+	res = strcmp(&pool1[p1->name], &pool2[p2->name]);
+	if (res == 0)
+		res = razor_version_cache_compare(versions,
+						  p1->version, p2->version);
+	if (res == 0)
+		res = strcmp(&pool1[p1->arch], &pool2[p2->arch]);
+
+	return res;
+}
+
+/**
+ * razor_set_create_delta:
+ * @base: the %razor_set to update from
+ * @target: the %razor_set to update to
+ *
+ * Create a delta set, which holds the packages of @target that
+ * aren't in @base, with their properties, files and details, and the
+ * list of packages of @base that aren't in @target.  A package that
+ * kept its name, version and arch but changed its details,
+ * properties or files counts as removed and added.  The delta is written with
+ * %RAZOR_REPO_FILE_ALL, and turned back into @target with
+ * razor_set_apply_delta().
+ *
+ * Returns: the new delta set, or %NULL if the files of @target are
+ * corrupt.
+ **/
+RAZOR_EXPORT struct razor_set *
+razor_set_create_delta(struct razor_set *base, struct razor_set *target)
+{
+	struct razor_version_cache *versions;
+	struct razor_merger *merger;
+	struct razor_package *b, *bpkgs, *bend, *t, *tend;
+	struct razor_delta_info *info;
+	struct array removed;
+	struct razor_set *delta;
+	uint32_t *r, *base_sums, *target_sums;
+	int cmp;
+
+	assert (base != NULL);
+	assert (target != NULL);
+
+	versions = malloc(sizeof *versions);
+	razor_version_cache_init(versions, base, target);
+	array_init(&removed);
+	base_sums = file_checksums(base);
+	target_sums = file_checksums(target);
+
+	bpkgs = base->packages.data;
+	bend = base->packages.data + base->packages.size;
+	t = target->packages.data;
+	tend = target->packages.data + target->packages.size;
+
+	merger = razor_merger_create(target, target);
+	for (b = bpkgs; b < bend || t < tend; ) {
+		if (b < bend && t < tend)
+			cmp = compare_packages(versions, base, b, target, t);
+		else if (b < bend)
+			cmp = -1;
+		else
+			cmp = 1;
+
+		if (cmp == 0 &&
+		    package_checksum(base, b, base_sums) !=
+		    package_checksum(target, t, target_sums)) {
+			r = array_add(&removed, sizeof *r);
+			*r = b - bpkgs;
+			razor_merger_add_package(merger, t);
+		} else if (cmp < 0) {
+			r = array_add(&removed, sizeof *r);
+			*r = b - bpkgs;
+		} else if (cmp > 0) {
+			razor_merger_add_package(merger, t);
+		}
+
+		if (cmp <= 0)
+			b++;
+		if (cmp >= 0)
+			t++;
+	}
+	free(versions);
+	free(base_sums);
+	free(target_sums);
+
+	delta = razor_merger_finish(merger);
+	if (delta == NULL) {
+		array_release(&removed);
+		return NULL;
+	}
+	delta->flags |= RAZOR_SET_DELTA;
+
+	/* The delta gets merged into the base, and only the string
+	 * index of the base is used for that. */
+	delta->flags &= ~RAZOR_SET_STRING_INDEX;
+	array_release(&delta->string_index);
+	array_init(&delta->string_index);
+	delta->delta_removed = removed;
+	info = array_add(&delta->delta_info, sizeof *info);
+	info->base_checksum = razor_set_get_checksum(base);
+	info->target_checksum = razor_set_get_checksum(target);
+
+	return delta;
+}
+
+/**
+ * razor_set_apply_delta:
+ * @base: the %razor_set the delta was created from
+ * @delta: a delta set from razor_set_create_delta()
+ *
+ * Create the target set of @delta, by removing the packages the
+ * delta lists from @base and adding the ones it holds.  @base must
+ * have the checksum the delta was made against, and the result is
+ * checked against the checksum of the target.
+ *
+ * Returns: the new %razor_set, or %NULL if @delta isn't a delta or
+ * doesn't apply to @base.
+ **/
+RAZOR_EXPORT struct razor_set *
+razor_set_apply_delta(struct razor_set *base, struct razor_set *delta)
+{
+	struct razor_version_cache *versions;
+	struct razor_merger *merger;
+	struct razor_package *b, *bpkgs, *bend, *d, *dend;
+	struct razor_delta_info *info;
+	struct razor_set *result;
+	uint32_t *r, *rend;
+	int cmp;
+
+	assert (base != NULL);
+	assert (delta != NULL);
+
+	info = delta->delta_info.data;
+	if (!(delta->flags & RAZOR_SET_DELTA) ||
+	    delta->delta_info.size < sizeof *info ||
+	    info->base_checksum != razor_set_get_checksum(base))
+		return NULL;
+
+	versions = malloc(sizeof *versions);
+	razor_version_cache_init(versions, base, delta);
+
+	bpkgs = base->packages.data;
+	bend = base->packages.data + base->packages.size;
+	d = delta->packages.data;
+	dend = delta->packages.data + delta->packages.size;
+	r = delta->delta_removed.data;
+	rend = delta->delta_removed.data + delta->delta_removed.size;
+
+	merger = razor_merger_create(base, delta);
+	for (b = bpkgs; b < bend || d < dend; ) {
+		/* The removed indexes are in increasing order. */
+		if (b < bend && r < rend && *r == b - bpkgs) {
+			r++;
+			b++;
+			continue;
+		}
+
+		if (b < bend && d < dend)
+			cmp = compare_packages(versions, base, b, delta, d);
+		else if (b < bend)
+			cmp = -1;
+		else
+			cmp = 1;
+
+		if (cmp <= 0) {
+			razor_merger_add_package(merger, b);
+			b++;
+		} else {
+			razor_merger_add_package(merger, d);
+			d++;
+		}
+	}
+	free(versions);
+
+	result = razor_merger_finish(merger);
+	if (result == NULL)
+		return NULL;
+	if (r != rend ||
+	    razor_set_get_checksum(result) != info->target_checksum) {
+		razor_set_destroy(result);
+		return NULL;
+	}
+
+	return result;
+}
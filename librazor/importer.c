@@ -23,6 +23,23 @@
 #include "razor-internal.h"
 #include "razor.h"
 
+static uint32_t
+add_directory(struct razor_importer *importer, uint32_t name, uint32_t hash)
+{
+	struct import_directory *d;
+
+	d = array_add(&importer->directories, sizeof *d);
+	d->name = name;
+	d->hash = hash;
+	d->count = 0;
+	array_init(&d->children);
+	array_init(&d->packages);
+	d->child_hash = NULL;
+	d->child_hash_size = 0;
+
+	return d - (struct import_directory *) importer->directories.data;
+}
+
 /**
  * razor_importer_create:
  *
@@ -42,6 +59,8 @@ razor_importer_create(void)
 		       &importer->set->details_string_pool);
 	hashtable_init(&importer->file_table,
 		       &importer->set->file_string_pool);
+	add_directory(importer,
+		      hashtable_tokenize(&importer->file_table, ""), 0);
 
 	return importer;
 }
@@ -62,6 +81,35 @@ razor_importer_destroy(struct razor_importer *importer)
 }
 
 
+/**
+ * razor_importer_set_flags:
+ * @importer: the %razor_importer
+ * @flags: %razor_set_flags for the new set
+ *
+ * Set flags that control the layout of the set created by
+ * %razor_importer_finish.  With %RAZOR_SET_SORTED_STRING_POOL, the
+ * string pool is written in sorted order, so that names can be
+ * compared by comparing their offsets.  With
+ * %RAZOR_SET_HUGE_PAGE_ALIGNED, the sections are aligned to 2 MiB
+ * instead of the page size when the set is written.  With
+ * %RAZOR_SET_PACKED_LISTS, long package and file lists are delta
+ * encoded in a variable number of bytes per entry.  With
+ * %RAZOR_SET_FRONT_CODED_FILES, the file names are stored sorted, with
+ * the prefix each shares with the one before it left out.  With
+ * %RAZOR_SET_COMPRESSED_DETAILS, the details strings are compressed
+ * in blocks, which are uncompressed as they are needed.  With
+ * %RAZOR_SET_STRING_INDEX, the hash table over the string pool is
+ * saved in the set, so that merging new packages into it later only
+ * needs to hash the new strings.  With %RAZOR_SET_VERSION_KEYS, the
+ * razor_version_key() of each distinct version is saved, so versions
+ * from different sets can be compared with memcmp().
+ **/
+RAZOR_EXPORT void
+razor_importer_set_flags(struct razor_importer *importer, uint32_t flags)
+{
+	importer->flags = flags;
+}
+
 /**
  * razor_importer_begin_package:
  * @importer: the %razor_importer
@@ -91,6 +139,9 @@ razor_importer_begin_package(struct razor_importer *importer,
 	p->arch = hashtable_tokenize(&importer->table, arch);
 
 	importer->package = p;
+	importer->details = array_add(&importer->set->package_details,
+				      sizeof *importer->details);
+	razor_importer_add_details(importer, NULL, NULL, NULL, NULL);
 	array_init(&importer->properties);
 }
 
@@ -128,10 +179,10 @@ razor_importer_add_details(struct razor_importer *importer,
 			   const char *url,
 			   const char *license)
 {
-	importer->package->summary = hashtable_tokenize(&importer->details_table, summary);
-	importer->package->description = hashtable_tokenize(&importer->details_table, description);
-	importer->package->url = hashtable_tokenize(&importer->details_table, url);
-	importer->package->license = hashtable_tokenize(&importer->details_table, license);
+	importer->details->summary = hashtable_tokenize(&importer->details_table, summary);
+	importer->details->description = hashtable_tokenize(&importer->details_table, description);
+	importer->details->url = hashtable_tokenize(&importer->details_table, url);
+	importer->details->license = hashtable_tokenize(&importer->details_table, license);
 }
 
 /**
@@ -173,6 +224,108 @@ razor_importer_add_property(struct razor_importer *importer,
 	}
 }
 
+#define IMPORT_CHILD_HASH_MIN	8
+
+static int
+entry_has_name(struct razor_importer *importer, struct import_directory *d,
+	       const char *name, size_t length, uint32_t hash)
+{
+	const char *pool = importer->set->file_string_pool.data;
+
+	return d->hash == hash &&
+		strncmp(&pool[d->name], name, length) == 0 &&
+		pool[d->name + length] == '\0';
+}
+
+/* Return the index of the child of parent called name, which is
+ * length bytes long, or 0 if there's none.  The root is never a
+ * child, so 0 isn't a valid child index. */
+static uint32_t
+lookup_child(struct razor_importer *importer, uint32_t parent,
+	     const char *name, size_t length, uint32_t hash)
+{
+	struct import_directory *dirs, *d;
+	uint32_t *c, *end, i, mask;
+
+	dirs = importer->directories.data;
+	d = &dirs[parent];
+	if (d->child_hash == NULL) {
+		end = d->children.data + d->children.size;
+		for (c = d->children.data; c < end; c++)
+			if (entry_has_name(importer, &dirs[*c],
+					   name, length, hash))
+				return *c;
+		return 0;
+	}
+
+	mask = d->child_hash_size - 1;
+	for (i = hash & mask; d->child_hash[i]; i = (i + 1) & mask)
+		if (entry_has_name(importer, &dirs[d->child_hash[i] - 1],
+				   name, length, hash))
+			return d->child_hash[i] - 1;
+
+	return 0;
+}
+
+static void
+insert_child_hash(struct import_directory *d, uint32_t hash, uint32_t index)
+{
+	uint32_t i, mask;
+
+	mask = d->child_hash_size - 1;
+	for (i = hash & mask; d->child_hash[i]; i = (i + 1) & mask)
+		;
+	d->child_hash[i] = index + 1;
+}
+
+static void
+rehash_children(struct import_directory *dirs, struct import_directory *d,
+		uint32_t size)
+{
+	uint32_t *c, *end;
+
+	free(d->child_hash);
+	d->child_hash = zalloc(size * sizeof *d->child_hash);
+	d->child_hash_size = size;
+
+	end = d->children.data + d->children.size;
+	for (c = d->children.data; c < end; c++)
+		insert_child_hash(d, dirs[*c].hash, *c);
+}
+
+static uint32_t
+add_child(struct razor_importer *importer, uint32_t parent,
+	  const char *name, size_t length, uint32_t hash)
+{
+	struct import_directory *dirs, *d;
+	uint32_t index, count, *c;
+	char *p;
+
+	/* The name is part of a longer path, so it needs a copy of
+	 * its own to be added to the string pool. */
+	importer->path.size = 0;
+	p = array_add(&importer->path, length + 1);
+	memcpy(p, name, length);
+	p[length] = '\0';
+	index = add_directory(importer,
+			      hashtable_tokenize(&importer->file_table, p),
+			      hash);
+
+	dirs = importer->directories.data;
+	d = &dirs[parent];
+	c = array_add(&d->children, sizeof *c);
+	*c = index;
+
+	count = d->children.size / sizeof *c;
+	if (count > IMPORT_CHILD_HASH_MIN && count * 2 > d->child_hash_size)
+		rehash_children(dirs, d, d->child_hash_size > 0 ?
+				d->child_hash_size * 2 : 4 * IMPORT_CHILD_HASH_MIN);
+	else if (d->child_hash != NULL)
+		insert_child_hash(d, hash, index);
+
+	return index;
+}
+
 /**
  * razor_importer_add_file:
  * @importer: the %razor_importer
@@ -183,49 +336,111 @@ razor_importer_add_property(struct razor_importer *importer,
 RAZOR_EXPORT void
 razor_importer_add_file(struct razor_importer *importer, const char *name)
 {
-	struct import_entry *e;
-
-	e = array_add(&importer->files, sizeof *e);
+	struct import_directory *d;
+	const char *end;
+	uint32_t index, child, hash, *r;
+	size_t length;
+
+	if (*name != '/')
+		return;
+	name++;
+
+	index = 0;
+	while (*name) {
+		end = strchrnul(name, '/');
+		length = end - name;
+		hash = hashtable_hash_string(name, length);
+		child = lookup_child(importer, index, name, length, hash);
+		if (child == 0)
+			child = add_child(importer, index, name, length, hash);
+		index = child;
+		if (*end == '\0')
+			break;
+		name = end + 1;
+	}
 
-	e->package = importer->package -
+	d = (struct import_directory *) importer->directories.data + index;
+	r = array_add(&d->packages, sizeof *r);
+	*r = importer->package -
 		(struct razor_package *) importer->set->packages.data;
-	e->name = strdup(name);
 }
 
 static int
 compare_packages(const void *p1, const void *p2, void *data)
 {
 	const struct razor_package *pkg1 = p1, *pkg2 = p2;
-	struct razor_set *set = data;
+	struct razor_importer *importer = data;
+	struct razor_set *set = importer->set;
 	char *pool = set->string_pool.data;
+	uint32_t *ranks = importer->version_ranks;
 
 	/* FIXME: what if the flags are different? */
 	if (pkg1->name == pkg2->name)
-		return razor_versioncmp(&pool[pkg1->version], &pool[pkg2->version]);
+		return ranks[pkg1->version] < ranks[pkg2->version] ? -1 :
+			ranks[pkg1->version] > ranks[pkg2->version];
+	else if (set->flags & RAZOR_SET_SORTED_STRING_POOL)
+		return pkg1->name < pkg2->name ? -1 : 1;
 	else
 		return strcmp(&pool[pkg1->name], &pool[pkg2->name]);
 }
 
+/* With a sorted string pool, compare_packages() orders by the name
+ * offset and then the version rank, so the packages can be radix
+ * sorted on the two combined. */
+static uint32_t *
+sort_packages(struct razor_importer *importer, int count)
+{
+	struct razor_set *set = importer->set;
+	struct razor_package *packages = set->packages.data;
+	uint32_t *ranks = importer->version_ranks;
+	uint64_t *keys;
+	uint32_t *map;
+	int i;
+
+	if (!(set->flags & RAZOR_SET_SORTED_STRING_POOL))
+		return razor_sort_with_data(packages, count, sizeof *packages,
+					    compare_packages, importer);
+
+	keys = malloc(count * sizeof *keys);
+	for (i = 0; i < count; i++)
+		keys[i] = (uint64_t) packages[i].name << 32 |
+			ranks[packages[i].version];
+	map = razor_sort_with_keys(packages, count, sizeof *packages, keys);
+	free(keys);
+
+	return map;
+}
+
 static int
 compare_properties(const void *p1, const void *p2, void *data)
 {
 	const struct razor_property *prop1 = p1, *prop2 = p2;
-	struct razor_set *set = data;
+	struct razor_importer *importer = data;
+	struct razor_set *set = importer->set;
 	char *pool = set->string_pool.data;
+	uint32_t *ranks = importer->version_ranks;
 
-	if (prop1->name != prop2->name)
+	if (prop1->name != prop2->name) {
+		if (set->flags & RAZOR_SET_SORTED_STRING_POOL)
+			return prop1->name < prop2->name ? -1 : 1;
 		return strcmp(&pool[prop1->name], &pool[prop2->name]);
+	} else if ((prop1->flags ^ prop2->flags) & RAZOR_PROPERTY_TYPE_MASK)
+		return (prop1->flags & RAZOR_PROPERTY_TYPE_MASK) -
+			(prop2->flags & RAZOR_PROPERTY_TYPE_MASK);
 	else if (prop1->flags != prop2->flags)
 		return prop1->flags - prop2->flags;
+	else if (ranks[prop1->version] != ranks[prop2->version])
+		return ranks[prop1->version] < ranks[prop2->version] ? -1 : 1;
 	else if (prop1->version != prop2->version)
-		return razor_versioncmp(&pool[prop1->version], &pool[prop2->version]);
+		return prop1->version < prop2->version ? -1 : 1;
 	else
 		return prop1->packages.list_ptr - prop2->packages.list_ptr;
 }
 
 static uint32_t *
-uniqueify_properties(struct razor_set *set)
+uniqueify_properties(struct razor_importer *importer)
 {
+	struct razor_set *set = importer->set;
 	struct razor_property *rp, *up, *rp_end;
 	struct array *pkgs, *p;
 	struct list_head *r;
@@ -233,11 +448,11 @@ uniqueify_properties(struct razor_set *set)
 	int i, count, unique;
 
 	count = set->properties.size / sizeof(struct razor_property);
-	map = razor_qsort_with_data(set->properties.data,
-				    count,
-				    sizeof(struct razor_property),
-				    compare_properties,
-				    set);
+	map = razor_sort_with_data(set->properties.data,
+				   count,
+				   sizeof(struct razor_property),
+				   compare_properties,
+				   importer);
 
 	rp_end = set->properties.data + set->properties.size;
 	rmap = malloc(count * sizeof *map);
@@ -274,62 +489,51 @@ uniqueify_properties(struct razor_set *set)
 }
 
 static int
-compare_filenames(const void *p1, const void *p2, void *data)
+compare_entries(const void *p1, const void *p2, void *data)
 {
-	const struct import_entry *e1 = p1;
-	const struct import_entry *e2 = p2;
-	const char *n1 = e1->name;
-	const char *n2 = e2->name;
-
-	/* Need to make sure that the contents of a directory
-	 * are sorted immediately after it. So "foo/bar" has to
-	 * sort before "foo.conf"
-	 *
-	 * FIXME: this is about 60% slower than strcmp
-	 */
-	while (*n1 && *n2) {
-		if (*n1 < *n2)
-			return *n2 == '/' ? 1 : -1;
-		else if (*n1 > *n2)
-			return *n1 == '/' ? -1 : 1;
-		n1++;
-		n2++;
-	}
-	if (*n1)
-		return 1;
-	else if (*n2)
-		return -1;
-	else
-		return 0;
+	const uint32_t *c1 = p1, *c2 = p2;
+	struct razor_importer *importer = data;
+	struct import_directory *dirs = importer->directories.data;
+	const char *pool = importer->set->file_string_pool.data;
+
+	return strcmp(&pool[dirs[*c1].name], &pool[dirs[*c2].name]);
 }
 
+/* Sort the children of d by name, recursively, and count the
+ * entries below each directory. */
 static void
-count_entries(struct import_directory *d)
+sort_entries(struct razor_importer *importer, struct import_directory *d)
 {
-	struct import_directory *p, *end;
+	struct import_directory *dirs = importer->directories.data;
+	uint32_t *c, *end, count;
+
+	count = d->children.size / sizeof *c;
+	if (count > 1)
+		free(razor_sort_with_data(d->children.data, count, sizeof *c,
+					  compare_entries, importer));
+	free(d->child_hash);
+	d->child_hash = NULL;
 
-	p = d->files.data;
-	end = d->files.data + d->files.size;
 	d->count = 0;
-	while (p < end) {
-		count_entries(p);
-		d->count += p->count + 1;
-		p++;
+	end = d->children.data + d->children.size;
+	for (c = d->children.data; c < end; c++) {
+		sort_entries(importer, &dirs[*c]);
+		d->count += dirs[*c].count + 1;
 	}
 }
 
 static void
-serialize_files(struct razor_set *set,
+serialize_files(struct razor_set *set, struct import_directory *dirs,
 		struct import_directory *d, struct array *array)
 {
-	struct import_directory *p, *end;
+	struct import_directory *p;
 	struct razor_entry *e = NULL;
-	uint32_t s;
+	uint32_t *c, *end, s;
 
-	p = d->files.data;
-	end = d->files.data + d->files.size;
-	s = array->size / sizeof *e + d->files.size / sizeof *p;
-	while (p < end) {
+	end = d->children.data + d->children.size;
+	s = array->size / sizeof *e + d->children.size / sizeof *c;
+	for (c = d->children.data; c < end; c++) {
+		p = &dirs[*c];
 		e = array_add(array, sizeof *e);
 		e->name = p->name;
 		e->flags = 0;
@@ -338,17 +542,13 @@ serialize_files(struct razor_set *set,
 
 		list_set_array(&e->packages, &set->package_pool, &p->packages, 0);
 		array_release(&p->packages);
-		p++;
 	}
 	if (e != NULL)
 		e->flags |= RAZOR_ENTRY_LAST;
 
-	p = d->files.data;
-	end = d->files.data + d->files.size;
-	while (p < end) {
-		serialize_files(set, p, array);
-		p++;
-	}
+	for (c = d->children.data; c < end; c++)
+		serialize_files(set, dirs, &dirs[*c], array);
+	array_release(&d->children);
 }
 
 static void
@@ -364,71 +564,23 @@ remap_property_package_links(struct array *properties, uint32_t *rmap)
 static void
 build_file_tree(struct razor_importer *importer)
 {
-	int count, i, length;
-	struct import_entry *filenames;
-	char *f, *end;
-	uint32_t name, *r;
-	char dirname[256];
-	struct import_directory *d, root;
+	struct import_directory *root;
 	struct razor_entry *e;
 
-	count = importer->files.size / sizeof (struct import_entry);
-	razor_qsort_with_data(importer->files.data,
-			      count,
-			      sizeof (struct import_entry),
-			      compare_filenames,
-			      NULL);
-
-	root.name = hashtable_tokenize(&importer->file_table, "");
-	array_init(&root.files);
-	array_init(&root.packages);
-	root.last = NULL;
+	root = importer->directories.data;
+	sort_entries(importer, root);
 
-	filenames = importer->files.data;
-	for (i = 0; i < count; i++) {
-		f = filenames[i].name;
-		if (*f != '/')
-			continue;
-		f++;
-
-		d = &root;
-		while (*f) {
-			end = strchr(f, '/');
-			if (end == NULL)
-				end = f + strlen(f);
-			length = end - f;
-			memcpy(dirname, f, length);
-			dirname[length] ='\0';
-			name = hashtable_tokenize(&importer->file_table,
-						  dirname);
-			if (d->last == NULL || d->last->name != name) {
-				d->last = array_add(&d->files, sizeof *d);
-				d->last->name = name;
-				d->last->last = NULL;
-				array_init(&d->last->files);
-				array_init(&d->last->packages);
-			}
-			d = d->last;
-			f = end + 1;
-			if (*end == '\0')
-				break;
-		}
-
-		r = array_add(&d->packages, sizeof *r);
-		*r = filenames[i].package;
-		free(filenames[i].name);
-	}
-
-	count_entries(&root);
 	e = importer->set->files.data;
-	e->name = root.name;
+	e->name = root->name;
 	e->flags = RAZOR_ENTRY_LAST;
-	e->start = importer->files.size ? 1 : 0;
+	e->start = root->count > 0 ? 1 : 0;
 	list_set_empty(&e->packages);
 
-	serialize_files(importer->set, &root, &importer->set->files);
+	serialize_files(importer->set, root, root, &importer->set->files);
 
-	array_release(&importer->files);
+	array_release(&root->packages);
+	array_release(&importer->directories);
+	array_release(&importer->path);
 }
 
 static void
@@ -470,8 +622,8 @@ find_file_provides(struct razor_importer *importer)
 
 	req = req_start = importer->file_requires.data;
 	req_end = importer->file_requires.data + importer->file_requires.size;
-	map = razor_qsort_with_data(req, req_end - req, sizeof *req,
-				    compare_file_requires, pool);
+	map = razor_sort_with_data(req, req_end - req, sizeof *req,
+				   compare_file_requires, pool);
 	free(map);
 
 	for (req = req_start; req < req_end; req++) {
@@ -534,6 +686,23 @@ build_package_file_lists(struct razor_set *set, uint32_t *rmap)
 	free(pkgs);
 }
 
+static void
+sort_package_details(struct razor_set *set, uint32_t *map, int count)
+{
+	struct razor_package_details *details, *sorted;
+	int i;
+
+	if (count == 0)
+		return;
+
+	details = set->package_details.data;
+	sorted = malloc(count * sizeof *sorted);
+	for (i = 0; i < count; i++)
+		sorted[i] = details[map[i]];
+	memcpy(details, sorted, count * sizeof *sorted);
+	free(sorted);
+}
+
 /**
  * razor_importer_finish:
  * @importer: the %razor_importer
@@ -555,20 +724,25 @@ razor_importer_finish(struct razor_importer *importer)
 	build_file_tree(importer);
 	find_file_provides(importer);
 
-	map = uniqueify_properties(importer->set);
+	if (importer->flags & RAZOR_SET_SORTED_STRING_POOL)
+		razor_set_sort_string_pool(importer->set);
+	importer->set->flags |= importer->flags &
+		(RAZOR_SET_HUGE_PAGE_ALIGNED | RAZOR_SET_PACKED_LISTS |
+		 RAZOR_SET_STRING_INDEX | RAZOR_SET_VERSION_KEYS);
+
+	importer->version_ranks = razor_set_rank_versions(importer->set);
+
+	map = uniqueify_properties(importer);
 	list_remap_pool(&importer->set->property_pool, map);
 	free(map);
 
 	count = importer->set->packages.size / sizeof(struct razor_package);
-	map = razor_qsort_with_data(importer->set->packages.data,
-				    count,
-				    sizeof(struct razor_package),
-				    compare_packages,
-				    importer->set);
+	map = sort_packages(importer, count);
 
 	rmap = malloc(count * sizeof *rmap);
 	for (i = 0; i < count; i++)
 		rmap[map[i]] = i;
+	sort_package_details(importer->set, map, count);
 	free(map);
 
 	list_remap_pool(&importer->set->package_pool, rmap);
@@ -576,6 +750,17 @@ razor_importer_finish(struct razor_importer *importer)
 	remap_property_package_links(&importer->set->properties, rmap);
 	free(rmap);
 
+	razor_set_build_property_names(importer->set);
+	razor_set_build_version_ranks(importer->set, importer->version_ranks);
+	free(importer->version_ranks);
+	razor_set_compact_lists(importer->set);
+	if (importer->flags & RAZOR_SET_FRONT_CODED_FILES)
+		razor_set_front_code_file_names(importer->set);
+	if (importer->flags & RAZOR_SET_COMPRESSED_DETAILS)
+		razor_set_compress_details(importer->set);
+	if (importer->flags & RAZOR_SET_STRING_INDEX)
+		razor_set_build_string_index(importer->set);
+
 	set = importer->set;
 	hashtable_release(&importer->table);
 	hashtable_release(&importer->details_table);
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2008  Kristian Høgsberg <krh@redhat.com>
+ * Copyright (C) 2008  Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "razor-internal.h"
+
+/* The strings are spread over the shards by the top bits of their
+ * hash, and each shard has its own lock, so threads only contend
+ * when they add strings to the same shard at the same time.  An id
+ * is the offset of the string in the pool of its shard, shifted up,
+ * with the shard number in the low bits.
+ *
+ * The entries of the shard and stage pools are a uint32_t followed
+ * by the string, and the offsets in the tables point at the string.
+ * In a stage the uint32_t is the id of the string, in a shard it is
+ * the offset razor_interner_finish() gave it. */
+#define INTERNER_SHARD_BITS	4
+#define INTERNER_SHARDS		(1 << INTERNER_SHARD_BITS)
+
+struct razor_interner_shard {
+	pthread_mutex_t lock;
+	struct hashtable table;
+	struct array pool;
+};
+
+struct razor_interner {
+	struct razor_interner_shard shards[INTERNER_SHARDS];
+};
+
+/* A stage remembers the strings a thread has already seen, so that
+ * tokenizing a string again doesn't take a lock. */
+struct razor_interner_stage {
+	struct razor_interner *interner;
+	struct hashtable table;
+	struct array pool;
+};
+
+static uint32_t
+add_entry(struct array *pool, uint32_t value,
+	  const char *string, size_t length)
+{
+	char *p;
+
+	p = array_add(pool, sizeof value + length + 1);
+	memcpy(p, &value, sizeof value);
+	memcpy(p + sizeof value, string, length + 1);
+
+	return p + sizeof value - (char *) pool->data;
+}
+
+static uint32_t
+get_entry_value(struct array *pool, uint32_t offset)
+{
+	uint32_t value;
+
+	memcpy(&value, pool->data + offset - sizeof value, sizeof value);
+
+	return value;
+}
+
+struct razor_interner *
+razor_interner_create(void)
+{
+	struct razor_interner *interner;
+	int i;
+
+	interner = zalloc(sizeof *interner);
+	for (i = 0; i < INTERNER_SHARDS; i++) {
+		pthread_mutex_init(&interner->shards[i].lock, NULL);
+		array_init(&interner->shards[i].pool);
+		hashtable_init(&interner->shards[i].table,
+			       &interner->shards[i].pool);
+	}
+
+	return interner;
+}
+
+void
+razor_interner_destroy(struct razor_interner *interner)
+{
+	int i;
+
+	for (i = 0; i < INTERNER_SHARDS; i++) {
+		pthread_mutex_destroy(&interner->shards[i].lock);
+		hashtable_release(&interner->shards[i].table);
+		array_release(&interner->shards[i].pool);
+	}
+	free(interner);
+}
+
+struct razor_interner_stage *
+razor_interner_stage_create(struct razor_interner *interner)
+{
+	struct razor_interner_stage *stage;
+
+	stage = zalloc(sizeof *stage);
+	stage->interner = interner;
+	array_init(&stage->pool);
+	hashtable_init(&stage->table, &stage->pool);
+
+	return stage;
+}
+
+void
+razor_interner_stage_destroy(struct razor_interner_stage *stage)
+{
+	hashtable_release(&stage->table);
+	array_release(&stage->pool);
+	free(stage);
+}
+
+static uint32_t
+intern(struct razor_interner *interner,
+       const char *string, size_t length, uint32_t hash)
+{
+	struct razor_interner_shard *shard;
+	uint32_t shard_index, offset;
+
+	shard_index = hash >> (32 - INTERNER_SHARD_BITS);
+	shard = &interner->shards[shard_index];
+
+	pthread_mutex_lock(&shard->lock);
+	offset = hashtable_lookup_with_hash(&shard->table, string, hash);
+	if (offset == 0) {
+		offset = add_entry(&shard->pool, 0, string, length);
+		hashtable_add_with_hash(&shard->table, hash, offset);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	assert (offset < 1u << (32 - INTERNER_SHARD_BITS));
+
+	return offset << INTERNER_SHARD_BITS | shard_index;
+}
+
+/* Return the id of string, which is the same for all the stages of
+ * the interner. */
+uint32_t
+razor_interner_stage_tokenize(struct razor_interner_stage *stage,
+			      const char *string)
+{
+	uint32_t hash, offset, id;
+	size_t length;
+
+	if (string == NULL)
+		string = "";
+
+	length = strlen(string);
+	hash = hashtable_hash_string(string, length);
+	offset = hashtable_lookup_with_hash(&stage->table, string, hash);
+	if (offset != 0)
+		return get_entry_value(&stage->pool, offset);
+
+	id = intern(stage->interner, string, length, hash);
+	offset = add_entry(&stage->pool, id, string, length);
+	hashtable_add_with_hash(&stage->table, hash, offset);
+
+	return id;
+}
+
+static int
+compare_strings(const void *p1, const void *p2, void *data)
+{
+	const char * const *s1 = p1, * const *s2 = p2;
+
+	return strcmp(*s1, *s2);
+}
+
+/* Add all the strings of interner to the pool of table, and record
+ * their offsets for razor_interner_get_offset().  The strings are
+ * added in sorted order, so the pool doesn't depend on which thread
+ * got to a string first.  No stage may be used while this runs. */
+void
+razor_interner_finish(struct razor_interner *interner,
+		      struct hashtable *table)
+{
+	struct razor_interner_shard *shard;
+	struct array strings;
+	char **s, **end, *p, *pend;
+	uint32_t offset;
+	int i;
+
+	array_init(&strings);
+	for (i = 0; i < INTERNER_SHARDS; i++) {
+		shard = &interner->shards[i];
+		p = shard->pool.data;
+		pend = shard->pool.data + shard->pool.size;
+		while (p < pend) {
+			p += sizeof offset;
+			s = array_add(&strings, sizeof *s);
+			*s = p;
+			p += strlen(p) + 1;
+		}
+	}
+
+	free(razor_sort_with_data(strings.data,
+				  strings.size / sizeof *s, sizeof *s,
+				  compare_strings, NULL));
+
+	end = strings.data + strings.size;
+	for (s = strings.data; s < end; s++) {
+		offset = hashtable_tokenize(table, *s);
+		memcpy(*s - sizeof offset, &offset, sizeof offset);
+	}
+
+	array_release(&strings);
+}
+
+/* Return the offset in the string pool that razor_interner_finish()
+ * gave the string with the given id. */
+uint32_t
+razor_interner_get_offset(struct razor_interner *interner, uint32_t id)
+{
+	struct razor_interner_shard *shard;
+
+	shard = &interner->shards[id & (INTERNER_SHARDS - 1)];
+
+	return get_entry_value(&shard->pool, id >> INTERNER_SHARD_BITS);
+}
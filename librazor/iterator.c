@@ -20,7 +20,9 @@
 #define _GNU_SOURCE
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
+#include <fnmatch.h>
 #include <assert.h>
 
 #include "razor-internal.h"
@@ -28,13 +30,13 @@
 
 static struct razor_package_iterator *
 razor_package_iterator_create_with_index(struct razor_set *set,
-					 struct list *index)
+					 struct list_head *index)
 {
 	struct razor_package_iterator *pi;
 
 	pi = zalloc(sizeof *pi);
 	pi->set = set;
-	pi->index = index;
+	list_iterator_init(&pi->index, index, &set->package_pool);
 
 	return pi;
 }
@@ -46,13 +48,99 @@ razor_package_iterator_create_empty(struct razor_set *set)
 	return zalloc(sizeof *pi);
 }
 
+/* An iterator over an overlay set runs an iterator over each layer
+ * and merges their packages by name, skipping the hidden ones.  The
+ * layer iterators are created by the caller, NULL for layers with
+ * nothing to iterate. */
+static struct razor_package_iterator *
+razor_overlay_iterator_create(struct razor_set *set)
+{
+	struct razor_package_iterator *pi;
+
+	pi = zalloc(sizeof *pi);
+	pi->set = set;
+	pi->layers = zalloc(set->layer_count * sizeof *pi->layers);
+
+	return pi;
+}
+
+static void
+razor_overlay_iterator_advance(struct razor_package_iterator *pi,
+			       uint32_t i)
+{
+	struct razor_layer_iterator *l = &pi->layers[i];
+	struct razor_package *p;
+
+	if (l->pi == NULL)
+		return;
+
+	while (razor_package_iterator_next(l->pi, &p, RAZOR_DETAIL_LAST) &&
+	       razor_layer_package_is_hidden(&pi->set->layers[i], p))
+		;
+	l->package = p;
+}
+
+static struct razor_package_iterator *
+razor_overlay_iterator_start(struct razor_package_iterator *pi)
+{
+	uint32_t i;
+
+	for (i = 0; i < pi->set->layer_count; i++)
+		razor_overlay_iterator_advance(pi, i);
+
+	return pi;
+}
+
+static struct razor_package *
+razor_overlay_iterator_next(struct razor_package_iterator *pi,
+			    struct razor_set **set)
+{
+	struct razor_layer *layers = pi->set->layers;
+	struct razor_package *p, *q;
+	const char *pool, *qpool;
+	uint32_t i, next;
+
+	p = NULL;
+	next = 0;
+	for (i = 0; i < pi->set->layer_count; i++) {
+		q = pi->layers[i].package;
+		if (q == NULL)
+			continue;
+		qpool = layers[i].set->string_pool.data;
+		if (p == NULL || strcmp(&qpool[q->name], &pool[p->name]) < 0) {
+			p = q;
+			pool = qpool;
+			next = i;
+		}
+	}
+
+	if (p == NULL)
+		return NULL;
+
+	*set = layers[next].set;
+	razor_overlay_iterator_advance(pi, next);
+
+	return p;
+}
+
 RAZOR_EXPORT struct razor_package_iterator *
 razor_package_iterator_create(struct razor_set *set)
 {
 	struct razor_package_iterator *pi;
+	struct razor_set *layer;
+	uint32_t i;
 
 	assert (set != NULL);
 
+	if (set->layers) {
+		pi = razor_overlay_iterator_create(set);
+		for (i = 0; i < set->layer_count; i++) {
+			layer = set->layers[i].set;
+			pi->layers[i].pi = razor_package_iterator_create(layer);
+		}
+		return razor_overlay_iterator_start(pi);
+	}
+
 	pi = zalloc(sizeof *pi);
 	pi->set = set;
 	pi->end = set->packages.data + set->packages.size;
@@ -70,40 +158,117 @@ razor_package_iterator_init_for_property(struct razor_package_iterator *pi,
 	assert (set != NULL);
 	assert (property != NULL);
 
+	/* This doesn't skip the hidden packages of an overlay. */
+	set = razor_set_get_property_layer(set, property);
 	memset(pi, 0, sizeof *pi);
 	pi->set = set;
-	pi->index = list_first(&property->packages, &set->package_pool);
+	list_iterator_init(&pi->index,
+			   &property->packages, &set->package_pool);
 }
 
 RAZOR_EXPORT struct razor_package_iterator *
 razor_package_iterator_create_for_property(struct razor_set *set,
 					   struct razor_property *property)
 {
-	struct list *index;
+	size_t offset = offsetof(struct razor_set, properties);
+	struct razor_package_iterator *pi;
+	int i;
 
 	assert (set != NULL);
 	assert (property != NULL);
 
-	index = list_first(&property->packages, &set->package_pool);
-	return razor_package_iterator_create_with_index(set, index);
+	if (set->layers) {
+		pi = razor_overlay_iterator_create(set);
+		i = razor_set_find_layer(set, property, offset);
+		if (i >= 0)
+			pi->layers[i].pi =
+				razor_package_iterator_create_with_index(
+					set->layers[i].set,
+					&property->packages);
+		return razor_overlay_iterator_start(pi);
+	}
+
+	return razor_package_iterator_create_with_index(set,
+							&property->packages);
 }
 
 RAZOR_EXPORT struct razor_package_iterator *
 razor_package_iterator_create_for_file(struct razor_set *set,
 				       const char *filename)
 {
+	struct razor_package_iterator *pi;
 	struct razor_entry *entry;
-	struct list *index;
+	struct razor_set *layer;
+	uint32_t i;
 
 	assert (set != NULL);
 	assert (filename != NULL);
 
+	if (set->layers) {
+		pi = razor_overlay_iterator_create(set);
+		for (i = 0; i < set->layer_count; i++) {
+			layer = set->layers[i].set;
+			pi->layers[i].pi =
+				razor_package_iterator_create_for_file(
+					layer, filename);
+		}
+		return razor_overlay_iterator_start(pi);
+	}
+
+	if (razor_set_bind_files(set) < 0)
+		return razor_package_iterator_create_empty(set);
 	entry = razor_set_find_entry(set, set->files.data, filename);
 	if (entry == NULL)
 		return razor_package_iterator_create_empty(set);
 
-	index = list_first(&entry->packages, &set->package_pool);
-	return razor_package_iterator_create_with_index(set, index);
+	return razor_package_iterator_create_with_index(set, &entry->packages);
+}
+
+/* Length of the literal prefix of a glob pattern, that is, the part
+ * before the first special character. */
+static size_t
+pattern_prefix_length(const char *pattern)
+{
+	return strcspn(pattern, "*?[\\");
+}
+
+RAZOR_EXPORT struct razor_package_iterator *
+razor_package_iterator_create_for_name(struct razor_set *set,
+				       const char *pattern)
+{
+	struct razor_package_iterator *pi;
+	struct razor_set *layer;
+	size_t len;
+	uint32_t i;
+
+	assert (set != NULL);
+	assert (pattern != NULL);
+
+	if (set->layers) {
+		pi = razor_overlay_iterator_create(set);
+		for (i = 0; i < set->layer_count; i++) {
+			layer = set->layers[i].set;
+			pi->layers[i].pi =
+				razor_package_iterator_create_for_name(
+					layer, pattern);
+		}
+		return razor_overlay_iterator_start(pi);
+	}
+
+	pi = zalloc(sizeof *pi);
+	pi->set = set;
+
+	len = pattern_prefix_length(pattern);
+	if (pattern[len] == '\0') {
+		razor_set_find_package_range(set, pattern, len + 1,
+					     &pi->package, &pi->end);
+	} else {
+		razor_set_find_package_range(set, pattern, len,
+					     &pi->package, &pi->end);
+		pi->pattern = strdup(pattern);
+	}
+
+	return pi;
 }
 
 /**
@@ -125,16 +290,26 @@ razor_package_iterator_next(struct razor_package_iterator *pi,
 	va_list args;
 	int valid;
 	struct razor_package *p, *packages;
+	struct razor_set *set;
+	const char *pool;
+	uint32_t index;
 
 	assert (pi != NULL);
 
-	if (pi->package) {
+	set = pi->set;
+	if (pi->layers) {
+		p = razor_overlay_iterator_next(pi, &set);
+		valid = p != NULL;
+	} else if (pi->package) {
+		pool = pi->set->string_pool.data;
+		while (pi->pattern && pi->package < pi->end &&
+		       fnmatch(pi->pattern, &pool[pi->package->name], 0) != 0)
+			pi->package++;
 		p = pi->package++;
 		valid = p < pi->end;
-	} else if (pi->index) {
+	} else if (list_iterator_next(&pi->index, &index)) {
 		packages = pi->set->packages.data;
-		p = &packages[pi->index->data];
-		pi->index = list_next(pi->index);
+		p = &packages[index];
 		valid = 1;
 	} else
 		valid = 0;
@@ -147,7 +322,7 @@ razor_package_iterator_next(struct razor_package_iterator *pi,
 	*package = p;
 
 	va_start(args, NULL);
-	razor_package_get_details_varg (pi->set, p, args);
+	razor_package_get_details_varg (set, p, args);
 	va_end (args);
 out:
 	return valid;
@@ -156,11 +331,18 @@ out:
 RAZOR_EXPORT void
 razor_package_iterator_destroy(struct razor_package_iterator *pi)
 {
+	uint32_t i;
+
 	assert (pi != NULL);
 
-	if (pi->free_index)
-		free(pi->index);
+	for (i = 0; pi->layers && i < pi->set->layer_count; i++)
+		if (pi->layers[i].pi)
+			razor_package_iterator_destroy(pi->layers[i].pi);
+	free(pi->layers);
 
+	free(pi->index_array);
+
+	free(pi->pattern);
 	free(pi);
 }
 
@@ -176,8 +358,12 @@ razor_property_iterator_create(struct razor_set *set,
 	pi->set = set;
 
 	if (package) {
+		set = razor_set_get_package_layer(set, package);
+		pi->set = set;
 		pi->index = list_first(&package->properties,
 				       &set->property_pool);
+	} else if (set->layers) {
+		pi->overlay = set;
 	} else {
 		pi->property = set->properties.data;
 		pi->end = set->properties.data + set->properties.size;
@@ -186,6 +372,172 @@ razor_property_iterator_create(struct razor_set *set,
 	return pi;
 }
 
+RAZOR_EXPORT struct razor_property_iterator *
+razor_property_iterator_create_for_name(struct razor_set *set,
+					const char *name, uint32_t type)
+{
+	struct razor_property_iterator *pi;
+
+	assert (set != NULL);
+	assert (name != NULL);
+
+	pi = zalloc(sizeof *pi);
+	pi->set = set;
+	pi->type = type & RAZOR_PROPERTY_TYPE_MASK;
+	pi->typed = 1;
+	if (set->layers) {
+		pi->overlay = set;
+		pi->name = strdup(name);
+		return pi;
+	}
+
+	razor_set_find_property_range(set, name, type,
+				      &pi->property, &pi->end);
+
+	return pi;
+}
+
+/**
+ * razor_property_iterator_create_for_sets:
+ * @sets: an array of #razor_set objects
+ * @count: the number of sets
+ *
+ * Create a new #razor_property_iterator object for the properties of
+ * all of @sets, merged in the order the properties of a set are
+ * sorted in: name, type, relation and version.  Use
+ * razor_property_iterator_next_with_set() to find out which set each
+ * property comes from.
+ *
+ * Returns: the new #razor_property_iterator object.
+ **/
+RAZOR_EXPORT struct razor_property_iterator *
+razor_property_iterator_create_for_sets(struct razor_set **sets, int count)
+{
+	struct razor_property_iterator *pi;
+	struct razor_property_source *source;
+	int i;
+
+	assert (sets != NULL);
+
+	pi = zalloc(sizeof *pi);
+	pi->sources = zalloc(count * sizeof *pi->sources);
+	pi->source_count = count;
+	for (i = 0; i < count; i++) {
+		source = &pi->sources[i];
+		source->set = sets[i];
+		source->property = sets[i]->properties.data;
+		source->end = sets[i]->properties.data +
+			sets[i]->properties.size;
+	}
+
+	return pi;
+}
+
+static int
+compare_sources(struct razor_property_source *s1,
+		struct razor_property_source *s2)
+{
+	const char *pool1 = s1->set->string_pool.data;
+	const char *pool2 = s2->set->string_pool.data;
+	struct razor_property *p1 = s1->property, *p2 = s2->property;
+	uint32_t type1, type2;
+	int cmp;
+
+	cmp = strcmp(&pool1[p1->name], &pool2[p2->name]);
+	if (cmp)
+		return cmp;
+
+	/* Same order as the properties of a set are sorted in. */
+	type1 = p1->flags & RAZOR_PROPERTY_TYPE_MASK;
+	type2 = p2->flags & RAZOR_PROPERTY_TYPE_MASK;
+	if (type1 != type2)
+		return type1 < type2 ? -1 : 1;
+	if (p1->flags != p2->flags)
+		return p1->flags < p2->flags ? -1 : 1;
+
+	return razor_versioncmp(&pool1[p1->version], &pool2[p2->version]);
+}
+
+/* Each set has its properties sorted, so this is a merge of the
+ * sorted runs.  The number of sets is small, a linear scan for the
+ * smallest head beats a heap.  Ties go to the first set. */
+static struct razor_property *
+razor_property_iterator_next_source(struct razor_property_iterator *pi)
+{
+	struct razor_property_source *source, *next;
+	uint32_t i;
+
+	next = NULL;
+	for (i = 0; i < pi->source_count; i++) {
+		source = &pi->sources[i];
+		if (source->property == source->end)
+			continue;
+		if (next == NULL || compare_sources(source, next) < 0)
+			next = source;
+	}
+
+	if (next == NULL)
+		return NULL;
+
+	pi->set = next->set;
+	pi->source = next - pi->sources;
+
+	return next->property++;
+}
+
+/* Move an iterator over an overlay on to the properties of the next
+ * layer.  Returns 0 if there are no more layers. */
+static int
+razor_property_iterator_next_layer(struct razor_property_iterator *pi)
+{
+	struct razor_set *set;
+
+	if (pi->layer == pi->overlay->layer_count)
+		return 0;
+
+	set = pi->overlay->layers[pi->layer++].set;
+	pi->set = set;
+	if (pi->name) {
+		razor_set_find_property_range(set, pi->name, pi->type,
+					      &pi->property, &pi->end);
+	} else {
+		pi->property = set->properties.data;
+		pi->end = set->properties.data + set->properties.size;
+	}
+
+	return 1;
+}
+
+/* Whether p is of the type a name iterator was created for.  The
+ * range for a name only holds a single type if the set has the
+ * property name index. */
+static int
+razor_property_iterator_wants(struct razor_property_iterator *pi,
+			      struct razor_property *p)
+{
+	return !pi->typed ||
+		(p->flags & RAZOR_PROPERTY_TYPE_MASK) == pi->type;
+}
+
+static struct razor_property *
+razor_overlay_property_next(struct razor_property_iterator *pi)
+{
+	struct razor_property *p;
+	struct razor_layer *layer;
+
+	for (;;) {
+		if (pi->property < pi->end) {
+			p = pi->property++;
+			layer = &pi->overlay->layers[pi->layer - 1];
+			if (razor_property_iterator_wants(pi, p) &&
+			    razor_layer_property_is_visible(layer, p))
+				return p;
+		} else if (!razor_property_iterator_next_layer(pi)) {
+			return NULL;
+		}
+	}
+}
+
 RAZOR_EXPORT int
 razor_property_iterator_next(struct razor_property_iterator *pi,
 			     struct razor_property **property,
@@ -199,7 +551,16 @@ razor_property_iterator_next(struct razor_property_iterator *pi,
 
 	assert (pi != NULL);
 
-	if (pi->property) {
+	if (pi->sources) {
+		p = razor_property_iterator_next_source(pi);
+		valid = p != NULL;
+	} else if (pi->overlay) {
+		p = razor_overlay_property_next(pi);
+		valid = p != NULL;
+	} else if (pi->property) {
+		while (pi->property < pi->end &&
+		       !razor_property_iterator_wants(pi, pi->property))
+			pi->property++;
 		p = pi->property++;
 		valid = p < pi->end;
 	} else if (pi->index) {
@@ -223,9 +584,39 @@ razor_property_iterator_next(struct razor_property_iterator *pi,
 	return valid;
 }
 
+/**
+ * razor_property_iterator_next_with_set:
+ * @pi: a #razor_property_iterator from
+ * razor_property_iterator_create_for_sets()
+ * @set: return location for the index of the set of the property
+ *
+ * Like razor_property_iterator_next(), but also gives the index in
+ * the array of sets of the set the property belongs to.
+ *
+ * Returns: 0 when there are no more properties.
+ **/
+RAZOR_EXPORT int
+razor_property_iterator_next_with_set(struct razor_property_iterator *pi,
+				      int *set,
+				      struct razor_property **property,
+				      const char **name,
+				      uint32_t *flags,
+				      const char **version)
+{
+	if (!razor_property_iterator_next(pi, property,
+					  name, flags, version))
+		return 0;
+
+	*set = pi->source;
+
+	return 1;
+}
+
 RAZOR_EXPORT void
 razor_property_iterator_destroy(struct razor_property_iterator *pi)
 {
+	free(pi->sources);
+	free(pi->name);
 	free(pi);
 }
 
@@ -303,15 +694,17 @@ razor_package_query_finish(struct razor_package_query *pq)
 
 		index[j].data = i;
 		if (j == pq->count - 1)
-			index[j].flags = 0x80;
+			index[j].flags = RAZOR_LIST_LAST;
 		j++;
 	}
 
 	free(pq->vector);
 	free(pq);
 
-	pi = razor_package_iterator_create_with_index(set, index);
-	pi->free_index = 1;
+	pi = zalloc(sizeof *pi);
+	pi->set = set;
+	pi->index_array = index;
+	list_iterator_init_list(&pi->index, index);
 
 	return pi;
 }
@@ -21,80 +21,202 @@
 #include "razor-internal.h"
 #include "razor.h"
 
-#define UPSTREAM_SOURCE 0x80
-
 struct source {
 	struct razor_set *set;
 	uint32_t *property_map;
 	uint32_t *file_map;
+	uint32_t *keys;
+	struct razor_file_name_cursor names;
 };
 
 struct razor_merger {
 	struct razor_set *set;
 	struct hashtable table;
-	struct source source1;
-	struct source source2;
+	struct hashtable file_table;
+	struct hashtable details_table;
+	struct source *sources;
+	int source_count;
+	struct array package_sources;
+	int sorted;
+	int seeded;
+	int error;
 };
 
+/* Start out with the string pool and hash table of set, if it has
+ * saved its hash table.  The strings of set then keep their offsets
+ * in the new set and never need to be looked up. */
+static void
+seed_string_pool(struct razor_merger *merger, struct razor_set *set)
+{
+	struct array *pool = &merger->set->string_pool;
+
+	array_release(pool);
+	array_init(pool);
+	memcpy(array_add(pool, set->string_pool.size),
+	       set->string_pool.data, set->string_pool.size);
+
+	if (hashtable_init_with_index(&merger->table, pool,
+				      &set->string_index) == 0) {
+		merger->seeded = 1;
+		return;
+	}
+
+	pool->size = 1;
+	hashtable_init(&merger->table, pool);
+}
+
+static uint32_t
+tokenize(struct razor_merger *merger, struct razor_set *set, uint32_t string)
+{
+	if (merger->seeded && set == merger->sources[0].set)
+		return string;
+
+	return hashtable_tokenize(&merger->table,
+				  (const char *) set->string_pool.data + string);
+}
+
+/* Create a merger for the packages of several sets.  The string pool
+ * of the first set seeds the pool of the new set, and packages that
+ * are in more than one of the sets are taken from the first. */
 struct razor_merger *
-razor_merger_create(struct razor_set *set1, struct razor_set *set2)
+razor_merger_create_for_sets(struct razor_set **sets, int count)
 {
 	struct razor_merger *merger;
-	int count;
+	struct razor_set *set, *base;
+	struct source *source;
+	uint32_t flags;
+	int i;
 	size_t size;
 
 	merger = zalloc(sizeof *merger);
 	merger->set = razor_set_create();
-	hashtable_init(&merger->table, &merger->set->string_pool);
-
-	merger->source1.set = set1;
-	count = set1->properties.size / sizeof (struct razor_property);
-	size = count * sizeof merger->source1.property_map[0];
-	merger->source1.property_map = zalloc(size);
-	count = set1->files.size / sizeof (struct razor_entry);
-	size = count * sizeof merger->source1.file_map[0];
-	merger->source1.file_map = zalloc(size);
-
-	merger->source2.set = set2;
-	count = set2->properties.size / sizeof (struct razor_property);
-	size = count * sizeof merger->source2.property_map[0];
-	merger->source2.property_map = zalloc(size);
-	count = set2->files.size / sizeof (struct razor_entry);
-	size = count * sizeof merger->source2.file_map[0];
-	merger->source2.file_map = zalloc(size);
+	merger->sources = zalloc(count * sizeof *merger->sources);
+	merger->source_count = count;
+	array_init(&merger->package_sources);
+
+	flags = 0;
+	for (i = 0; i < count; i++)
+		flags |= sets[i]->flags;
+	merger->set->flags = flags &
+		(RAZOR_SET_HUGE_PAGE_ALIGNED | RAZOR_SET_PACKED_LISTS |
+		 RAZOR_SET_STRING_INDEX | RAZOR_SET_VERSION_KEYS);
+	if (sets[0]->string_index.size > 0)
+		seed_string_pool(merger, sets[0]);
+	else
+		hashtable_init(&merger->table, &merger->set->string_pool);
+	hashtable_init(&merger->file_table, &merger->set->file_string_pool);
+	hashtable_init(&merger->details_table,
+		       &merger->set->details_string_pool);
+	*(char *) array_add(&merger->set->file_string_pool, 1) = '\0';
+
+	flags = RAZOR_SET_SORTED_STRING_POOL;
+	base = sets[0];
+	for (i = 0; i < count; i++) {
+		set = sets[i];
+		source = &merger->sources[i];
+
+		/* Without the file lists of all the sets there's no
+		 * way to build the new one, so the merge fails in
+		 * razor_merger_finish(). */
+		if (razor_set_bind_files(set) < 0)
+			merger->error = 1;
+
+		source->set = set;
+		razor_file_name_cursor_init(&source->names, set);
+		size = set->properties.size / sizeof (struct razor_property);
+		source->property_map =
+			zalloc(size * sizeof source->property_map[0]);
+		size = set->files.size / sizeof (struct razor_entry);
+		source->file_map = zalloc(size * sizeof source->file_map[0]);
+
+		flags &= set->flags;
+		if (set->string_pool.size > base->string_pool.size)
+			base = set;
+	}
+
+	/* If all the string pools are sorted, map the strings of the
+	 * other pools into the offset space of the biggest one, so
+	 * that merging the properties only compares integers. */
+	if (flags & RAZOR_SET_SORTED_STRING_POOL) {
+		merger->sorted = 1;
+		for (i = 0; i < count; i++) {
+			source = &merger->sources[i];
+			if (source->set != base)
+				source->keys =
+					razor_string_pool_map_keys(&source->set->string_pool,
+								   &base->string_pool);
+		}
+	}
 
 	return merger;
 }
 
+struct razor_merger *
+razor_merger_create(struct razor_set *set1, struct razor_set *set2)
+{
+	struct razor_set *sets[2];
+
+	sets[0] = set1;
+	sets[1] = set2;
+
+	return razor_merger_create_for_sets(sets, 2);
+}
+
+static void
+add_details(struct razor_merger *merger, struct razor_set *set,
+	    struct razor_package *package)
+{
+	struct razor_package_details *d;
+	const char *summary, *description, *url, *license;
+
+	razor_package_get_details(set, package,
+				  RAZOR_DETAIL_SUMMARY, &summary,
+				  RAZOR_DETAIL_DESCRIPTION, &description,
+				  RAZOR_DETAIL_URL, &url,
+				  RAZOR_DETAIL_LICENSE, &license,
+				  RAZOR_DETAIL_LAST);
+
+	d = array_add(&merger->set->package_details, sizeof *d);
+	d->summary = hashtable_tokenize(&merger->details_table, summary);
+	d->description =
+		hashtable_tokenize(&merger->details_table, description);
+	d->url = hashtable_tokenize(&merger->details_table, url);
+	d->license = hashtable_tokenize(&merger->details_table, license);
+}
+
 void
 razor_merger_add_package(struct razor_merger *merger,
 			 struct razor_package *package)
 {
-	char *pool;
 	struct list *r;
+	struct list_iterator li;
 	struct razor_package *p;
-	struct razor_set *set1;
+	struct razor_set *set;
 	struct source *source;
-	uint32_t flags;
+	uint32_t file, *index;
+	int i;
+
+	if (merger->error)
+		return;
 
-	set1 = merger->source1.set;
-	if (set1->packages.data <= (void *) package &&
-	    (void *) package < set1->packages.data + set1->packages.size) {
-		source = &merger->source1;
-		flags = 0;
-	} else {
-		source = &merger->source2;
-		flags = UPSTREAM_SOURCE;
+	for (i = 0; i < merger->source_count - 1; i++) {
+		set = merger->sources[i].set;
+		if (set->packages.data <= (void *) package &&
+		    (void *) package < set->packages.data + set->packages.size)
+			break;
 	}
+	source = &merger->sources[i];
+
+	index = array_add(&merger->package_sources, sizeof *index);
+	*index = i;
 
-	pool = source->set->string_pool.data;
 	p = array_add(&merger->set->packages, sizeof *p);
-	p->name = hashtable_tokenize(&merger->table, &pool[package->name]);
-	p->flags = flags;
-	p->version = hashtable_tokenize(&merger->table,
-					&pool[package->version]);
-	p->arch = hashtable_tokenize(&merger->table,
-				     &pool[package->arch]);
+	p->name = tokenize(merger, source->set, package->name);
+	p->flags = 0;
+	p->version = tokenize(merger, source->set, package->version);
+	p->arch = tokenize(merger, source->set, package->arch);
+
+	add_details(merger, source->set, package);
 
 	p->properties = package->properties;
 	r = list_first(&package->properties, &source->set->property_pool);
@@ -104,107 +226,154 @@ razor_merger_add_package(struct razor_merger *merger,
 	}
 
 	p->files = package->files;
-	r = list_first(&package->files, &source->set->file_pool);
-	while (r) {
-		source->file_map[r->data] = 1;
-		r = list_next(r);
-	}
+	list_iterator_init(&li, &package->files, &source->set->file_pool);
+	while (list_iterator_next(&li, &file))
+		source->file_map[file] = 1;
 }
 
 static uint32_t
 add_property(struct razor_merger *merger,
-	     const char *name, uint32_t flags, const char *version)
+	     struct razor_set *set, struct razor_property *property)
 {
 	struct razor_property *p;
 
 	p = array_add(&merger->set->properties, sizeof *p);
-	p->name = hashtable_tokenize(&merger->table, name);
-	p->flags = flags;
-	p->version = hashtable_tokenize(&merger->table, version);
+	p->name = tokenize(merger, set, property->name);
+	p->flags = property->flags;
+	p->version = tokenize(merger, set, property->version);
 
 	return p - (struct razor_property *) merger->set->properties.data;
 }
 
+/* Compare names from the string pools of two sources.  Keys only
+ * order strings against the pool they were mapped into, so two pools
+ * that both have keys still go through strcmp. */
+static int
+compare_source_names(struct razor_merger *merger,
+		     struct source *s1, uint32_t name1,
+		     struct source *s2, uint32_t name2)
+{
+	const char *pool1, *pool2;
+	uint32_t key1, key2;
+
+	if (!merger->sorted || (s1->keys && s2->keys)) {
+		pool1 = s1->set->string_pool.data;
+		pool2 = s2->set->string_pool.data;
+		return strcmp(&pool1[name1], &pool2[name2]);
+	}
+
+	key1 = razor_string_key(s1->keys, name1);
+	key2 = razor_string_key(s2->keys, name2);
+
+	return key1 < key2 ? -1 : key1 > key2;
+}
+
+static int
+compare_source_properties(struct razor_merger *merger,
+			  struct source *s1, struct razor_property *p1,
+			  struct source *s2, struct razor_property *p2)
+{
+	const char *pool1, *pool2;
+	int cmp;
+
+	cmp = compare_source_names(merger, s1, p1->name, s2, p2->name);
+	if (cmp == 0)
+		cmp = (p1->flags & RAZOR_PROPERTY_TYPE_MASK) -
+			(p2->flags & RAZOR_PROPERTY_TYPE_MASK);
+	if (cmp == 0)
+		cmp = p1->flags - p2->flags;
+	if (cmp == 0) {
+		pool1 = s1->set->string_pool.data;
+		pool2 = s2->set->string_pool.data;
+		cmp = razor_versioncmp(&pool1[p1->version],
+				       &pool2[p2->version]);
+	}
+
+	return cmp;
+}
+
+/* Skip the properties of source that no package uses and return the
+ * next one that is, or NULL. */
+static struct razor_property *
+source_next_property(struct source *source, uint32_t *index)
+{
+	struct razor_property *properties;
+	uint32_t count;
+
+	properties = source->set->properties.data;
+	count = source->set->properties.size / sizeof *properties;
+	while (*index < count && source->property_map[*index] == 0)
+		(*index)++;
+
+	return *index < count ? &properties[*index] : NULL;
+}
+
 static void
 merge_properties(struct razor_merger *merger)
 {
-	struct razor_property *p1, *p2;
-	struct razor_set *set1, *set2;
-	uint32_t *map1, *map2;
-	int i, j, cmp, count1, count2;
-	char *pool1, *pool2;
-
-	set1 = merger->source1.set;
-	set2 = merger->source2.set;
-	map1 = merger->source1.property_map;
-	map2 = merger->source2.property_map;
-
-	i = 0;
-	j = 0;
-	pool1 = set1->string_pool.data;
-	pool2 = set2->string_pool.data;
-
-	count1 = set1->properties.size / sizeof *p1;
-	count2 = set2->properties.size / sizeof *p2;
-	while (i < count1 || j < count2) {
-		if (i < count1 && map1[i] == 0) {
-			i++;
-			continue;
-		}
-		if (j < count2 && map2[j] == 0) {
-			j++;
-			continue;
+	struct razor_property **heads, *p;
+	struct source *source, *min;
+	uint32_t *index, property;
+	int i;
+
+	heads = zalloc(merger->source_count * sizeof *heads);
+	index = zalloc(merger->source_count * sizeof *index);
+	for (i = 0; i < merger->source_count; i++)
+		heads[i] = source_next_property(&merger->sources[i],
+						&index[i]);
+
+	/* A property that is in more than one set becomes one
+	 * property of the new set, which all of them map to. */
+	for (;;) {
+		min = NULL;
+		p = NULL;
+		for (i = 0; i < merger->source_count; i++) {
+			source = &merger->sources[i];
+			if (heads[i] == NULL)
+				continue;
+			if (min == NULL ||
+			    compare_source_properties(merger, source, heads[i],
+						      min, p) < 0) {
+				min = source;
+				p = heads[i];
+			}
 		}
-		p1 = (struct razor_property *) set1->properties.data + i;
-		p2 = (struct razor_property *) set2->properties.data + j;
-		if (i < count1 && j < count2)
-			cmp = strcmp(&pool1[p1->name], &pool2[p2->name]);
-		else if (i < count1)
-			cmp = -1;
-		else
-			cmp = 1;
-		if (cmp == 0)
-			cmp = p1->flags - p2->flags;
-		if (cmp == 0)
-			cmp = razor_versioncmp(&pool1[p1->version],
-					       &pool2[p2->version]);
-		if (cmp < 0) {
-			map1[i++] = add_property(merger,
-						 &pool1[p1->name],
-						 p1->flags,
-						 &pool1[p1->version]);
-		} else if (cmp > 0) {
-			map2[j++] = add_property(merger,
-						 &pool2[p2->name],
-						 p2->flags,
-						 &pool2[p2->version]);
-		} else  {
-			map1[i++] = map2[j++] =
-				add_property(merger,
-					     &pool1[p1->name],
-					     p1->flags,
-					     &pool1[p1->version]);
+		if (min == NULL)
+			break;
+
+		property = add_property(merger, min->set, p);
+		for (i = 0; i < merger->source_count; i++) {
+			source = &merger->sources[i];
+			if (heads[i] == NULL ||
+			    (source != min &&
+			     compare_source_properties(merger, source, heads[i],
+						       min, p) != 0))
+				continue;
+			source->property_map[index[i]++] = property;
+			heads[i] = source_next_property(source, &index[i]);
 		}
 	}
+
+	free(heads);
+	free(index);
 }
 
 static void
 emit_properties(struct list_head *properties, struct array *source_pool,
 		uint32_t *map, struct array *pool)
 {
-	uint32_t r;
-	struct list *p, *q;
-
-	r = pool->size / sizeof *q;
-	p = list_first(properties, source_pool);
-	while (p) {
-		q = array_add(pool, sizeof *q);
-		q->data = map[p->data];
-		q->flags = p->flags;
-		p = list_next(p);
-	}
-
-	list_set_ptr(properties, r);
+	struct list_iterator li;
+	struct array items;
+	uint32_t property;
+
+	array_init(&items);
+	list_iterator_init(&li, properties, source_pool);
+	while (list_iterator_next(&li, &property))
+		*(uint32_t *) array_add(&items, sizeof property) =
+			map[property];
+
+	list_set_array(properties, pool, &items, 0);
+	array_release(&items);
 }
 
 static uint32_t
@@ -213,7 +382,7 @@ add_file(struct razor_merger *merger, const char *name)
 	struct razor_entry *e;
 
 	e = array_add(&merger->set->files, sizeof *e);
-	e->name = hashtable_tokenize(&merger->table, name);
+	e->name = hashtable_tokenize(&merger->file_table, name);
 	e->flags = 0;
 	e->start = 0;
 
@@ -242,168 +411,139 @@ fix_file_map(uint32_t *map,
 	return found_file;
 }
 
-struct merge_directory {
-	uint32_t merged, dir1, dir2;
-};
-
+/* Merge the entries of the directories dirs, one per source, into
+ * the directory merged of the new set, and then their children.  A
+ * dirs entry of 0 means the source doesn't have that directory. */
 static void
-merge_one_directory(struct razor_merger *merger, struct merge_directory *md)
+merge_one_directory(struct razor_merger *merger,
+		    uint32_t merged, uint32_t *dirs)
 {
-	struct razor_entry *root1, *root2, *mroot, *e1, *e2;
-	struct razor_set *set1, *set2;
-	struct array merge_stack;
-	struct merge_directory *child_md, *end_md;
-	uint32_t *map1, *map2, start, last;
-	int cmp;
-	char *pool1, *pool2;
-
-	set1 = merger->source1.set;
-	set2 = merger->source2.set;
-	map1 = merger->source1.file_map;
-	map2 = merger->source2.file_map;
-	pool1 = set1->file_string_pool.data;
-	pool2 = set2->file_string_pool.data;
-	root1 = (struct razor_entry *) set1->files.data;
-	root2 = (struct razor_entry *) set2->files.data;
+	struct razor_entry **entries, *root, *mroot, *e;
+	struct source *source;
+	struct array merge_stack, child_dirs;
+	uint32_t *child, *end, *d, start, last;
+	const char **names, *min;
+	int i, n, count, has_children;
+
+	count = merger->source_count;
+	entries = zalloc(count * sizeof *entries);
+	names = zalloc(count * sizeof *names);
+	for (i = 0; i < count; i++) {
+		root = (struct razor_entry *) merger->sources[i].set->files.data;
+		entries[i] = dirs[i] ? root + dirs[i] : NULL;
+	}
 
 	array_init(&merge_stack);
+	array_init(&child_dirs);
 
 	start = merger->set->files.size / sizeof (struct razor_entry);
 	last = 0;
-	e1 = md->dir1 ? root1 + md->dir1 : NULL;
-	e2 = md->dir2 ? root2 + md->dir2 : NULL;
-	while (e1 || e2) {
-		if (!e2 && !map1[e1 - root1]) {
-			if ((e1++)->flags & RAZOR_ENTRY_LAST)
-				e1 = NULL;
-			continue;
-		}
-		if (!e1 && !map2[e2 - root2]) {
-			if ((e2++)->flags & RAZOR_ENTRY_LAST)
-				e2 = NULL;
-			continue;
-		}
-		if (e1 && !map1[e1 - root1] &&
-		    e2 && !map2[e2 - root2]) {
-			if ((e1++)->flags & RAZOR_ENTRY_LAST)
-				e1 = NULL;
-			if ((e2++)->flags & RAZOR_ENTRY_LAST)
-				e2 = NULL;
-			continue;
-		}
+	for (;;) {
+		/* Skip the entries that no package has, and find the
+		 * smallest name among the rest. */
+		min = NULL;
+		for (i = 0; i < count; i++) {
+			source = &merger->sources[i];
+			root = (struct razor_entry *) source->set->files.data;
+			while (entries[i] && !source->file_map[entries[i] - root]) {
+				if ((entries[i]++)->flags & RAZOR_ENTRY_LAST)
+					entries[i] = NULL;
+			}
+			if (entries[i] == NULL)
+				continue;
 
-		if (!e1)
-			cmp = 1;
-		else if (!e2)
-			cmp = -1;
-		else {
-			cmp = strcmp (&pool1[e1->name],
-				      &pool2[e2->name]);
+			names[i] = razor_file_name_cursor_get(&source->names,
+							      entries[i]->name);
+			if (min == NULL || strcmp(names[i], min) < 0)
+				min = names[i];
 		}
-
-		if (cmp < 0) {
-			if (map1[e1 - root1]) {
-				map1[e1 - root1] = last =
-					add_file(merger, &pool1[e1->name]);
-				if (e1->start) {
-					child_md = array_add(&merge_stack, sizeof (struct merge_directory));
-					child_md->merged = last;
-					child_md->dir1 = e1->start;
-					child_md->dir2 = 0;
-				}
-			}
-			if ((e1++)->flags & RAZOR_ENTRY_LAST)
-				e1 = NULL;
-		} else if (cmp > 0) {
-			if (map2[e2 - root2]) {
-				map2[e2 - root2] = last =
-					add_file(merger, &pool2[e2->name]);
-				if (e2->start) {
-					child_md = array_add(&merge_stack, sizeof (struct merge_directory));
-					child_md->merged = last;
-					child_md->dir1 = 0;
-					child_md->dir2 = e2->start;
-				}
-			}
-			if ((e2++)->flags & RAZOR_ENTRY_LAST)
-				e2 = NULL;
-		} else {
-			map1[e1 - root1] = map2[e2- root2] = last =
-				add_file(merger, &pool1[e1->name]);
-			if (e1->start || e2->start) {
-				child_md = array_add(&merge_stack, sizeof (struct merge_directory));
-				child_md->merged = last;
-				child_md->dir1 = e1->start;
-				child_md->dir2 = e2->start;
-			}
-			if ((e1++)->flags & RAZOR_ENTRY_LAST)
-				e1 = NULL;
-			if ((e2++)->flags & RAZOR_ENTRY_LAST)
-				e2 = NULL;
+		if (min == NULL)
+			break;
+
+		last = add_file(merger, min);
+		d = array_add(&child_dirs, count * sizeof *d);
+		has_children = 0;
+		for (i = 0; i < count; i++) {
+			d[i] = 0;
+			if (entries[i] == NULL || strcmp(names[i], min) != 0)
+				continue;
+
+			source = &merger->sources[i];
+			root = (struct razor_entry *) source->set->files.data;
+			e = entries[i];
+			source->file_map[e - root] = last;
+			d[i] = e->start;
+			if (e->start)
+				has_children = 1;
+			if (e->flags & RAZOR_ENTRY_LAST)
+				entries[i] = NULL;
+			else
+				entries[i]++;
 		}
+
+		if (has_children)
+			*(uint32_t *) array_add(&merge_stack, sizeof last) = last;
+		else
+			child_dirs.size -= count * sizeof *d;
 	}
 
 	mroot = (struct razor_entry *)merger->set->files.data;
 	if (last) {
 		mroot[last].flags = RAZOR_ENTRY_LAST;
-		mroot[md->merged].start = start;
+		mroot[merged].start = start;
 	} else
-		mroot[md->merged].start = 0;
+		mroot[merged].start = 0;
+
+	free(entries);
+	free(names);
 
-	end_md = merge_stack.data + merge_stack.size;
-	for (child_md = merge_stack.data; child_md < end_md; child_md++)
-		merge_one_directory(merger, child_md);
+	n = 0;
+	end = merge_stack.data + merge_stack.size;
+	for (child = merge_stack.data; child < end; child++, n++)
+		merge_one_directory(merger, *child,
+				    (uint32_t *) child_dirs.data + n * count);
 	array_release(&merge_stack);
+	array_release(&child_dirs);
 }
 
 static void
 merge_files(struct razor_merger *merger)
 {
 	struct razor_entry *root;
-	struct merge_directory md;
-	uint32_t *map1, *map2;
-
-	map1 = merger->source1.file_map;
-	map2 = merger->source2.file_map;
-
-	md.merged = 0;
-
-	if (merger->source1.set->files.size) {
-		root = (struct razor_entry *) merger->source1.set->files.data;
-		if (root->start)
-			fix_file_map(map1, root, root);
-		md.dir1 = root->start;
-	} else
-		md.dir1 = 0;
+	struct source *source;
+	uint32_t *dirs;
+	int i;
 
-	if (merger->source2.set->files.size) {
-		root = (struct razor_entry *) merger->source2.set->files.data;
+	dirs = zalloc(merger->source_count * sizeof *dirs);
+	for (i = 0; i < merger->source_count; i++) {
+		source = &merger->sources[i];
+		if (source->set->files.size == 0)
+			continue;
+		root = (struct razor_entry *) source->set->files.data;
 		if (root->start)
-			fix_file_map(map2, root, root);
-		md.dir2 = root->start;
-	} else
-		md.dir2 = 0;
+			fix_file_map(source->file_map, root, root);
+		dirs[i] = root->start;
+	}
 
-	merge_one_directory(merger, &md);
+	merge_one_directory(merger, 0, dirs);
+	free(dirs);
 }
 
 static void
 emit_files(struct list_head *files, struct array *source_pool,
 	   uint32_t *map, struct array *pool)
 {
-	uint32_t r;
-	struct list *p, *q;
-
-	r = pool->size / sizeof *q;
-	p = list_first(files, source_pool);
-	while (p) {
-		q = array_add(pool, sizeof *q);
-		q->data = map[p->data];
-		q->flags = p->flags;
-		p = list_next(p);
-	}
+	struct list_iterator li;
+	struct array items;
+	uint32_t file;
+
+	array_init(&items);
+	list_iterator_init(&li, files, source_pool);
+	while (list_iterator_next(&li, &file))
+		*(uint32_t *) array_add(&items, sizeof file) = map[file];
 
-	list_set_ptr(files, r);
+	list_set_array(files, pool, &items, 0);
+	array_release(&items);
 }
 
 /* Rebuild property->packages maps.  We can't just remap these, as a
@@ -474,11 +614,15 @@ rebuild_file_package_lists(struct razor_set *set)
 	free(pkgs);
 }
 
+/* Build the merged set and free the merger.  Returns NULL if the
+ * files of one of the sets couldn't be read. */
 struct razor_set *
 razor_merger_finish(struct razor_merger *merger)
 {
 	struct razor_set *result;
 	struct razor_package *p, *pend;
+	uint32_t *ranks, *index, flags;
+	int i, rebuilt;
 
 	/* As we built the package list, we filled out a bitvector of
 	 * the properties that are referenced by the packages in the
@@ -488,6 +632,12 @@ razor_merger_finish(struct razor_merger *merger)
 	 * indices in the old property list to indices in the new
 	 * property list for both sets. */
 
+	if (merger->error) {
+		razor_set_destroy(merger->set);
+		result = NULL;
+		goto out;
+	}
+
 	merge_properties(merger);
 	merge_files(merger);
 
@@ -495,13 +645,9 @@ razor_merger_finish(struct razor_merger *merger)
 	 * property lists, remapped to point to the new properties. */
 
 	pend = merger->set->packages.data + merger->set->packages.size;
-	for (p = merger->set->packages.data; p < pend; p++) {
-		struct source *src;
-
-		if (p->flags & UPSTREAM_SOURCE)
-			src = &merger->source2;
-		else
-			src = &merger->source1;
+	index = merger->package_sources.data;
+	for (p = merger->set->packages.data; p < pend; p++, index++) {
+		struct source *src = &merger->sources[*index];
 
 		emit_properties(&p->properties,
 				&src->set->property_pool,
@@ -511,14 +657,52 @@ razor_merger_finish(struct razor_merger *merger)
 			   &src->set->file_pool,
 			   src->file_map,
 			   &merger->set->file_pool);
-		p->flags &= ~UPSTREAM_SOURCE;
 	}
 
 	rebuild_property_package_lists(merger->set);
 	rebuild_file_package_lists(merger->set);
+	razor_set_build_property_names(merger->set);
+	/* A seeded pool still has the strings of the packages of set1
+	 * that didn't make it.  A compacted or sorted pool gets new
+	 * offsets, so the table has to be built again; otherwise the
+	 * one we merged with is still good. */
+	rebuilt = merger->sorted;
+	if (merger->seeded && razor_set_compact_string_pool(merger->set))
+		rebuilt = 1;
+	if (merger->sorted)
+		razor_set_sort_string_pool(merger->set);
+	if (merger->set->flags & RAZOR_SET_STRING_INDEX) {
+		if (rebuilt)
+			razor_set_build_string_index(merger->set);
+		else
+			hashtable_take_index(&merger->table,
+					     &merger->set->string_index);
+	}
+	ranks = razor_set_rank_versions(merger->set);
+	razor_set_build_version_ranks(merger->set, ranks);
+	free(ranks);
+	razor_set_compact_lists(merger->set);
+	flags = 0;
+	for (i = 0; i < merger->source_count; i++)
+		flags |= merger->sources[i].set->flags;
+	if (flags & RAZOR_SET_FRONT_CODED_FILES)
+		razor_set_front_code_file_names(merger->set);
+	if (flags & RAZOR_SET_COMPRESSED_DETAILS)
+		razor_set_compress_details(merger->set);
 
 	result = merger->set;
+out:
 	hashtable_release(&merger->table);
+	hashtable_release(&merger->file_table);
+	hashtable_release(&merger->details_table);
+	for (i = 0; i < merger->source_count; i++) {
+		free(merger->sources[i].property_map);
+		free(merger->sources[i].file_map);
+		free(merger->sources[i].keys);
+		razor_file_name_cursor_release(&merger->sources[i].names);
+	}
+	free(merger->sources);
+	array_release(&merger->package_sources);
 	free(merger);
 
 	return result;
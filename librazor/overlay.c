@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2008  Kristian Høgsberg <krh@redhat.com>
+ * Copyright (C) 2008  Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "razor-internal.h"
+#include "razor.h"
+
+/* Mark the packages of layer that a higher layer has a package of
+ * the same name and arch for. */
+static void
+hide_packages(struct razor_set *overlay, uint32_t layer)
+{
+	struct razor_set *set, *upper;
+	struct razor_package *packages, *p, *end, *q, *qstart, *qend;
+	const char *pool, *upper_pool;
+	char *hidden;
+	uint32_t i;
+
+	set = overlay->layers[layer].set;
+	hidden = overlay->layers[layer].hidden;
+	pool = set->string_pool.data;
+	packages = set->packages.data;
+	end = set->packages.data + set->packages.size;
+	for (p = packages; p < end; p++) {
+		for (i = layer + 1; i < overlay->layer_count; i++) {
+			upper = overlay->layers[i].set;
+			upper_pool = upper->string_pool.data;
+			razor_set_find_package_range(upper, &pool[p->name],
+						     strlen(&pool[p->name]) + 1,
+						     &qstart, &qend);
+			for (q = qstart; q < qend; q++)
+				if (!strcmp(&pool[p->arch],
+					    &upper_pool[q->arch]))
+					break;
+			if (q < qend) {
+				hidden[p - packages] = 1;
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * razor_set_create_overlay:
+ * @sets: the sets to stack, bottom first
+ * @count: the number of sets
+ *
+ * Create a view of a stack of package sets, typically a read-only
+ * base set with a small local set on top.  The view holds the
+ * packages of all the sets, except that a package of a given name
+ * and arch hides those of the same name and arch in the sets below
+ * it.  Nothing is merged; the package and property iterators, file
+ * lookups, razor_set_get_package() and razor_set_diff() go through
+ * the sets as they are.  Properties aren't merged either: one that
+ * several sets have is returned once for each of them, and a
+ * property only the hidden packages have isn't returned at all.
+ * The returned set doesn't own @sets, which
+ * must outlive it.  Use razor_set_compact_overlay() to turn it into
+ * a plain set.
+ *
+ * Returns: the new overlay %razor_set.
+ **/
+RAZOR_EXPORT struct razor_set *
+razor_set_create_overlay(struct razor_set **sets, int count)
+{
+	struct razor_set *overlay;
+	size_t size;
+	int i;
+
+	assert (sets != NULL);
+	assert (count > 0);
+
+	overlay = zalloc(sizeof *overlay);
+	overlay->layers = zalloc(count * sizeof *overlay->layers);
+	overlay->layer_count = count;
+	for (i = 0; i < count; i++) {
+		assert (sets[i]->layers == NULL);
+		overlay->layers[i].set = sets[i];
+		size = sets[i]->packages.size / sizeof (struct razor_package);
+		overlay->layers[i].hidden = zalloc(size + 1);
+	}
+
+	for (i = 0; i < count - 1; i++)
+		hide_packages(overlay, i);
+
+	return overlay;
+}
+
+/* Return the index of the layer whose array at offset holds p, or
+ * -1 if there's none. */
+int
+razor_set_find_layer(struct razor_set *set, void *p, size_t offset)
+{
+	struct array *array;
+	uint32_t i;
+
+	for (i = 0; i < set->layer_count; i++) {
+		array = (void *) set->layers[i].set + offset;
+		if (array->data <= p && p < array->data + array->size)
+			return i;
+	}
+
+	return -1;
+}
+
+struct razor_set *
+razor_set_get_package_layer(struct razor_set *set,
+			    struct razor_package *package)
+{
+	int i;
+
+	if (set->layers == NULL)
+		return set;
+
+	i = razor_set_find_layer(set, package,
+				 offsetof(struct razor_set, packages));
+
+	return i < 0 ? set : set->layers[i].set;
+}
+
+struct razor_set *
+razor_set_get_property_layer(struct razor_set *set,
+			     struct razor_property *property)
+{
+	int i;
+
+	if (set->layers == NULL)
+		return set;
+
+	i = razor_set_find_layer(set, property,
+				 offsetof(struct razor_set, properties));
+
+	return i < 0 ? set : set->layers[i].set;
+}
+
+/* A property is only part of the overlay if one of the packages that
+ * have it is. */
+int
+razor_layer_property_is_visible(struct razor_layer *layer,
+				struct razor_property *property)
+{
+	struct list_iterator li;
+	uint32_t index;
+
+	list_iterator_init(&li, &property->packages,
+			   &layer->set->package_pool);
+	while (list_iterator_next(&li, &index))
+		if (!layer->hidden[index])
+			return 1;
+
+	return 0;
+}
+
+static struct razor_set *
+merge_layer(struct razor_set *base, struct razor_layer *layer)
+{
+	struct razor_merger *merger;
+	struct razor_package *b, *bend, *l, *lend;
+	const char *bpool, *lpool;
+	int cmp;
+
+	if (base == NULL)
+		base = layer->set;
+
+	merger = razor_merger_create(base, layer->set);
+
+	bpool = base->string_pool.data;
+	lpool = layer->set->string_pool.data;
+	b = base->packages.data;
+	bend = base->packages.data + base->packages.size;
+	if (base == layer->set)
+		b = bend;
+	l = layer->set->packages.data;
+	lend = layer->set->packages.data + layer->set->packages.size;
+
+	while (b < bend || l < lend) {
+		if (l < lend && razor_layer_package_is_hidden(layer, l)) {
+			l++;
+			continue;
+		}
+
+		if (b < bend && l < lend) {
+			cmp = strcmp(&bpool[b->name], &lpool[l->name]);
+			if (cmp == 0)
+				cmp = razor_versioncmp(&bpool[b->version],
+						       &lpool[l->version]);
+		} else if (b < bend) {
+			cmp = -1;
+		} else {
+			cmp = 1;
+		}
+
+		if (cmp <= 0)
+			razor_merger_add_package(merger, b++);
+		else
+			razor_merger_add_package(merger, l++);
+	}
+
+	return razor_merger_finish(merger);
+}
+
+/**
+ * razor_set_compact_overlay:
+ * @overlay: an overlay %razor_set
+ *
+ * Merge the packages of @overlay that aren't hidden into a new,
+ * plain package set, for when the top layers have grown too large
+ * to be worth keeping apart.  The result can be written out with
+ * razor_set_write() and used as the new base.
+ *
+ * Returns: the new %razor_set, or %NULL if the files of one of the
+ * sets are corrupt.
+ **/
+RAZOR_EXPORT struct razor_set *
+razor_set_compact_overlay(struct razor_set *overlay)
+{
+	struct razor_set *set, *merged;
+	uint32_t i;
+
+	assert (overlay != NULL);
+	assert (overlay->layers != NULL);
+
+	set = NULL;
+	for (i = 0; i < overlay->layer_count; i++) {
+		merged = merge_layer(set, &overlay->layers[i]);
+		if (set != NULL)
+			razor_set_destroy(set);
+		if (merged == NULL)
+			return NULL;
+		set = merged;
+	}
+
+	return set;
+}
@@ -22,7 +22,9 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 
 #include "razor.h"
 
@@ -48,16 +50,22 @@ void array_release(struct array *array);
 void *array_add(struct array *array, int size);
 
 
+/* A list head is either a pointer into a pool of list entries, a
+ * single immediate entry, or empty.  The flag bit marks the last
+ * entry of a list; a head with the flag set is an immediate entry,
+ * or the empty list if the pointer is all ones. */
 struct list_head {
-	uint32_t list_ptr : 24;
-	uint32_t flags    : 8;
+	uint32_t list_ptr : 31;
+	uint32_t flags    : 1;
 };
 
 struct list {
-	uint32_t data  : 24;
-	uint32_t flags : 8;
+	uint32_t data  : 31;
+	uint32_t flags : 1;
 };
 
+#define RAZOR_LIST_LAST	0x01
+
 void list_set_empty(struct list_head *head);
 void list_set_ptr(struct list_head *head, uint32_t ptr);
 void list_set_array(struct list_head *head, struct array *pool, struct array *items, int force_indirect);
@@ -68,59 +76,236 @@ struct list *list_next(struct list *list);
 void list_remap_pool(struct array *pool, uint32_t *map);
 void list_remap_head(struct list_head *list, uint32_t *map);
 
+/* A packed list is a head without the immediate flag and with
+ * RAZOR_PACKED_LIST set in the pointer.  The rest of the pointer is
+ * the offset of a block in the pool holding the number of entries,
+ * followed by one control byte per group of four entries and the
+ * zigzag encoded deltas between consecutive entries, each stored in
+ * the number of bytes given by two bits of the control byte.  Packed
+ * lists can only be read through a list iterator, not list_first(). */
+#define RAZOR_PACKED_LIST	0x40000000
+#define RAZOR_PACKED_LIST_MIN	8
+#define RAZOR_LIST_BATCH	16
+
+void list_set_packed(struct list_head *head, struct array *pool, struct array *items);
+
+struct list_iterator {
+	struct list *list;
+	const uint8_t *control, *data;
+	uint32_t remaining, last;
+	uint32_t index, count;
+	uint32_t buffer[RAZOR_LIST_BATCH];
+};
+
+void list_iterator_init(struct list_iterator *li, struct list_head *head, struct array *pool);
+void list_iterator_init_list(struct list_iterator *li, struct list *list);
+uint32_t list_iterator_decode(struct list_iterator *li);
+
+static inline int
+list_iterator_next(struct list_iterator *li, uint32_t *data)
+{
+	if (li->index == li->count) {
+		if (li->list) {
+			*data = li->list->data;
+			li->list = list_next(li->list);
+			return 1;
+		}
+		if (li->remaining == 0 || list_iterator_decode(li) == 0)
+			return 0;
+	}
+
+	*data = li->buffer[li->index++];
+
+	return 1;
+}
+
+/* A list table finds lists already stored in a pool, so that equal
+ * lists can share one range of the pool. */
+struct list_bucket {
+	uint32_t hash;
+	struct list_head head;
+};
+
+struct list_table {
+	struct list_bucket *buckets;
+	uint32_t size, count;
+	struct array *pool;
+};
+
+void list_table_init(struct list_table *table, struct array *pool);
+void list_table_release(struct list_table *table);
+void list_table_set_array(struct list_table *table, struct list_head *head,
+			  struct array *items, int packed);
+
+
+struct hashtable_slot {
+	uint32_t hash;
+	uint32_t value;
+};
 
 struct hashtable {
-	struct array buckets;
+	uint8_t *tags;
+	struct hashtable_slot *slots;
+	uint32_t size, count;
 	struct array *pool;
 };
 
 void hashtable_init(struct hashtable *table, struct array *pool);
 void hashtable_release(struct hashtable *table);
+int hashtable_init_with_index(struct hashtable *table, struct array *pool,
+			      struct array *index);
+void hashtable_take_index(struct hashtable *table, struct array *index);
+void hashtable_add(struct hashtable *table, uint32_t value);
 uint32_t hashtable_insert(struct hashtable *table, const char *key);
 uint32_t hashtable_lookup(struct hashtable *table, const char *key);
 uint32_t hashtable_tokenize(struct hashtable *table, const char *string);
+uint32_t hashtable_hash_string(const char *key, size_t length);
+uint32_t hashtable_lookup_with_hash(struct hashtable *table, const char *key,
+				    uint32_t hash);
+void hashtable_add_with_hash(struct hashtable *table,
+			     uint32_t hash, uint32_t value);
+
+/* A string interner that several threads can feed at once.  Each
+ * thread tokenizes through its own stage, which hands out ids that
+ * are stable across threads; razor_interner_finish() then adds the
+ * strings to a string pool and maps the ids to their offsets there. */
+struct razor_interner;
+struct razor_interner_stage;
+
+struct razor_interner *razor_interner_create(void);
+void razor_interner_destroy(struct razor_interner *interner);
+struct razor_interner_stage *
+razor_interner_stage_create(struct razor_interner *interner);
+void razor_interner_stage_destroy(struct razor_interner_stage *stage);
+uint32_t razor_interner_stage_tokenize(struct razor_interner_stage *stage,
+				       const char *string);
+void razor_interner_finish(struct razor_interner *interner,
+			   struct hashtable *table);
+uint32_t razor_interner_get_offset(struct razor_interner *interner,
+				   uint32_t id);
+
+uint32_t *razor_string_pool_map_keys(struct array *pool, struct array *base);
+
+static inline uint32_t
+razor_string_key(uint32_t *keys, uint32_t offset)
+{
+	return keys ? keys[offset] : offset * 2;
+}
 
 
 struct razor_set_section {
 	uint32_t name;
 	uint32_t offset;
 	uint32_t size;
+	uint32_t checksum;
 };
 
 struct razor_set_header {
 	uint32_t magic;
-	uint32_t version;
+	uint16_t version;
+	uint16_t flags;
 	uint32_t num_sections;
 };
 
 #define RAZOR_MAGIC 	0x525a4442
-#define RAZOR_VERSION	1
+#define RAZOR_VERSION	7
+
+/* Version 1 files have a 32 bit version field, which newer files
+ * split into a 16 bit version and 16 bits of flags.  On a big endian
+ * host a version 1 file reads as version 0 with flags 1; its header
+ * is rewritten in the current layout when it is mapped. */
+#define RAZOR_VERSION_NO_FLAGS		1
+
+/* Version 1 files have 24 bit list pointers, list entries and
+ * package and file names, with an 8 bit flags field on top.  They
+ * are converted to the current layout when the sections are bound. */
+#define RAZOR_VERSION_NARROW_LISTS	1
+
+/* Version 3 and older files keep the details in the package
+ * records.  The packages section of those is split into the packages
+ * and the package details when it is bound. */
+#define RAZOR_VERSION_INLINE_DETAILS	3
+
+/* Version 6 and older files have no checksum in the section table
+ * entries, which are only 12 bytes long. */
+#define RAZOR_VERSION_NO_CHECKSUMS	6
+
+/* Sections start at a multiple of this in the file, or of
+ * RAZOR_HUGE_PAGE_ALIGN if the set has RAZOR_SET_HUGE_PAGE_ALIGNED,
+ * so that madvise() can be applied to each of them separately. */
+#define RAZOR_SECTION_ALIGN	4096
+#define RAZOR_HUGE_PAGE_ALIGN	(2 * 1024 * 1024)
 
 #define RAZOR_STRING_POOL		"string_pool"
 #define RAZOR_PACKAGES			"packages"
 #define RAZOR_PROPERTIES		"properties"
 #define RAZOR_PACKAGE_POOL		"package_pool"
 #define RAZOR_PROPERTY_POOL		"property_pool"
+#define RAZOR_PROPERTY_NAMES		"property_names"
+#define RAZOR_PACKAGE_VERSION_RANKS	"package_version_ranks"
+#define RAZOR_PROPERTY_VERSION_RANKS	"property_version_ranks"
+#define RAZOR_VERSION_KEYS		"version_keys"
+#define RAZOR_STRING_INDEX		"string_index"
 
 #define RAZOR_DETAILS_STRING_POOL	"details_string_pool"
+#define RAZOR_PACKAGE_DETAILS		"package_details"
+#define RAZOR_DETAILS_BLOCKS		"details_blocks"
 
 #define RAZOR_FILES			"files"
 #define RAZOR_FILE_POOL			"file_pool"
 #define RAZOR_FILE_STRING_POOL		"file_string_pool"
+#define RAZOR_FILE_STRING_INDEX		"file_string_index"
+
+#define RAZOR_DELTA_INFO		"delta_info"
+#define RAZOR_DELTA_REMOVED		"delta_removed"
 
 struct razor_package {
-	uint name  : 24;
-	uint flags : 8;
+	uint32_t name  : 31;
+	uint32_t flags : 1;
 	uint32_t version;
 	uint32_t arch;
+	struct list_head properties;
+	struct list_head files;
+};
+
+/* The details of the package at the same index in the packages
+ * array, as offsets into the details string pool.  They live in a
+ * section of their own, so the solver doesn't pull them into the
+ * cache along with the packages. */
+struct razor_package_details {
 	uint32_t summary;
 	uint32_t description;
 	uint32_t url;
 	uint32_t license;
-	struct list_head properties;
-	struct list_head files;
 };
 
+/* With RAZOR_SET_COMPRESSED_DETAILS, the details string pool is split
+ * into blocks of whole strings of about RAZOR_DETAILS_BLOCK_SIZE,
+ * each compressed on its own with zlib.  The details blocks section
+ * gives the offset of each block in the uncompressed pool and in the
+ * compressed one, followed by an entry with the sizes of both.  The
+ * details keep their offsets into the uncompressed pool. */
+struct razor_details_block {
+	uint32_t offset;
+	uint32_t compressed;
+};
+
+#define RAZOR_DETAILS_BLOCK_SIZE	(32 * 1024)
+#define RAZOR_DETAILS_CACHE_SIZE	8
+
+/* The most recently used uncompressed blocks.  A string stays valid
+ * until RAZOR_DETAILS_CACHE_SIZE other blocks have been read. */
+struct razor_details_cache {
+	uint32_t clock;
+	struct {
+		uint32_t block;
+		uint32_t used;
+		char *data;
+	} entries[RAZOR_DETAILS_CACHE_SIZE];
+};
+
+void razor_set_compress_details(struct razor_set *set);
+
 
 struct razor_property {
 	uint32_t name;
@@ -129,14 +314,33 @@ struct razor_property {
 	struct list_head packages;
 };
 
+/* Index of the distinct property names.  Properties are sorted by
+ * name and then type, so the properties of type t with this name are
+ * the range [start[t], start[t + 1]), where start[4] is start[0] of
+ * the next entry. */
+struct razor_property_name {
+	uint32_t name;
+	uint32_t start[4];
+};
+
+#define RAZOR_PROPERTY_TYPE_INDEX(flags) \
+	(((flags) & RAZOR_PROPERTY_TYPE_MASK) >> 3)
+
+/* The version rank sections hold one rank per package and per
+ * property.  Ranks order the versions of a set the same way
+ * razor_versioncmp() does, so within a set a version comparison is
+ * an integer compare.  Sets written before the rank sections existed
+ * have no ranks and get RAZOR_NO_RANK. */
+#define RAZOR_NO_RANK	0xffffffff
+
 struct razor_entry {
-	uint32_t name  : 24;
-	uint32_t flags : 8;
+	uint32_t name  : 31;
+	uint32_t flags : 1;
 	uint32_t start;
 	struct list_head packages;
 };
 
-#define RAZOR_ENTRY_LAST	0x80
+#define RAZOR_ENTRY_LAST	0x01
 
 struct razor_set {
 	struct array string_pool;
@@ -145,9 +349,26 @@ struct razor_set {
  	struct array files;
 	struct array package_pool;
  	struct array property_pool;
+	struct array property_names;
+	struct array package_version_ranks;
+	struct array property_version_ranks;
+	struct array version_keys;
+	struct array string_index;
  	struct array file_pool;
 	struct array file_string_pool;
+	struct array file_string_index;
 	struct array details_string_pool;
+	struct array details_blocks;
+	struct array package_details;
+	struct razor_details_cache *details_cache;
+	struct array delta_info;
+	struct array delta_removed;
+	struct razor_layer *layers;
+	uint32_t layer_count;
+
+	uint32_t flags;
+	uint32_t open_flags;
+	uint32_t unbound;
 
 	struct razor_set_header *header;
 	size_t header_size;
@@ -159,51 +380,253 @@ struct razor_set {
 	size_t files_header_size;
 };
 
-struct import_entry {
-	uint32_t package;
-	char *name;
+static inline uint32_t
+razor_set_package_rank(struct razor_set *set, struct razor_package *package)
+{
+	uint32_t i = package - (struct razor_package *) set->packages.data;
+
+	if (i >= set->package_version_ranks.size / sizeof (uint32_t))
+		return RAZOR_NO_RANK;
+
+	return ((uint32_t *) set->package_version_ranks.data)[i];
+}
+
+static inline uint32_t
+razor_set_property_rank(struct razor_set *set, struct razor_property *property)
+{
+	uint32_t i = property - (struct razor_property *) set->properties.data;
+
+	if (i >= set->property_version_ranks.size / sizeof (uint32_t))
+		return RAZOR_NO_RANK;
+
+	return ((uint32_t *) set->property_version_ranks.data)[i];
+}
+
+/* Ranks from different sets can't be compared, so comparisons across
+ * sets parse the version strings.  This caches the results, keyed on
+ * the pair of string offsets.  A zeroed entry is the comparison of
+ * the two empty strings at offset 0, so a zeroed cache is valid. */
+#define RAZOR_VERSION_CACHE_SIZE	4096
+
+struct razor_version_cache {
+	struct razor_set *set1, *set2;
+	struct {
+		uint32_t version1, version2;
+		int result;
+	} entries[RAZOR_VERSION_CACHE_SIZE];
 };
 
+void razor_version_cache_init(struct razor_version_cache *cache,
+			      struct razor_set *set1, struct razor_set *set2);
+int razor_version_cache_compare(struct razor_version_cache *cache,
+				uint32_t version1, uint32_t version2);
+
+/* The version keys section has a key from razor_version_key() for
+ * each rank: a uint32_t count of ranks, count + 1 uint32_t offsets
+ * of the keys from the end of the offsets, and the keys.  Unlike
+ * ranks, keys from different sets can be compared. */
+#define RAZOR_VERSION_KEY_MAX(length)	(2 * (length) + 6)
+
+static inline int
+razor_version_key_compare(const char *key1, size_t size1,
+			  const char *key2, size_t size2)
+{
+	int cmp;
+
+	cmp = memcmp(key1, key2, size1 < size2 ? size1 : size2);
+	if (cmp == 0)
+		return size1 < size2 ? -1 : size1 > size2;
+
+	return cmp < 0 ? -1 : 1;
+}
+
+static inline const char *
+razor_set_version_key(struct razor_set *set, uint32_t rank, size_t *size)
+{
+	const uint32_t *offsets = set->version_keys.data;
+	size_t header, count;
+
+	*size = 0;
+	if (rank == RAZOR_NO_RANK ||
+	    set->version_keys.size < (int) sizeof *offsets)
+		return NULL;
+
+	count = offsets[0];
+	header = (count + 2) * sizeof *offsets;
+	if (rank >= count || header > (size_t) set->version_keys.size ||
+	    offsets[rank + 1] > offsets[rank + 2] ||
+	    offsets[rank + 2] > set->version_keys.size - header)
+		return NULL;
+
+	*size = offsets[rank + 2] - offsets[rank + 1];
+
+	return (const char *) set->version_keys.data + header +
+		offsets[rank + 1];
+}
+
+/* A delta set (RAZOR_SET_DELTA) holds the packages that are new in
+ * the target set, the indexes of the base set packages that are gone
+ * in delta_removed, and this in delta_info.  The checksums are those
+ * of razor_set_get_checksum(). */
+struct razor_delta_info {
+	uint32_t base_checksum;
+	uint32_t target_checksum;
+};
+
+#define RAZOR_SET_DETAILS_UNBOUND	0x01
+#define RAZOR_SET_FILES_UNBOUND		0x02
+#define RAZOR_SET_FILES_CORRUPT		0x04
+
+void razor_set_bind_details(struct razor_set *set);
+int razor_set_bind_files(struct razor_set *set);
+int razor_set_has_section(struct razor_set *set, const char *name);
+
+/* The importer builds the file tree as files are added.  The entries
+ * live in one array and refer to each other by index, the root being
+ * the first.  Once an entry has more than a few children, it keeps a
+ * hash table of them, which holds child index + 1, 0 meaning empty. */
 struct import_directory {
-	uint32_t name, count;
-	struct array files;
+	uint32_t name, hash, count;
+	struct array children;
 	struct array packages;
-	struct import_directory *last;
+	uint32_t *child_hash;
+	uint32_t child_hash_size;
 };
 
 struct razor_importer {
 	struct razor_set *set;
+	uint32_t flags;
 	struct hashtable table;
 	struct hashtable file_table;
 	struct hashtable details_table;
 	struct razor_package *package;
+	struct razor_package_details *details;
 	struct array properties;
-	struct array files;
+	struct array directories;
+	struct array path;
 	struct array file_requires;
+	uint32_t *version_ranks;
+};
+
+/* An overlay set, from razor_set_create_overlay(), has no packages
+ * of its own, only a stack of layers, bottom first.  A package is
+ * hidden if a higher layer has a package of the same name and arch;
+ * the hidden array has a byte for each package of the layer. */
+struct razor_layer {
+	struct razor_set *set;
+	char *hidden;
+};
+
+int razor_set_find_layer(struct razor_set *set, void *p, size_t offset);
+struct razor_set *
+razor_set_get_package_layer(struct razor_set *set,
+			    struct razor_package *package);
+struct razor_set *
+razor_set_get_property_layer(struct razor_set *set,
+			     struct razor_property *property);
+int razor_layer_property_is_visible(struct razor_layer *layer,
+				    struct razor_property *property);
+
+static inline int
+razor_layer_package_is_hidden(struct razor_layer *layer,
+			      struct razor_package *package)
+{
+	struct razor_package *packages = layer->set->packages.data;
+
+	return layer->hidden[package - packages];
+}
+
+struct razor_layer_iterator {
+	struct razor_package_iterator *pi;
+	struct razor_package *package;
 };
 
 struct razor_package_iterator {
 	struct razor_set *set;
 	struct razor_package *package, *end;
-	struct list *index;
-	int free_index;
+	struct list_iterator index;
+	struct list *index_array;
+	char *pattern;
+	struct razor_layer_iterator *layers;
 };
 
+void razor_set_sort_string_pool(struct razor_set *set);
+int razor_set_compact_string_pool(struct razor_set *set);
+void razor_set_build_string_index(struct razor_set *set);
+uint32_t *razor_set_rank_versions(struct razor_set *set);
+void razor_set_build_version_ranks(struct razor_set *set, uint32_t *ranks);
+void razor_set_build_property_names(struct razor_set *set);
+void razor_set_compact_lists(struct razor_set *set);
+void
+razor_property_name_get_range(struct razor_set *set,
+			      struct razor_property_name *name, uint32_t type,
+			      struct razor_property **start,
+			      struct razor_property **end);
+void
+razor_set_find_property_range(struct razor_set *set,
+			      const char *name, uint32_t type,
+			      struct razor_property **start,
+			      struct razor_property **end);
+void
+razor_set_find_package_range(struct razor_set *set,
+			     const char *prefix, size_t len,
+			     struct razor_package **start,
+			     struct razor_package **end);
+
 void
 razor_package_iterator_init_for_property(struct razor_package_iterator *pi,
 					 struct razor_set *set,
 					 struct razor_property *property);
 
+struct razor_property_source {
+	struct razor_set *set;
+	struct razor_property *property, *end;
+};
+
 struct razor_property_iterator {
 	struct razor_set *set;
 	struct razor_property *property, *end;
 	struct list *index;
+	struct razor_set *overlay;
+	uint32_t layer, type;
+	int typed;
+	char *name;
+	struct razor_property_source *sources;
+	uint32_t source_count, source;
 };
 
 struct razor_entry *
 razor_set_find_entry(struct razor_set *set,
 		     struct razor_entry *dir, const char *pattern);
 
+/* In a set with RAZOR_SET_FRONT_CODED_FILES, the name of a file entry
+ * is the index of the name in the sorted, front coded file string
+ * pool.  The names are stored in blocks of RAZOR_FILE_NAME_BLOCK.
+ * The first name of each block is stored in full, the others as a
+ * byte holding the length of the prefix shared with the previous
+ * name, followed by the rest of the name.  The file string index has
+ * the offset of each block.  A cursor decodes names, and walking the
+ * names in order only decodes each one once.  Names can be of any
+ * length, so the cursor keeps the current name in an array that
+ * razor_file_name_cursor_release() frees. */
+#define RAZOR_FILE_NAME_BLOCK	16
+
+struct razor_file_name_cursor {
+	struct razor_set *set;
+	const char *next;
+	uint32_t index;
+	struct array name;
+};
+
+void razor_file_name_cursor_init(struct razor_file_name_cursor *cursor,
+				 struct razor_set *set);
+void razor_file_name_cursor_release(struct razor_file_name_cursor *cursor);
+const char *razor_file_name_cursor_get(struct razor_file_name_cursor *cursor,
+				       uint32_t name);
+void razor_set_front_code_file_names(struct razor_set *set);
+
+struct razor_merger *
+razor_merger_create_for_sets(struct razor_set **sets, int count);
 struct razor_merger *
 razor_merger_create(struct razor_set *set1, struct razor_set *set2);
 void
@@ -219,15 +642,28 @@ razor_package_get_details_varg(struct razor_set *set,
 			       struct razor_package *package,
 			       va_list args);
 
+int razor_set_write_to_fd_with_base(struct razor_set *set, int fd,
+				    enum razor_repo_file_type type,
+				    struct razor_set *base, int base_fd);
+int razor_set_move_to_fd_with_base(struct razor_set *set, int fd,
+				   struct razor_set *base, int base_fd);
+
 int razor_create_dir(const char *root, const char *path);
 int razor_write(int fd, const void *data, size_t size);
+int razor_writev(int fd, struct iovec *iov, int count);
+int razor_pwritev(int fd, struct iovec *iov, int count, off_t offset);
+int razor_sync_directory(const char *filename);
+uint32_t razor_crc32c(uint32_t crc, const void *data, size_t size);
 
 
 typedef int (*razor_compare_with_data_func_t)(const void *p1,
 					      const void *p,
 					      void *data);
 uint32_t *
-razor_qsort_with_data(void *base, size_t nelem, size_t size,
-		      razor_compare_with_data_func_t compare, void *data);
+razor_sort_with_data(void *base, size_t nelem, size_t size,
+		     razor_compare_with_data_func_t compare, void *data);
+uint32_t *
+razor_sort_with_keys(void *base, size_t nelem, size_t size,
+		     const uint64_t *keys);
 
 #endif /* _RAZOR_INTERNAL_H_ */
@@ -20,6 +20,7 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -34,6 +35,7 @@
 #include <ctype.h>
 #include <fnmatch.h>
 #include <assert.h>
+#include <zlib.h>
 
 #include "razor-internal.h"
 #include "razor.h"
@@ -49,27 +51,56 @@ zalloc(size_t size)
 	return p;
 }
 
+/* Hot sections are walked by the solver and the iterators; string
+ * sections are only read here and there to print something. */
+#define SECTION_HOT	0x01
+#define SECTION_STRINGS	0x02
+
 struct razor_set_section_index {
 	const char *name;
 	uint32_t offset;
+	uint32_t flags;
 };
 
 struct razor_set_section_index razor_sections[] = {
-	{ RAZOR_STRING_POOL,	offsetof(struct razor_set, string_pool) },
-	{ RAZOR_PACKAGES,	offsetof(struct razor_set, packages) },
-	{ RAZOR_PROPERTIES,	offsetof(struct razor_set, properties) },
-	{ RAZOR_PACKAGE_POOL,	offsetof(struct razor_set, package_pool) },
-	{ RAZOR_PROPERTY_POOL,	offsetof(struct razor_set, property_pool) },
+	{ RAZOR_STRING_POOL,	offsetof(struct razor_set, string_pool),
+	  SECTION_STRINGS },
+	{ RAZOR_PACKAGES,	offsetof(struct razor_set, packages),
+	  SECTION_HOT },
+	{ RAZOR_PROPERTIES,	offsetof(struct razor_set, properties),
+	  SECTION_HOT },
+	{ RAZOR_PACKAGE_POOL,	offsetof(struct razor_set, package_pool),
+	  SECTION_HOT },
+	{ RAZOR_PROPERTY_POOL,	offsetof(struct razor_set, property_pool),
+	  SECTION_HOT },
+	{ RAZOR_PROPERTY_NAMES,	offsetof(struct razor_set, property_names),
+	  SECTION_HOT },
+	{ RAZOR_PACKAGE_VERSION_RANKS,
+	  offsetof(struct razor_set, package_version_ranks), SECTION_HOT },
+	{ RAZOR_PROPERTY_VERSION_RANKS,
+	  offsetof(struct razor_set, property_version_ranks), SECTION_HOT },
+	{ RAZOR_VERSION_KEYS,	offsetof(struct razor_set, version_keys), 0 },
+	{ RAZOR_STRING_INDEX,	offsetof(struct razor_set, string_index), 0 },
 };
 
 struct razor_set_section_index razor_files_sections[] = {
-	{ RAZOR_FILES,			offsetof(struct razor_set, files) },
-	{ RAZOR_FILE_POOL,		offsetof(struct razor_set, file_pool) },
-	{ RAZOR_FILE_STRING_POOL,	offsetof(struct razor_set, file_string_pool) },
+	{ RAZOR_FILES,			offsetof(struct razor_set, files), 0 },
+	{ RAZOR_FILE_POOL,		offsetof(struct razor_set, file_pool), 0 },
+	{ RAZOR_FILE_STRING_POOL,	offsetof(struct razor_set, file_string_pool),
+	  SECTION_STRINGS },
+	{ RAZOR_FILE_STRING_INDEX,	offsetof(struct razor_set, file_string_index), 0 },
 };
 
 struct razor_set_section_index razor_details_sections[] = {
-	{ RAZOR_DETAILS_STRING_POOL,	offsetof(struct razor_set, details_string_pool) },
+	{ RAZOR_DETAILS_STRING_POOL,	offsetof(struct razor_set, details_string_pool),
+	  SECTION_STRINGS },
+	{ RAZOR_PACKAGE_DETAILS,	offsetof(struct razor_set, package_details), 0 },
+	{ RAZOR_DETAILS_BLOCKS,		offsetof(struct razor_set, details_blocks), 0 },
+};
+
+struct razor_set_section_index razor_delta_sections[] = {
+	{ RAZOR_DELTA_INFO,		offsetof(struct razor_set, delta_info), 0 },
+	{ RAZOR_DELTA_REMOVED,		offsetof(struct razor_set, delta_removed), 0 },
 };
 
 RAZOR_EXPORT struct razor_set *
@@ -92,274 +123,2177 @@ razor_set_create(void)
 	return set;
 }
 
+static void
+razor_set_advise_section(struct razor_set *set, struct array *array,
+			 uint32_t flags)
+{
+	uintptr_t page_size, start, end;
+
+	if (array->size == 0)
+		return;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	start = (uintptr_t) array->data & ~(page_size - 1);
+	end = ALIGN((uintptr_t) array->data + array->size, page_size);
+
+	if ((flags & SECTION_HOT) &&
+	    (set->open_flags & RAZOR_SET_OPEN_HUGE_PAGES)) {
+#ifdef MADV_HUGEPAGE
+		madvise((void *) start, end - start, MADV_HUGEPAGE);
+#endif
+	}
+
+	if ((flags & SECTION_HOT) &&
+	    (set->open_flags & RAZOR_SET_OPEN_PREFAULT)) {
+#ifdef MADV_POPULATE_READ
+		if (madvise((void *) start, end - start,
+			    MADV_POPULATE_READ) == 0)
+			return;
+#endif
+		madvise((void *) start, end - start, MADV_WILLNEED);
+	}
+
+	if ((flags & SECTION_STRINGS) &&
+	    (set->open_flags & RAZOR_SET_OPEN_LAZY_STRINGS))
+		madvise((void *) start, end - start, MADV_RANDOM);
+}
+
+/* Convert a version 1 word with a 24 bit value and 8 bit flags to a
+ * 31 bit value and a 1 bit flag.  A set flags byte becomes the flag
+ * bit, and all ones stays all ones, which is the empty list. */
+static uint32_t
+upgrade_narrow_word(uint32_t word)
+{
+	if (word == 0xffffffff)
+		return word;
+
+	return (word & 0xffffff) | ((word >> 24) ? 0x80000000 : 0);
+}
+
+static void
+upgrade_narrow_words(struct array *array, size_t stride,
+		     const size_t *words, int count)
+{
+	uint32_t *p, *end;
+	int i;
+
+	end = array->data + array->size;
+	for (p = array->data; p + stride <= end; p += stride)
+		for (i = 0; i < count; i++)
+			p[words[i]] = upgrade_narrow_word(p[words[i]]);
+}
+
+/* The package record of version 3 and older files. */
+struct razor_inline_details_package {
+	uint32_t name;
+	uint32_t version;
+	uint32_t arch;
+	struct razor_package_details details;
+	struct list_head properties;
+	struct list_head files;
+};
+
+/* Split the packages of a version 3 or older file into the packages
+ * and the package details.  Both fit in the space of the old
+ * packages section, the details go after the packages. */
+static void
+split_inline_details(struct razor_set *set, struct array *array)
+{
+	struct razor_inline_details_package *old;
+	struct razor_package_details *details;
+	struct razor_package *p;
+	int i, count;
+
+	count = array->size / sizeof *old;
+	details = malloc(count * sizeof *details);
+	old = array->data;
+	for (i = 0; i < count; i++)
+		details[i] = old[i].details;
+
+	p = array->data;
+	for (i = 0; i < count; i++) {
+		memmove(&p[i], &old[i], offsetof(struct razor_package,
+						   properties));
+		p[i].properties = old[i].properties;
+		p[i].files = old[i].files;
+	}
+
+	array->size = count * sizeof *p;
+	array->alloc = array->size;
+	set->package_details.data = &p[count];
+	set->package_details.size = count * sizeof *details;
+	set->package_details.alloc = set->package_details.size;
+	memcpy(set->package_details.data, details,
+	       set->package_details.size);
+	free(details);
+}
+
+#define WORD(type, member) (offsetof(type, member) / sizeof (uint32_t))
+
+static void
+upgrade_narrow_section(struct array *array, uint32_t offset)
+{
+	static const size_t package_words[] = {
+		0,
+		WORD(struct razor_inline_details_package, properties),
+		WORD(struct razor_inline_details_package, files)
+	};
+	static const size_t property_words[] = {
+		WORD(struct razor_property, packages)
+	};
+	static const size_t entry_words[] = {
+		0,
+		WORD(struct razor_entry, packages)
+	};
+	static const size_t pool_words[] = { 0 };
+
+	if (offset == offsetof(struct razor_set, packages))
+		upgrade_narrow_words(array,
+				     sizeof (struct razor_inline_details_package) / 4,
+				     package_words,
+				     ARRAY_SIZE(package_words));
+	else if (offset == offsetof(struct razor_set, properties))
+		upgrade_narrow_words(array,
+				     sizeof (struct razor_property) / 4,
+				     property_words,
+				     ARRAY_SIZE(property_words));
+	else if (offset == offsetof(struct razor_set, files))
+		upgrade_narrow_words(array,
+				     sizeof (struct razor_entry) / 4,
+				     entry_words,
+				     ARRAY_SIZE(entry_words));
+	else if (offset == offsetof(struct razor_set, package_pool) ||
+		 offset == offsetof(struct razor_set, property_pool) ||
+		 offset == offsetof(struct razor_set, file_pool))
+		upgrade_narrow_words(array, 1,
+				     pool_words, ARRAY_SIZE(pool_words));
+}
+
+/* Rewrite a section of an older file in the current layout.  The
+ * mapping is private, so this only touches our copy of the pages. */
+static void
+razor_set_upgrade_section(struct razor_set *set, struct array *array,
+			  uint32_t offset, uint32_t version)
+{
+	uintptr_t page_size, start, end;
+
+	if (array->size == 0)
+		return;
+	if (version > RAZOR_VERSION_NARROW_LISTS &&
+	    offset != offsetof(struct razor_set, packages))
+		return;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	start = (uintptr_t) array->data & ~(page_size - 1);
+	end = ALIGN((uintptr_t) array->data + array->size, page_size);
+	mprotect((void *) start, end - start, PROT_READ | PROT_WRITE);
+
+	if (version == RAZOR_VERSION_NARROW_LISTS)
+		upgrade_narrow_section(array, offset);
+	if (offset == offsetof(struct razor_set, packages))
+		split_inline_details(set, array);
+
+	mprotect((void *) start, end - start, PROT_READ);
+}
+
+static size_t
+razor_set_section_entry_size(struct razor_set_header *header)
+{
+	if (header->version <= RAZOR_VERSION_NO_CHECKSUMS)
+		return offsetof(struct razor_set_section, checksum);
+
+	return sizeof (struct razor_set_section);
+}
+
+static struct razor_set_section *
+razor_set_get_section(struct razor_set_header *header, uint32_t i)
+{
+	return (void *) header + sizeof *header +
+		i * razor_set_section_entry_size(header);
+}
+
+/* Check that the section table is sane and that the sections listed
+ * in section_index, or all of them if it's NULL, are inside the file
+ * and match their checksums. */
+static int
+razor_set_check_sections(struct razor_set_header *header, size_t size,
+			 struct razor_set_section_index section_index[],
+			 int section_index_size)
+{
+	struct razor_set_section *s;
+	const char *pool, *name;
+	size_t pool_size;
+	uint32_t i;
+	int j;
+
+	if ((uint64_t) header->num_sections *
+	    razor_set_section_entry_size(header) > size - sizeof *header) {
+		fprintf(stderr, "razor: corrupt section table\n");
+		return -1;
+	}
+
+	pool = (void *) razor_set_get_section(header, header->num_sections);
+	pool_size = (void *) header + size - (void *) pool;
+
+	for (i = 0; i < header->num_sections; i++) {
+		s = razor_set_get_section(header, i);
+		if (s->name >= pool_size ||
+		    memchr(&pool[s->name], 0, pool_size - s->name) == NULL) {
+			fprintf(stderr, "razor: corrupt section table\n");
+			return -1;
+		}
+		name = &pool[s->name];
+
+		for (j = 0; section_index && j < section_index_size; j++)
+			if (!strcmp(section_index[j].name, name))
+				break;
+		if (section_index && j == section_index_size)
+			continue;
+
+		if ((uint64_t) s->offset + s->size > size) {
+			fprintf(stderr,
+				"razor: section %s is truncated\n", name);
+			return -1;
+		}
+		if (header->version > RAZOR_VERSION_NO_CHECKSUMS &&
+		    razor_crc32c(0, (void *) header + s->offset,
+				 s->size) != s->checksum) {
+			fprintf(stderr,
+				"razor: checksum mismatch in section %s\n",
+				name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Sections are verified the first time they get bound, so a group
+ * that's never used is never read.  A group that fails is left
+ * unbound as a whole. */
 static int
 razor_set_bind_sections(struct razor_set *set,
-			struct razor_set_header **header,
-			size_t *header_size,
+			struct razor_set_header *header, size_t size,
 			struct razor_set_section_index section_index[],
-			int section_index_size,
-			const char *filename)
+			int section_index_size)
 {
-	struct razor_set_section *s, *sections;
-	struct stat stat;
+	struct razor_set_section *s;
 	struct array *array;
 	const char *pool;
-	int fd, i;
+	uint32_t i;
+	int j;
+
+	if (razor_set_check_sections(header, size,
+				     section_index, section_index_size) < 0)
+		return -1;
+
+	pool = (void *) razor_set_get_section(header, header->num_sections);
+
+	for (i = 0; i < header->num_sections; i++) {
+		s = razor_set_get_section(header, i);
+		for (j = 0; j < section_index_size; j++)
+			if (!strcmp(section_index[j].name,
+				    &pool[s->name]))
+				break;
+		if (j == section_index_size)
+			continue;
+		array = (void *) set + section_index[j].offset;
+		array->data = (void *) header + s->offset;
+		array->size = s->size;
+		array->alloc = s->size;
+		if (header->version <= RAZOR_VERSION_INLINE_DETAILS)
+			razor_set_upgrade_section(set, array,
+						  section_index[j].offset,
+						  header->version);
+		if (set->open_flags)
+			razor_set_advise_section(set, array,
+						 section_index[j].flags);
+	}
+
+	return 0;
+}
+
+/* Map the file at a 2 MiB boundary, so that sections aligned to
+ * RAZOR_HUGE_PAGE_ALIGN in the file are also aligned in memory.  We
+ * reserve enough address space to find an aligned address, map the
+ * file over it and give back the rest. */
+static void *
+razor_map_huge_aligned(int fd, size_t size)
+{
+	uintptr_t reserved, aligned, end;
+	size_t reserved_size;
+	void *p;
+
+	reserved_size = size + RAZOR_HUGE_PAGE_ALIGN;
+	p = mmap(NULL, reserved_size, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return MAP_FAILED;
+
+	reserved = (uintptr_t) p;
+	aligned = ALIGN(reserved, (uintptr_t) RAZOR_HUGE_PAGE_ALIGN);
+	p = mmap((void *) aligned, size, PROT_READ,
+		 MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED) {
+		munmap((void *) reserved, reserved_size);
+		return MAP_FAILED;
+	}
+
+	end = ALIGN(aligned + size, (uintptr_t) sysconf(_SC_PAGESIZE));
+	if (aligned > reserved)
+		munmap((void *) reserved, aligned - reserved);
+	if (reserved + reserved_size > end)
+		munmap((void *) end, reserved + reserved_size - end);
+
+	return p;
+}
+
+/* Rewrite the header of a version 1 file that reads as version 0
+ * on a big endian host.  Returns -1 if the header is in neither
+ * layout. */
+static int
+razor_set_upgrade_header(struct razor_set_header *header)
+{
+	uintptr_t page_size, start;
+
+	if (header->version != 0)
+		return 0;
+	if (header->flags != RAZOR_VERSION_NO_FLAGS)
+		return -1;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	start = (uintptr_t) header & ~(page_size - 1);
+	if (mprotect((void *) start, page_size, PROT_READ | PROT_WRITE) < 0)
+		return -1;
+	header->version = header->flags;
+	header->flags = 0;
+	mprotect((void *) start, page_size, PROT_READ);
+
+	return 0;
+}
+
+static int
+razor_set_map_sections(struct razor_set *set,
+		       struct razor_set_header **header,
+		       size_t *header_size,
+		       struct razor_set_section_index section_index[],
+		       int section_index_size,
+		       const char *filename)
+{
+	struct stat stat;
+	int fd;
 
 	fd = open(filename, O_RDONLY);
-	if (fstat(fd, &stat) < 0)
+	if (fd < 0)
 		return -1;
-	*header = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (*header == MAP_FAILED)
+	if (fstat(fd, &stat) < 0 || stat.st_size < sizeof **header) {
+		close(fd);
 		return -1;
+	}
+	if (set->open_flags & RAZOR_SET_OPEN_HUGE_PAGES)
+		*header = razor_map_huge_aligned(fd, stat.st_size);
+	else
+		*header = mmap(NULL, stat.st_size,
+			       PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*header == MAP_FAILED) {
+		*header = NULL;
+		return -1;
+	}
 	*header_size = stat.st_size;
 
-	sections = (void *) *header + sizeof **header;
-	pool = (void *) sections + (*header)->num_sections * sizeof *sections;
+	if ((*header)->magic != RAZOR_MAGIC ||
+	    razor_set_upgrade_header(*header) < 0 ||
+	    (*header)->version > RAZOR_VERSION) {
+		fprintf(stderr, "%s: not a razor package set "
+			"or unsupported version\n", filename);
+		munmap(*header, *header_size);
+		*header = NULL;
+		return -1;
+	}
+
+	if (razor_set_bind_sections(set, *header, *header_size,
+				    section_index, section_index_size) < 0) {
+		fprintf(stderr, "%s: corrupt package set\n", filename);
+		munmap(*header, *header_size);
+		*header = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+RAZOR_EXPORT struct razor_set *
+razor_set_open(const char *filename)
+{
+	return razor_set_open_with_flags(filename, 0);
+}
+
+RAZOR_EXPORT struct razor_set *
+razor_set_open_with_flags(const char *filename, uint32_t flags)
+{
+	struct razor_set *set;
+
+	set = zalloc(sizeof *set);
+	set->open_flags = flags;
+	if (razor_set_map_sections(set, &set->header, &set->header_size,
+				   razor_sections, ARRAY_SIZE(razor_sections),
+				   filename)){
+		free(set);
+		return NULL;
+	}
+	set->flags = set->header->flags;
+
+	if ((set->flags & RAZOR_SET_DELTA) &&
+	    razor_set_bind_sections(set, set->header, set->header_size,
+				    razor_delta_sections,
+				    ARRAY_SIZE(razor_delta_sections)) < 0) {
+		razor_set_destroy(set);
+		return NULL;
+	}
+
+	/* A single-file set also holds the details and files
+	 * sections.  Only the section table has been read so far;
+	 * those get bound the first time they're needed. */
+	set->unbound = RAZOR_SET_DETAILS_UNBOUND | RAZOR_SET_FILES_UNBOUND;
+
+	return set;
+}
+
+RAZOR_EXPORT int
+razor_set_open_details(struct razor_set *set, const char *filename)
+{
+	set->unbound &= ~RAZOR_SET_DETAILS_UNBOUND;
+
+	return razor_set_map_sections(set, &set->details_header,
+				      &set->details_header_size,
+				      razor_details_sections,
+				      ARRAY_SIZE(razor_details_sections),
+				      filename);
+}
+
+RAZOR_EXPORT int
+razor_set_open_files(struct razor_set *set, const char *filename)
+{
+	set->unbound &= ~RAZOR_SET_FILES_UNBOUND;
+
+	return razor_set_map_sections(set, &set->files_header,
+				      &set->files_header_size,
+				      razor_files_sections,
+				      ARRAY_SIZE(razor_files_sections),
+				      filename);
+}
+
+/* Bind the details sections of a single-file set opened with
+ * razor_set_open().  If the file doesn't have them, the details stay
+ * empty as before, until razor_set_open_details() is called. */
+void
+razor_set_bind_details(struct razor_set *set)
+{
+	if (!(set->unbound & RAZOR_SET_DETAILS_UNBOUND))
+		return;
+
+	/* Corrupt details just read as empty strings. */
+	set->unbound &= ~RAZOR_SET_DETAILS_UNBOUND;
+	razor_set_bind_sections(set, set->header, set->header_size,
+				razor_details_sections,
+				ARRAY_SIZE(razor_details_sections));
+}
+
+/* Like razor_set_bind_details(), but the package file lists point
+ * into the file pool, so there's nothing sensible to fall back to if
+ * the files are corrupt.  The files are left empty and every later
+ * call returns -1, for the caller to give up on whatever needed
+ * them. */
+int
+razor_set_bind_files(struct razor_set *set)
+{
+	if (set->unbound & RAZOR_SET_FILES_CORRUPT)
+		return -1;
+	if (!(set->unbound & RAZOR_SET_FILES_UNBOUND))
+		return 0;
+
+	set->unbound &= ~RAZOR_SET_FILES_UNBOUND;
+	if (razor_set_bind_sections(set, set->header, set->header_size,
+				    razor_files_sections,
+				    ARRAY_SIZE(razor_files_sections)) < 0) {
+		set->unbound |= RAZOR_SET_FILES_CORRUPT;
+		return -1;
+	}
+
+	return 0;
+}
+
+RAZOR_EXPORT int
+razor_set_verify(struct razor_set *set)
+{
+	if (set->header &&
+	    razor_set_check_sections(set->header, set->header_size,
+				     NULL, 0) < 0)
+		return -1;
+	if (set->details_header &&
+	    razor_set_check_sections(set->details_header,
+				     set->details_header_size, NULL, 0) < 0)
+		return -1;
+	if (set->files_header &&
+	    razor_set_check_sections(set->files_header,
+				     set->files_header_size, NULL, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+int
+razor_set_has_section(struct razor_set *set, const char *name)
+{
+	struct razor_set_section *s;
+	const char *pool;
+	uint32_t i;
+
+	if (set->header == NULL)
+		return 0;
+
+	pool = (void *) razor_set_get_section(set->header,
+					      set->header->num_sections);
+	for (i = 0; i < set->header->num_sections; i++) {
+		s = razor_set_get_section(set->header, i);
+		if (!strcmp(&pool[s->name], name))
+			return 1;
+	}
+
+	return 0;
+}
+
+RAZOR_EXPORT void
+razor_set_destroy(struct razor_set *set)
+{
+	struct array *a;
+	int i;
+
+	assert (set != NULL);
+
+	if (set->header) {
+		munmap(set->header, set->header_size);
+	} else {
+		for (i = 0; i < ARRAY_SIZE(razor_sections); i++) {
+			a = (void *) set + razor_sections[i].offset;
+			free(a->data);
+		}
+		for (i = 0; i < ARRAY_SIZE(razor_delta_sections); i++) {
+			a = (void *) set + razor_delta_sections[i].offset;
+			free(a->data);
+		}
+	}
+
+	if (set->details_header) {
+		munmap(set->details_header, set->details_header_size);
+	} else if (set->header == NULL) {
+		for (i = 0; i < ARRAY_SIZE(razor_details_sections); i++) {
+			a = (void *) set + razor_details_sections[i].offset;
+			free(a->data);
+		}
+	}
+
+	if (set->files_header) {
+		munmap(set->files_header, set->files_header_size);
+	} else if (set->header == NULL) {
+		for (i = 0; i < ARRAY_SIZE(razor_files_sections); i++) {
+			a = (void *) set + razor_files_sections[i].offset;
+			free(a->data);
+		}
+	}
+
+	if (set->details_cache) {
+		for (i = 0; i < RAZOR_DETAILS_CACHE_SIZE; i++)
+			free(set->details_cache->entries[i].data);
+		free(set->details_cache);
+	}
+
+	for (i = 0; i < set->layer_count; i++)
+		free(set->layers[i].hidden);
+	free(set->layers);
+
+	free(set);
+}
+
+static void
+add_iovec(struct array *iov, const void *data, size_t size)
+{
+	struct iovec *v;
+
+	if (size == 0)
+		return;
+
+	v = array_add(iov, sizeof *v);
+	v->iov_base = (void *) data;
+	v->iov_len = size;
+}
+
+/* Zeros for the padding between sections, for when fd is a pipe and
+ * we can't leave holes. */
+static void
+add_padding(struct array *iov, size_t size)
+{
+	static const char zeros[4096];
+	size_t len;
+
+	while (size > 0) {
+		len = size < sizeof zeros ? size : sizeof zeros;
+		add_iovec(iov, zeros, len);
+		size -= len;
+	}
+}
+
+/* Write out the gathered iovecs at offset, or at the current position
+ * if offset is negative, and start over. */
+static int
+flush_iovec(int fd, struct array *iov, off_t offset)
+{
+	int status;
+
+	if (offset < 0)
+		status = razor_writev(fd, iov->data,
+				      iov->size / sizeof (struct iovec));
+	else
+		status = razor_pwritev(fd, iov->data,
+				       iov->size / sizeof (struct iovec),
+				       offset);
+	iov->size = 0;
+
+	return status;
+}
+
+/* Look for a section of base with the same name and contents as
+ * section, so that it can be copied over from the base file instead
+ * of being written out again.  Sections smaller than a page aren't
+ * worth the extra system call. */
+static struct razor_set_section *
+find_base_section(struct razor_set *base, const char *name,
+		  struct razor_set_section *section, struct array *array)
+{
+	struct razor_set_header *header;
+	struct razor_set_section *s;
+	const char *pool;
+	uint32_t i;
+
+	if (base == NULL || base->header == NULL ||
+	    array->size < RAZOR_SECTION_ALIGN)
+		return NULL;
+
+	header = base->header;
+	if (header->version <= RAZOR_VERSION_NO_CHECKSUMS)
+		return NULL;
+
+	pool = (void *) razor_set_get_section(header, header->num_sections);
+	for (i = 0; i < header->num_sections; i++) {
+		s = razor_set_get_section(header, i);
+		if (s->size == section->size &&
+		    s->checksum == section->checksum &&
+		    (uint64_t) s->offset + s->size <= base->header_size &&
+		    !strcmp(&pool[s->name], name) &&
+		    !memcmp((void *) header + s->offset, array->data, s->size))
+			return s;
+	}
+
+	return NULL;
+}
+
+/* Copy size bytes at offset in base_fd to fd at out_offset, or to
+ * the current position of fd if out_offset is negative.  On file
+ * systems that can share extents between files, this doesn't copy
+ * any data at all.  If copy_file_range() doesn't work here, the rest
+ * is written out from data. */
+static int
+copy_section(int fd, off_t out_offset, int base_fd, off_t offset,
+	     const void *data, size_t size)
+{
+	struct iovec iov;
+	ssize_t copied;
+	size_t done;
+
+	done = 0;
+	while (done < size) {
+		copied = copy_file_range(base_fd, &offset, fd,
+					 out_offset < 0 ? NULL : &out_offset,
+					 size - done, 0);
+		if (copied <= 0)
+			break;
+		done += copied;
+	}
+
+	iov.iov_base = (void *) data + done;
+	iov.iov_len = size - done;
+	if (out_offset < 0)
+		return razor_writev(fd, &iov, 1);
+
+	return razor_pwritev(fd, &iov, 1, out_offset);
+}
+
+/* Fill in the header, section table and section name pool for
+ * writing out the given sections of set, and return the size of the
+ * file. */
+static uint32_t
+razor_set_layout_sections(struct razor_set *set,
+			  struct razor_set_section_index *sections,
+			  size_t array_size,
+			  struct razor_set_header *header,
+			  struct razor_set_section *out_sections,
+			  struct array *pool)
+{
+	struct hashtable table;
+	struct array *a;
+	uint32_t offset, align;
+	int i;
+
+	/* Deltas are meant to be downloaded and applied once, so they
+	 * don't get page aligned sections. */
+	if (set->flags & RAZOR_SET_DELTA)
+		align = sizeof (uint32_t);
+	else if (set->flags & RAZOR_SET_HUGE_PAGE_ALIGNED)
+		align = RAZOR_HUGE_PAGE_ALIGN;
+	else
+		align = RAZOR_SECTION_ALIGN;
+
+	header->magic = RAZOR_MAGIC;
+	header->version = RAZOR_VERSION;
+	header->flags = set->flags;
+	header->num_sections = array_size;
+	offset = sizeof *header + array_size * sizeof *out_sections;
+
+	array_init(pool);
+	hashtable_init(&table, pool);
+
+	for (i = 0; i < array_size; i++)
+		out_sections[i].name =
+			hashtable_tokenize(&table, sections[i].name);
+	hashtable_release(&table);
+
+	offset += pool->size;
+
+	/* Empty sections aren't aligned, there's nothing to map. */
+	for (i = 0; i < array_size; i++) {
+		a = (void *) set + sections[i].offset;
+		if (a->size > 0)
+			offset = ALIGN(offset, align);
+		out_sections[i].offset = offset;
+		out_sections[i].size = a->size;
+		out_sections[i].checksum = razor_crc32c(0, a->data, a->size);
+		offset += a->size;
+	}
+
+	return offset;
+}
+
+/* Write the sections at the current position of fd.  The padding
+ * between sections is left as holes in the file, unless fd can't
+ * seek. */
+static int
+razor_set_write_sections_to_fd(struct razor_set *set, int fd,
+			       struct razor_set_section_index *sections,
+			       size_t array_size,
+			       struct razor_set *base, int base_fd)
+{
+	struct razor_set_header header;
+	struct razor_set_section *out_sections =
+		malloc(array_size * sizeof *out_sections);
+	struct razor_set_section *s;
+	struct array *a, pool, iov;
+	struct stat st;
+	off_t start, pos;
+	uint32_t end;
+	int i, status;
+
+	razor_set_layout_sections(set, sections, array_size,
+				  &header, out_sections, &pool);
+
+	/* Gather up the runs of data between the holes, so each goes
+	 * out in one system call, except for the sections that are
+	 * unchanged from base, which we copy from the base file. */
+	start = lseek(fd, 0, SEEK_CUR);
+	pos = start;
+	array_init(&iov);
+	add_iovec(&iov, &header, sizeof header);
+	add_iovec(&iov, out_sections, array_size * sizeof *out_sections);
+	add_iovec(&iov, pool.data, pool.size);
+
+	status = 0;
+	end = sizeof header + array_size * sizeof *out_sections + pool.size;
+	for (i = 0; i < array_size && status == 0; i++) {
+		a = (void *) set + sections[i].offset;
+		if (out_sections[i].offset > end && start < 0) {
+			add_padding(&iov, out_sections[i].offset - end);
+		} else if (out_sections[i].offset > end) {
+			status = flush_iovec(fd, &iov, pos);
+			pos = start + out_sections[i].offset;
+		}
+		end = out_sections[i].offset + a->size;
+
+		s = find_base_section(base, sections[i].name,
+				      &out_sections[i], a);
+		if (s == NULL) {
+			add_iovec(&iov, a->data, a->size);
+			continue;
+		}
+
+		if (status == 0)
+			status = flush_iovec(fd, &iov, pos);
+		if (status == 0)
+			status = copy_section(fd, pos, base_fd, s->offset,
+					      a->data, a->size);
+		if (start >= 0)
+			pos = start + end;
+	}
+
+	if (status == 0)
+		status = flush_iovec(fd, &iov, pos);
+
+	/* The last section may be preceded by a hole, and the file
+	 * may have been longer before, so set its size. */
+	if (status == 0 && start >= 0) {
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+			status = ftruncate(fd, start + end);
+		if (status == 0 && lseek(fd, start + end, SEEK_SET) < 0)
+			status = -1;
+	}
+
+	array_release(&iov);
+	free(out_sections);
+	array_release(&pool);
+
+	return status;
+}
+
+/* List all the sections set has, for writing a single file set. */
+static struct razor_set_section_index *
+razor_set_all_sections(struct razor_set *set, size_t *count_out)
+{
+	struct razor_set_section_index *sections, *s;
+	size_t count;
+
+	count = ARRAY_SIZE(razor_sections) +
+		ARRAY_SIZE(razor_details_sections) +
+		ARRAY_SIZE(razor_files_sections);
+	if (set->flags & RAZOR_SET_DELTA)
+		count += ARRAY_SIZE(razor_delta_sections);
+	sections = malloc(count * sizeof *sections);
+
+	s = sections;
+	memcpy(s, razor_sections, sizeof razor_sections);
+	s += ARRAY_SIZE(razor_sections);
+	memcpy(s, razor_details_sections, sizeof razor_details_sections);
+	s += ARRAY_SIZE(razor_details_sections);
+	memcpy(s, razor_files_sections, sizeof razor_files_sections);
+	s += ARRAY_SIZE(razor_files_sections);
+	if (set->flags & RAZOR_SET_DELTA)
+		memcpy(s, razor_delta_sections, sizeof razor_delta_sections);
+
+	*count_out = count;
+
+	return sections;
+}
+
+static int
+razor_set_write_all_sections_to_fd(struct razor_set *set, int fd,
+				   struct razor_set *base, int base_fd)
+{
+	struct razor_set_section_index *sections;
+	size_t count;
+	int status;
+
+	sections = razor_set_all_sections(set, &count);
+	status = razor_set_write_sections_to_fd(set, fd, sections, count,
+						base, base_fd);
+	free(sections);
+
+	return status;
+}
+
+/* Write set like razor_set_write_to_fd(), copying the sections that
+ * are the same as in base from base_fd, the file base was opened
+ * from. */
+int
+razor_set_write_to_fd_with_base(struct razor_set *set, int fd,
+				enum razor_repo_file_type type,
+				struct razor_set *base, int base_fd)
+{
+	if (type == RAZOR_REPO_FILE_DETAILS || type == RAZOR_REPO_FILE_ALL)
+		razor_set_bind_details(set);
+	if ((type == RAZOR_REPO_FILE_FILES || type == RAZOR_REPO_FILE_ALL) &&
+	    razor_set_bind_files(set) < 0)
+		return -1;
+
+	switch (type) {
+	case RAZOR_REPO_FILE_ALL:
+		return razor_set_write_all_sections_to_fd(set, fd,
+							  base, base_fd);
+
+	case RAZOR_REPO_FILE_MAIN:
+		return razor_set_write_sections_to_fd(set, fd,
+						      razor_sections,
+						      ARRAY_SIZE(razor_sections),
+						      base, base_fd);
+
+	case RAZOR_REPO_FILE_DETAILS:
+		return razor_set_write_sections_to_fd(set, fd,
+						      razor_details_sections,
+						      ARRAY_SIZE(razor_details_sections),
+						      base, base_fd);
+	case RAZOR_REPO_FILE_FILES:
+		return razor_set_write_sections_to_fd(set, fd,
+						      razor_files_sections,
+						      ARRAY_SIZE(razor_files_sections),
+						      base, base_fd);
+	default:
+		return -1;
+	}
+}
+
+RAZOR_EXPORT int
+razor_set_write_to_fd(struct razor_set *set, int fd,
+		      enum razor_repo_file_type type)
+{
+	return razor_set_write_to_fd_with_base(set, fd, type, NULL, -1);
+}
+
+/* Make up a temporary name next to filename. */
+static void
+unique_name(const char *filename, char *path, size_t size)
+{
+	static unsigned int counter;
+
+	snprintf(path, size, "%s.%d.%u", filename, (int) getpid(), counter++);
+}
+
+/* Create an unnamed file in the directory of filename, so that
+ * nothing can see it before it's complete.  If the file system
+ * can't do that, fall back to a uniquely named file, whose name is
+ * returned in path.  For an unnamed file, path is empty.  Without
+ * /proc, as in many chroots, an unnamed file can usually not be
+ * linked in afterwards, so use a named one from the start. */
+static int
+open_temporary(const char *filename, char *path, size_t size)
+{
+	const char *slash;
+	int fd;
+
+	slash = strrchr(filename, '/');
+	if (slash == NULL)
+		snprintf(path, size, ".");
+	else if (slash == filename)
+		snprintf(path, size, "/");
+	else
+		snprintf(path, size, "%.*s", (int) (slash - filename), filename);
+
+#ifdef O_TMPFILE
+	if (access("/proc/self/fd", X_OK) == 0) {
+		fd = open(path, O_TMPFILE | O_RDWR, 0666);
+		if (fd >= 0) {
+			path[0] = '\0';
+			return fd;
+		}
+	}
+#endif
+
+	do {
+		unique_name(filename, path, size);
+		fd = open(path, O_CREAT | O_RDWR | O_EXCL, 0666);
+	} while (fd < 0 && errno == EEXIST);
+
+	return fd;
+}
+
+/* Give the file at fd, as created by open_temporary(), the name
+ * filename, replacing whatever had that name before, and sync the
+ * directory so the new name survives a crash.  Readers that have the
+ * old file open or mapped keep seeing the old file. */
+static int
+publish_temporary(int fd, char *path, size_t size, const char *filename)
+{
+	char proc[64];
+	int status;
+
+	if (path[0] == '\0') {
+		/* linkat() can't replace an existing file, so link
+		 * the file in under a unique name and rename that.
+		 * Linking the descriptor itself needs privileges, so
+		 * go through /proc unless we have them. */
+		status = -1;
+#ifdef AT_EMPTY_PATH
+		do {
+			unique_name(filename, path, size);
+			status = linkat(fd, "", AT_FDCWD, path,
+					AT_EMPTY_PATH);
+		} while (status < 0 && errno == EEXIST);
+#endif
+		if (status < 0) {
+			snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+			do {
+				unique_name(filename, path, size);
+				status = linkat(AT_FDCWD, proc,
+						AT_FDCWD, path,
+						AT_SYMLINK_FOLLOW);
+			} while (status < 0 && errno == EEXIST);
+		}
+		if (status < 0)
+			return -1;
+	}
+
+	if (renameat(AT_FDCWD, path, AT_FDCWD, filename) < 0) {
+		unlink(path);
+		return -1;
+	}
+
+	return razor_sync_directory(filename);
+}
+
+/**
+ * razor_set_write:
+ * @set: a %razor_set
+ * @filename: the file to write
+ * @type: which sections to write
+ *
+ * Write @set to @filename.  The file is written under a temporary
+ * name, synced and then renamed into place, so anybody opening
+ * @filename sees either the old file or the complete new one, never
+ * a partly written one.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+RAZOR_EXPORT int
+razor_set_write(struct razor_set *set, const char *filename,
+		enum razor_repo_file_type type)
+{
+	char path[PATH_MAX];
+	int fd, status;
+
+	fd = open_temporary(filename, path, sizeof path);
+	if (fd < 0)
+		return -1;
+
+	status = razor_set_write_to_fd(set, fd, type);
+	if (status == 0)
+		status = fdatasync(fd);
+	if (status == 0)
+		status = publish_temporary(fd, path, sizeof path, filename);
+	else if (path[0] != '\0')
+		unlink(path);
+
+	if (close(fd) < 0)
+		status = -1;
+
+	return status;
+}
+
+/* Lay out the file in a shared mapping of it and move the sections
+ * of set over one at a time, releasing each as soon as it's copied,
+ * so that the heap and the file never both hold the whole set.  The
+ * sections that are the same as in base are copied from base_fd like
+ * razor_set_write_to_fd_with_base() does. */
+static int
+razor_set_move_sections_to_fd(struct razor_set *set, int fd,
+			      struct razor_set *base, int base_fd)
+{
+	struct razor_set_section_index *sections;
+	struct razor_set_header *header;
+	struct razor_set_section *out_sections, *s;
+	struct array *a, pool;
+	size_t count, table_size;
+	uint32_t size;
+	void *p;
+	int i, status;
+
+	sections = razor_set_all_sections(set, &count);
+	table_size = count * sizeof *out_sections;
+	header = malloc(sizeof *header + table_size);
+	out_sections = (void *) header + sizeof *header;
+	size = razor_set_layout_sections(set, sections, count,
+					 header, out_sections, &pool);
+
+	if (ftruncate(fd, size) < 0) {
+		p = MAP_FAILED;
+	} else {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	}
+	if (p == MAP_FAILED) {
+		free(header);
+		free(sections);
+		array_release(&pool);
+		return -1;
+	}
+
+	memcpy(p, header, sizeof *header + table_size);
+	memcpy(p + sizeof *header + table_size, pool.data, pool.size);
+	status = 0;
+	for (i = 0; i < count; i++) {
+		a = (void *) set + sections[i].offset;
+		s = find_base_section(base, sections[i].name,
+				      &out_sections[i], a);
+		if (s != NULL && status == 0)
+			status = copy_section(fd, out_sections[i].offset,
+					      base_fd, s->offset,
+					      a->data, a->size);
+		else if (a->size > 0)
+			memcpy(p + out_sections[i].offset, a->data, a->size);
+		free(a->data);
+		array_init(a);
+	}
+
+	munmap(p, size);
+	free(header);
+	free(sections);
+	array_release(&pool);
+
+	return status;
+}
+
+/* Write set to fd, which must be empty and open for reading and
+ * writing, as razor_set_move_to_file() does, with the sections that
+ * are unchanged from base copied from base_fd.  set is destroyed. */
+int
+razor_set_move_to_fd_with_base(struct razor_set *set, int fd,
+			       struct razor_set *base, int base_fd)
+{
+	int status;
+
+	/* A set that's mapped from a file has nothing to release. */
+	if (set->header != NULL)
+		status = razor_set_write_to_fd_with_base(set, fd,
+							 RAZOR_REPO_FILE_ALL,
+							 base, base_fd);
+	else
+		status = razor_set_move_sections_to_fd(set, fd,
+						       base, base_fd);
+	razor_set_destroy(set);
+
+	return status;
+}
+
+/**
+ * razor_set_move_to_file:
+ * @set: a %razor_set, as returned by razor_importer_finish() or
+ * razor_merger_finish()
+ * @filename: the file to write
+ *
+ * Write @set to @filename like razor_set_write() with
+ * %RAZOR_REPO_FILE_ALL, and return the set as mapped from the new
+ * file.  The sections are copied straight into a mapping of the file
+ * and freed one by one, so unlike writing the set and opening it
+ * again, this never needs memory for two copies of the set, and
+ * the file isn't written out through write().  @set is destroyed,
+ * even on failure.
+ *
+ * Returns: the %razor_set for @filename, or %NULL on error.
+ **/
+RAZOR_EXPORT struct razor_set *
+razor_set_move_to_file(struct razor_set *set, const char *filename)
+{
+	char path[PATH_MAX];
+	int fd, status;
+
+	assert (set != NULL);
+	assert (set->layers == NULL);
+
+	fd = open_temporary(filename, path, sizeof path);
+	if (fd < 0) {
+		razor_set_destroy(set);
+		return NULL;
+	}
+
+	status = razor_set_move_to_fd_with_base(set, fd, NULL, -1);
+	if (status == 0)
+		status = fdatasync(fd);
+	if (status == 0)
+		status = publish_temporary(fd, path, sizeof path, filename);
+	else if (path[0] != '\0')
+		unlink(path);
+
+	if (close(fd) < 0)
+		status = -1;
+
+	return status == 0 ? razor_set_open(filename) : NULL;
+}
+
+RAZOR_EXPORT void
+razor_build_evr(char *evr_buf, int size, const char *epoch,
+		const char *version, const char *release)
+{
+	int len;
+
+	if (!version || !*version) {
+		*evr_buf = '\0';
+		return;
+	}
+
+	if (epoch && *epoch && strcmp(epoch, "0") != 0) {
+		len = snprintf(evr_buf, size, "%s:", epoch);
+		evr_buf += len;
+		size -= len;
+	}
+	len = snprintf(evr_buf, size, "%s", version);
+	evr_buf += len;
+	size -= len;
+	if (release && *release)
+		snprintf(evr_buf, size, "-%s", release);
+}
+
+/* Versions are compared as a sequence of tokens: the epoch, the
+ * number the version starts with, both 0 if missing, and then each
+ * digit run as a number and any other character as itself, up to
+ * the end of the string.  A number is written to a key as
+ * RAZOR_VERSION_KEY_NUMBER, the number of digits without the leading
+ * zeros, and those digits, so comparing a number against a character
+ * compares the character against '0'.  The end is a 0 byte. */
+#define RAZOR_VERSION_KEY_NUMBER	'0'
+
+enum version_cursor_state {
+	VERSION_EPOCH,
+	VERSION_START,
+	VERSION_REST
+};
+
+struct version_cursor {
+	const char *p;
+	enum version_cursor_state state;
+};
+
+static const char *
+scan_number(const char *p, const char **digits, size_t *length)
+{
+	const char *end;
+
+	while (*p == '0')
+		p++;
+	for (end = p; isdigit((unsigned char) *end); end++)
+		;
+
+	/* Numbers with more than 255 digits compare on the first
+	 * 255. */
+	*digits = p;
+	*length = end - p < 255 ? end - p : 255;
+
+	return end;
+}
+
+/* Return the next token of the version: RAZOR_VERSION_KEY_NUMBER,
+ * with *digits pointing to the *length digits of the number, or a
+ * character, with *digits set to NULL. */
+static int
+next_version_token(struct version_cursor *cursor,
+		   const char **digits, size_t *length)
+{
+	const char *p;
+
+	switch (cursor->state) {
+	case VERSION_EPOCH:
+		cursor->state = VERSION_START;
+		for (p = cursor->p; isdigit((unsigned char) *p); p++)
+			;
+		if (*p == ':') {
+			scan_number(cursor->p, digits, length);
+			cursor->p = p + 1;
+		} else {
+			*digits = cursor->p;
+			*length = 0;
+		}
+		return RAZOR_VERSION_KEY_NUMBER;
+
+	case VERSION_START:
+		cursor->state = VERSION_REST;
+		cursor->p = scan_number(cursor->p, digits, length);
+		return RAZOR_VERSION_KEY_NUMBER;
+
+	default:
+		if (isdigit((unsigned char) *cursor->p)) {
+			cursor->p = scan_number(cursor->p, digits, length);
+			return RAZOR_VERSION_KEY_NUMBER;
+		}
+		*digits = NULL;
+		if (*cursor->p == '\0')
+			return '\0';
+		return (unsigned char) *cursor->p++;
+	}
+}
+
+static inline void
+put_key_byte(char *key, size_t size, size_t *length, int c)
+{
+	if (*length < size)
+		key[*length] = c;
+	(*length)++;
+}
+
+/**
+ * razor_version_key:
+ * @version: an EVR string
+ * @key: the buffer for the key
+ * @size: the size of @key
+ *
+ * Compile @version into a key, such that comparing the keys of two
+ * versions with memcmp() orders them the way razor_versioncmp()
+ * does.  Two different keys differ before the end of the shorter
+ * one.  A missing epoch counts as 0, numbers compare by value, and
+ * other characters compare as unsigned bytes.  Like strxfrm(), at
+ * most @size bytes are written, and @key is only complete if the
+ * returned length fits.
+ *
+ * Returns: the length of the key.
+ **/
+RAZOR_EXPORT size_t
+razor_version_key(const char *version, char *key, size_t size)
+{
+	struct version_cursor cursor;
+	const char *digits;
+	size_t length, count, i;
+	int token;
+
+	assert (version != NULL);
+
+	cursor.p = version;
+	cursor.state = VERSION_EPOCH;
+	length = 0;
+	do {
+		token = next_version_token(&cursor, &digits, &count);
+		put_key_byte(key, size, &length, token);
+		if (digits == NULL)
+			continue;
+		put_key_byte(key, size, &length, count);
+		for (i = 0; i < count; i++)
+			put_key_byte(key, size, &length, digits[i]);
+	} while (token != '\0');
+
+	return length;
+}
+
+/* This compares the tokens as they come, which gives the same result
+ * as comparing the keys but stops at the first difference. */
+RAZOR_EXPORT int
+razor_versioncmp(const char *s1, const char *s2)
+{
+	struct version_cursor cursor1, cursor2;
+	const char *digits1, *digits2;
+	size_t length1, length2;
+	int token1, token2, cmp;
+
+	assert (s1 != NULL);
+	assert (s2 != NULL);
+
+	cursor1.p = s1;
+	cursor1.state = VERSION_EPOCH;
+	cursor2.p = s2;
+	cursor2.state = VERSION_EPOCH;
+	do {
+		token1 = next_version_token(&cursor1, &digits1, &length1);
+		token2 = next_version_token(&cursor2, &digits2, &length2);
+		if (token1 != token2)
+			return token1 < token2 ? -1 : 1;
+		if (digits1 == NULL)
+			continue;
+		if (length1 != length2)
+			return length1 < length2 ? -1 : 1;
+		cmp = memcmp(digits1, digits2, length1);
+		if (cmp != 0)
+			return cmp < 0 ? -1 : 1;
+	} while (token1 != '\0');
+
+	return 0;
+}
+
+/* Find the range [*start, *end) of packages whose name begins with
+ * the first len bytes of prefix.  The packages array is sorted by
+ * name, so this is just two binary searches.  Passing strlen(name) +
+ * 1 for len includes the terminating NUL in the comparison and gives
+ * the range of packages with exactly that name. */
+void
+razor_set_find_package_range(struct razor_set *set,
+			     const char *prefix, size_t len,
+			     struct razor_package **start,
+			     struct razor_package **end)
+{
+	struct razor_package *packages;
+	const char *pool;
+	uint32_t lo, hi, mid, count, first;
+
+	packages = set->packages.data;
+	pool = set->string_pool.data;
+	count = set->packages.size / sizeof *packages;
+
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(&pool[packages[mid].name], prefix, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+
+	hi = count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(&pool[packages[mid].name], prefix, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*start = packages + first;
+	*end = packages + lo;
+}
+
+static int
+compare_pool_strings(const void *p1, const void *p2, void *data)
+{
+	const uint32_t *s1 = p1, *s2 = p2;
+	const char *pool = data;
+
+	return strcmp(&pool[*s1], &pool[*s2]);
+}
+
+/* Make pool the string pool of set, where map gives the new offset
+ * of each string of the old pool. */
+static void
+replace_string_pool(struct razor_set *set, struct array *pool, uint32_t *map)
+{
+	struct razor_package *pkg, *pkg_end;
+	struct razor_property *prop, *prop_end;
+	struct razor_property_name *n, *n_end;
+
+	pkg_end = set->packages.data + set->packages.size;
+	for (pkg = set->packages.data; pkg < pkg_end; pkg++) {
+		pkg->name = map[pkg->name];
+		pkg->version = map[pkg->version];
+		pkg->arch = map[pkg->arch];
+	}
+
+	prop_end = set->properties.data + set->properties.size;
+	for (prop = set->properties.data; prop < prop_end; prop++) {
+		prop->name = map[prop->name];
+		prop->version = map[prop->version];
+	}
+
+	n_end = set->property_names.data + set->property_names.size;
+	for (n = set->property_names.data; n < n_end; n++)
+		n->name = map[n->name];
+
+	array_release(&set->string_pool);
+	set->string_pool = *pool;
+
+	/* The offsets have all moved. */
+	array_release(&set->string_index);
+	array_init(&set->string_index);
+}
+
+/* Rewrite the string pool in lexicographic order and remap all string
+ * offsets in the set.  Duplicate strings are collapsed, so afterwards
+ * two strings compare the same way as their offsets do.  The empty
+ * string sorts first and stays at offset 0. */
+void
+razor_set_sort_string_pool(struct razor_set *set)
+{
+	struct array strings, pool;
+	uint32_t *s, *end, *map, offset;
+	const char *old;
+	char *p;
+	int len;
+
+	old = set->string_pool.data;
+	array_init(&strings);
+	for (offset = 0; offset < set->string_pool.size; offset += len + 1) {
+		len = strlen(&old[offset]);
+		s = array_add(&strings, sizeof *s);
+		*s = offset;
+	}
+
+	free(razor_sort_with_data(strings.data,
+				  strings.size / sizeof *s, sizeof *s,
+				  compare_pool_strings, set->string_pool.data));
+
+	map = malloc(set->string_pool.size * sizeof *map);
+	array_init(&pool);
+	end = strings.data + strings.size;
+	for (s = strings.data; s < end; s++) {
+		if (s > (uint32_t *) strings.data &&
+		    strcmp(&old[s[-1]], &old[s[0]]) == 0) {
+			map[s[0]] = map[s[-1]];
+			continue;
+		}
+		len = strlen(&old[*s]) + 1;
+		p = array_add(&pool, len);
+		memcpy(p, &old[*s], len);
+		map[*s] = p - (char *) pool.data;
+	}
+	array_release(&strings);
+
+	replace_string_pool(set, &pool, map);
+	free(map);
+	set->flags |= RAZOR_SET_SORTED_STRING_POOL;
+}
+
+/* Drop the strings that nothing in set refers to any more, keeping
+ * the order of the rest.  A merger that starts from the pool of the
+ * old set keeps the strings of the packages it leaves out, and
+ * without this the pool of a set that's only ever updated would keep
+ * growing.  Compacting isn't worth it for a few dead strings, so this
+ * only happens once they take up more than an eighth of the pool.
+ * Returns 1 if the pool was rewritten. */
+int
+razor_set_compact_string_pool(struct razor_set *set)
+{
+	struct razor_package *pkg, *pkg_end;
+	struct razor_property *prop, *prop_end;
+	struct array pool;
+	uint32_t *map, offset, size, used;
+	const char *old;
+	char *live, *p;
+	int len;
+
+	old = set->string_pool.data;
+	size = set->string_pool.size;
+	live = zalloc(size + 1);
+	live[0] = 1;
+
+	pkg_end = set->packages.data + set->packages.size;
+	for (pkg = set->packages.data; pkg < pkg_end; pkg++) {
+		live[pkg->name] = 1;
+		live[pkg->version] = 1;
+		live[pkg->arch] = 1;
+	}
+
+	prop_end = set->properties.data + set->properties.size;
+	for (prop = set->properties.data; prop < prop_end; prop++) {
+		live[prop->name] = 1;
+		live[prop->version] = 1;
+	}
+
+	used = 0;
+	for (offset = 0; offset < size; offset += len + 1) {
+		len = strlen(&old[offset]);
+		if (live[offset])
+			used += len + 1;
+	}
+
+	if ((size - used) * 8 <= size) {
+		free(live);
+		return 0;
+	}
+
+	map = malloc(size * sizeof *map);
+	array_init(&pool);
+	for (offset = 0; offset < size; offset += len + 1) {
+		len = strlen(&old[offset]);
+		if (!live[offset])
+			continue;
+		p = array_add(&pool, len + 1);
+		memcpy(p, &old[offset], len + 1);
+		map[offset] = p - (char *) pool.data;
+	}
+	free(live);
+
+	replace_string_pool(set, &pool, map);
+	free(map);
+
+	return 1;
+}
+
+/* Save the hash table over the string pool in the set, so that a
+ * merger that starts from this set can reuse it instead of hashing
+ * every string again. */
+void
+razor_set_build_string_index(struct razor_set *set)
+{
+	struct hashtable table;
+	const char *pool;
+	uint32_t offset;
+
+	/* Offset 0 is the empty string, which the table can't hold,
+	 * as 0 marks an empty bucket. */
+	pool = set->string_pool.data;
+	hashtable_init(&table, &set->string_pool);
+	for (offset = strlen(pool) + 1;
+	     offset < set->string_pool.size;
+	     offset += strlen(&pool[offset]) + 1)
+		hashtable_add(&table, offset);
+
+	array_release(&set->string_index);
+	hashtable_take_index(&table, &set->string_index);
+}
+
+struct version_key {
+	uint32_t version;
+	uint32_t key, size;
+};
+
+static int
+compare_version_keys(const void *p1, const void *p2, void *data)
+{
+	const struct version_key *v1 = p1, *v2 = p2;
+	const char *keys = data;
+
+	return razor_version_key_compare(&keys[v1->key], v1->size,
+					 &keys[v2->key], v2->size);
+}
+
+static void
+add_version_key(struct array *versions, struct array *keys,
+		uint32_t *ranks, const char *pool, uint32_t version)
+{
+	struct version_key *v;
+	size_t max;
+
+	if (ranks[version] != RAZOR_NO_RANK)
+		return;
+	ranks[version] = 0;
+
+	max = RAZOR_VERSION_KEY_MAX(strlen(&pool[version]));
+	v = array_add(versions, sizeof *v);
+	v->version = version;
+	v->key = keys->size;
+	v->size = razor_version_key(&pool[version],
+				    array_add(keys, max), max);
+	keys->size -= max - v->size;
+}
+
+/* Store the key of each rank in the version keys section.  The
+ * versions are sorted, and count is the number of ranks. */
+static void
+build_version_keys(struct razor_set *set, struct version_key *start,
+		   struct version_key *end, const char *keys, uint32_t count)
+{
+	struct array *section = &set->version_keys;
+	struct version_key *v;
+	uint32_t *offsets, offset, rank;
 
-	for (i = 0; i < (*header)->num_sections; i++) {
-		int j;
-		s = sections + i;
-		for (j = 0; j < section_index_size; j++)
-			if (!strcmp(section_index[j].name,
-				    &pool[s->name]))
-				break;
-		if (j == section_index_size)
+	array_release(section);
+	array_init(section);
+	if (start == end)
+		return;
+
+	offsets = array_add(section, (count + 2) * sizeof *offsets);
+	offsets[0] = count;
+	offset = 0;
+	rank = 0;
+	for (v = start; v < end; v++) {
+		if (v > start &&
+		    compare_version_keys(v - 1, v, (void *) keys) == 0)
 			continue;
-		array = (void *) set + section_index[j].offset;
-		array->data = (void *) *header + s->offset;
-		array->size = s->size;
-		array->alloc = s->size;
+		memcpy(array_add(section, v->size), &keys[v->key], v->size);
+		offsets = section->data;
+		offsets[++rank] = offset;
+		offset += v->size;
 	}
-	close(fd);
-
-	return 0;
+	offsets[count + 1] = offset;
 }
 
-RAZOR_EXPORT struct razor_set *
-razor_set_open(const char *filename)
+/* Sort the distinct version strings used by the packages and
+ * properties of the set by their version keys and return a table,
+ * indexed by string offset, of their ranks in that order.  Versions
+ * that razor_versioncmp() considers equal get the same rank.  Only
+ * the entries for version strings are valid.  If the set has
+ * RAZOR_SET_VERSION_KEYS, this also fills in its version keys. */
+uint32_t *
+razor_set_rank_versions(struct razor_set *set)
 {
-	struct razor_set *set;
+	struct razor_package *pkg, *pkg_end;
+	struct razor_property *prop, *prop_end;
+	struct version_key *v, *start, *end;
+	struct array versions, keys;
+	uint32_t *ranks, rank;
+	const char *pool;
 
-	set = zalloc(sizeof *set);
-	if (razor_set_bind_sections(set, &set->header, &set->header_size,
-				    razor_sections, ARRAY_SIZE(razor_sections),
-				    filename)){
-		free(set);
-		return NULL;
+	pool = set->string_pool.data;
+	ranks = malloc(set->string_pool.size * sizeof *ranks);
+	memset(ranks, 0xff, set->string_pool.size * sizeof *ranks);
+	array_init(&versions);
+	array_init(&keys);
+
+	pkg_end = set->packages.data + set->packages.size;
+	for (pkg = set->packages.data; pkg < pkg_end; pkg++)
+		add_version_key(&versions, &keys, ranks, pool, pkg->version);
+
+	prop_end = set->properties.data + set->properties.size;
+	for (prop = set->properties.data; prop < prop_end; prop++)
+		add_version_key(&versions, &keys, ranks, pool, prop->version);
+
+	start = versions.data;
+	end = versions.data + versions.size;
+	free(razor_sort_with_data(start, end - start, sizeof *v,
+				  compare_version_keys, keys.data));
+
+	for (v = start, rank = 0; v < end; v++) {
+		if (v > start && compare_version_keys(v - 1, v, keys.data))
+			rank++;
+		ranks[v->version] = rank;
 	}
-	return set;
+
+	if (set->flags & RAZOR_SET_VERSION_KEYS)
+		build_version_keys(set, start, end, keys.data, rank + 1);
+
+	array_release(&versions);
+	array_release(&keys);
+
+	return ranks;
 }
 
-RAZOR_EXPORT int
-razor_set_open_details(struct razor_set *set, const char *filename)
+/* Write the version rank sections from a table returned by
+ * razor_set_rank_versions().  This has to run after the packages and
+ * properties are in their final order. */
+void
+razor_set_build_version_ranks(struct razor_set *set, uint32_t *ranks)
 {
-	return razor_set_bind_sections(set, &set->details_header,
-				       &set->details_header_size,
-				       razor_details_sections,
-				       ARRAY_SIZE(razor_details_sections),
-				       filename);
+	struct razor_package *pkg, *pkg_end;
+	struct razor_property *prop, *prop_end;
+	uint32_t *r;
+
+	array_release(&set->package_version_ranks);
+	array_init(&set->package_version_ranks);
+	array_release(&set->property_version_ranks);
+	array_init(&set->property_version_ranks);
+
+	pkg_end = set->packages.data + set->packages.size;
+	for (pkg = set->packages.data; pkg < pkg_end; pkg++) {
+		r = array_add(&set->package_version_ranks, sizeof *r);
+		*r = ranks[pkg->version];
+	}
+
+	prop_end = set->properties.data + set->properties.size;
+	for (prop = set->properties.data; prop < prop_end; prop++) {
+		r = array_add(&set->property_version_ranks, sizeof *r);
+		*r = ranks[prop->version];
+	}
 }
 
-RAZOR_EXPORT int
-razor_set_open_files(struct razor_set *set, const char *filename)
+static void
+compact_list(struct list_head *head, struct array *source,
+	     struct list_table *table, struct array *items, int packed)
 {
-	return razor_set_bind_sections(set, &set->files_header,
-				       &set->files_header_size,
-				       razor_files_sections,
-				       ARRAY_SIZE(razor_files_sections),
-				       filename);
+	struct list_iterator li;
+	uint32_t data;
+
+	items->size = 0;
+	list_iterator_init(&li, head, source);
+	while (list_iterator_next(&li, &data))
+		*(uint32_t *) array_add(items, sizeof data) = data;
+	list_table_set_array(table, head, items, packed);
 }
 
-RAZOR_EXPORT void
-razor_set_destroy(struct razor_set *set)
+/* Rewrite the list pools so that equal lists are stored only once,
+ * and with the long package and file lists packed if the set has
+ * RAZOR_SET_PACKED_LISTS.  This has to be the last step when building
+ * a set, since lists can't be appended to or remapped after this. */
+void
+razor_set_compact_lists(struct razor_set *set)
 {
-	struct array *a;
-	int i;
+	struct razor_property *prop, *prop_end;
+	struct razor_entry *entry, *entry_end;
+	struct razor_package *pkg, *pkg_end;
+	struct array property_pool, package_pool, file_pool, items;
+	struct list_table properties, packages, files;
+	int packed;
+
+	array_init(&property_pool);
+	array_init(&package_pool);
+	array_init(&file_pool);
+	array_init(&items);
+	list_table_init(&properties, &property_pool);
+	list_table_init(&packages, &package_pool);
+	list_table_init(&files, &file_pool);
+	packed = (set->flags & RAZOR_SET_PACKED_LISTS) != 0;
+
+	pkg_end = set->packages.data + set->packages.size;
+	for (pkg = set->packages.data; pkg < pkg_end; pkg++) {
+		compact_list(&pkg->properties, &set->property_pool,
+			     &properties, &items, 0);
+		compact_list(&pkg->files, &set->file_pool,
+			     &files, &items, packed);
+	}
 
-	assert (set != NULL);
+	prop_end = set->properties.data + set->properties.size;
+	for (prop = set->properties.data; prop < prop_end; prop++)
+		compact_list(&prop->packages, &set->package_pool,
+			     &packages, &items, packed);
+
+	entry_end = set->files.data + set->files.size;
+	for (entry = set->files.data; entry < entry_end; entry++)
+		compact_list(&entry->packages, &set->package_pool,
+			     &packages, &items, packed);
+
+	list_table_release(&properties);
+	list_table_release(&packages);
+	list_table_release(&files);
+	array_release(&items);
+
+	array_release(&set->property_pool);
+	set->property_pool = property_pool;
+	array_release(&set->package_pool);
+	set->package_pool = package_pool;
+	array_release(&set->file_pool);
+	set->file_pool = file_pool;
+}
 
-	if (set->header) {
-		munmap(set->header, set->header_size);
-	} else {
-		for (i = 0; i < ARRAY_SIZE(razor_sections); i++) {
-			a = (void *) set + razor_sections[i].offset;
-			free(a->data);
-		}
-	}
+void
+razor_version_cache_init(struct razor_version_cache *cache,
+			 struct razor_set *set1, struct razor_set *set2)
+{
+	memset(cache, 0, sizeof *cache);
+	cache->set1 = set1;
+	cache->set2 = set2;
+}
 
-	if (set->details_header) {
-		munmap(set->details_header, set->details_header_size);
-	} else {
-		for (i = 0; i < ARRAY_SIZE(razor_details_sections); i++) {
-			a = (void *) set + razor_details_sections[i].offset;
-			free(a->data);
-		}
-	}
+/* Compare version1 from the string pool of set1 with version2 from
+ * the string pool of set2. */
+int
+razor_version_cache_compare(struct razor_version_cache *cache,
+			    uint32_t version1, uint32_t version2)
+{
+	const char *pool1, *pool2;
+	uint32_t hash;
+	int cmp;
+
+	hash = (version1 * 2654435761u) ^ version2;
+	hash = (hash ^ (hash >> 16)) % RAZOR_VERSION_CACHE_SIZE;
+	if (cache->entries[hash].version1 == version1 &&
+	    cache->entries[hash].version2 == version2)
+		return cache->entries[hash].result;
+
+	pool1 = cache->set1->string_pool.data;
+	pool2 = cache->set2->string_pool.data;
+	cmp = razor_versioncmp(&pool1[version1], &pool2[version2]);
+	cmp = cmp < 0 ? -1 : cmp > 0;
+
+	cache->entries[hash].version1 = version1;
+	cache->entries[hash].version2 = version2;
+	cache->entries[hash].result = cmp;
+
+	return cmp;
+}
 
-	if (set->files_header) {
-		munmap(set->files_header, set->files_header_size);
-	} else {
-		for (i = 0; i < ARRAY_SIZE(razor_files_sections); i++) {
-			a = (void *) set + razor_files_sections[i].offset;
-			free(a->data);
+/* Build the property name index from the sorted properties array.
+ * Names are tokenized, so equal names have equal string offsets. */
+void
+razor_set_build_property_names(struct razor_set *set)
+{
+	struct razor_property *properties;
+	struct razor_property_name *n;
+	uint32_t i, j, k, t, count;
+
+	properties = set->properties.data;
+	count = set->properties.size / sizeof *properties;
+
+	array_release(&set->property_names);
+	array_init(&set->property_names);
+
+	for (i = 0; i < count; i = j) {
+		for (j = i; j < count && properties[j].name == properties[i].name; j++)
+			;
+
+		n = array_add(&set->property_names, sizeof *n);
+		n->name = properties[i].name;
+		for (k = i, t = 0; t < ARRAY_SIZE(n->start); t++) {
+			while (k < j &&
+			       RAZOR_PROPERTY_TYPE_INDEX(properties[k].flags) < t)
+				k++;
+			n->start[t] = k;
 		}
 	}
-
-	free(set);
 }
 
-static int
-razor_set_write_sections_to_fd(struct razor_set *set, int fd,
-			       struct razor_set_section_index *sections,
-			       size_t array_size)
+void
+razor_property_name_get_range(struct razor_set *set,
+			      struct razor_property_name *name, uint32_t type,
+			      struct razor_property **start,
+			      struct razor_property **end)
 {
-	struct razor_set_header header;
-	struct razor_set_section *out_sections =
-		malloc(array_size * sizeof *out_sections);
-	struct hashtable table;
-	struct array *a, pool;
-	uint32_t offset;
-	int i;
-
-	header.magic = RAZOR_MAGIC;
-	header.version = RAZOR_VERSION;
-	header.num_sections = array_size;
-	offset = sizeof header + array_size * sizeof *out_sections;
-
-	array_init(&pool);
-	hashtable_init(&table, &pool);
+	struct razor_property *properties;
+	struct razor_property_name *names_end;
+	uint32_t t, last;
+
+	properties = set->properties.data;
+	names_end = set->property_names.data + set->property_names.size;
+
+	t = RAZOR_PROPERTY_TYPE_INDEX(type);
+	if (t + 1 < ARRAY_SIZE(name->start))
+		last = name->start[t + 1];
+	else if (name + 1 < names_end)
+		last = name[1].start[0];
+	else
+		last = set->properties.size / sizeof *properties;
+
+	*start = properties + name->start[t];
+	*end = properties + last;
+}
 
-	for (i = 0; i < array_size; i++)
-		out_sections[i].name =
-			hashtable_tokenize(&table, sections[i].name);
+/* Find the range [*start, *end) of properties of the given type and
+ * name.  Use the property name index if the set has one, otherwise
+ * binary search the properties array directly.  Sets written without
+ * the index sort the properties of a name by all of their flags, so
+ * requires with %RAZOR_PROPERTY_PRE and friends come after the other
+ * types; there the range holds every property of the name and the
+ * caller has to skip those of other types. */
+void
+razor_set_find_property_range(struct razor_set *set,
+			      const char *name, uint32_t type,
+			      struct razor_property **start,
+			      struct razor_property **end)
+{
+	struct razor_property_name *names;
+	struct razor_property *properties;
+	const char *pool;
+	uint32_t lo, hi, mid, count;
+
+	pool = set->string_pool.data;
+
+	if (set->property_names.size > 0) {
+		names = set->property_names.data;
+		lo = 0;
+		hi = set->property_names.size / sizeof *names;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (strcmp(&pool[names[mid].name], name) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
 
-	offset += pool.size;
+		if (lo * sizeof *names < set->property_names.size &&
+		    strcmp(&pool[names[lo].name], name) == 0) {
+			razor_property_name_get_range(set, &names[lo], type,
+						      start, end);
+		} else {
+			*start = NULL;
+			*end = NULL;
+		}
 
-	for (i = 0; i < array_size; i++) {
-		a = (void *) set + sections[i].offset;
-		out_sections[i].offset = offset;
-		out_sections[i].size = a->size;
-		offset += a->size;
+		return;
 	}
 
-	razor_write(fd, &header, sizeof header);
-	razor_write(fd, out_sections, array_size * sizeof *out_sections);
-	razor_write(fd, pool.data, pool.size);
-
-	for (i = 0; i < array_size; i++) {
-		a = (void *) set + sections[i].offset;
-		razor_write(fd, a->data, a->size);
+	properties = set->properties.data;
+	count = set->properties.size / sizeof *properties;
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(&pool[properties[mid].name], name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	free(out_sections);
+	hi = lo;
+	while (hi < count && strcmp(&pool[properties[hi].name], name) == 0)
+		hi++;
 
-	return 0;
+	*start = properties + lo;
+	*end = properties + hi;
 }
 
-RAZOR_EXPORT int
-razor_set_write_to_fd(struct razor_set *set, int fd,
-		      enum razor_repo_file_type type)
+/**
+ * razor_set_get_package:
+ * @set: a %razor_set
+ * @package: the name of the package to look up
+ *
+ * Look up a package by name.  If the set holds several versions of
+ * the package, the lowest version is returned.  Use
+ * razor_package_iterator_create_for_name() to get all of them.  In
+ * an overlay set, the package comes from the highest layer that has
+ * one by that name.
+ *
+ * Returns: the package or %NULL if the set has no package by that name.
+ **/
+RAZOR_EXPORT struct razor_package *
+razor_set_get_package(struct razor_set *set, const char *package)
 {
-	switch (type) {
-	case RAZOR_REPO_FILE_MAIN:
-		return razor_set_write_sections_to_fd(set, fd,
-						      razor_sections,
-						      ARRAY_SIZE(razor_sections));
+	struct razor_package *start, *end;
+	struct razor_layer *layer;
+	uint32_t i;
 
-	case RAZOR_REPO_FILE_DETAILS:
-		return razor_set_write_sections_to_fd(set, fd,
-						      razor_details_sections,
-						      ARRAY_SIZE(razor_details_sections));
-	case RAZOR_REPO_FILE_FILES:
-		return razor_set_write_sections_to_fd(set, fd,
-						      razor_files_sections,
-						      ARRAY_SIZE(razor_files_sections));
-	default:
-		return -1;
+	assert (set != NULL);
+	assert (package != NULL);
+
+	for (i = set->layer_count; i > 0; i--) {
+		layer = &set->layers[i - 1];
+		razor_set_find_package_range(layer->set,
+					     package, strlen(package) + 1,
+					     &start, &end);
+		while (start < end &&
+		       razor_layer_package_is_hidden(layer, start))
+			start++;
+		if (start < end)
+			return start;
 	}
+
+	razor_set_find_package_range(set, package, strlen(package) + 1,
+				     &start, &end);
+	if (start == end)
+		return NULL;
+
+	return start;
 }
 
-RAZOR_EXPORT int
-razor_set_write(struct razor_set *set, const char *filename,
-		enum razor_repo_file_type type)
+static int
+compress_details_block(struct array *out, const char *data, size_t size)
 {
-	int fd, status;
+	uLongf length;
+	Bytef *p;
 
-	fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-	if (fd < 0)
+	length = compressBound(size);
+	p = array_add(out, length);
+	if (compress2(p, &length, (const Bytef *) data, size,
+		      Z_BEST_COMPRESSION) != Z_OK)
 		return -1;
+	out->size -= compressBound(size) - length;
 
-	status = razor_set_write_to_fd(set, fd, type);
-	if (status) {
-	    close(fd);
-	    return status;
+	return 0;
+}
+
+/* Replace the details string pool with its compressed blocks.  This
+ * is done last when building a set, the merger and the importer only
+ * ever add to an uncompressed pool.  If zlib fails, the pool is left
+ * uncompressed. */
+void
+razor_set_compress_details(struct razor_set *set)
+{
+	struct razor_details_block *b;
+	struct array out;
+	const char *pool;
+	uint32_t start, p, size, len;
+
+	array_init(&out);
+	array_release(&set->details_blocks);
+	array_init(&set->details_blocks);
+
+	pool = set->details_string_pool.data;
+	size = set->details_string_pool.size;
+	for (start = 0, p = 0; p < size; p += len) {
+		len = strlen(pool + p) + 1;
+		if (p > start && p + len - start > RAZOR_DETAILS_BLOCK_SIZE) {
+			b = array_add(&set->details_blocks, sizeof *b);
+			b->offset = start;
+			b->compressed = out.size;
+			if (compress_details_block(&out, pool + start,
+						   p - start) < 0)
+				goto fail;
+			start = p;
+		}
+	}
+	if (start < size) {
+		b = array_add(&set->details_blocks, sizeof *b);
+		b->offset = start;
+		b->compressed = out.size;
+		if (compress_details_block(&out, pool + start,
+					   size - start) < 0)
+			goto fail;
 	}
 
-	return close(fd);
+	b = array_add(&set->details_blocks, sizeof *b);
+	b->offset = size;
+	b->compressed = out.size;
+
+	array_release(&set->details_string_pool);
+	set->details_string_pool = out;
+	set->flags |= RAZOR_SET_COMPRESSED_DETAILS;
+	return;
+
+fail:
+	fprintf(stderr, "failed to compress details\n");
+	array_release(&out);
+	array_release(&set->details_blocks);
+	array_init(&set->details_blocks);
+	set->flags &= ~RAZOR_SET_COMPRESSED_DETAILS;
 }
 
-RAZOR_EXPORT void
-razor_build_evr(char *evr_buf, int size, const char *epoch,
-		const char *version, const char *release)
+static char *
+razor_set_read_details_block(struct razor_set *set, uint32_t block)
 {
-	int len;
-
-	if (!version || !*version) {
-		*evr_buf = '\0';
-		return;
+	struct razor_details_cache *cache;
+	struct razor_details_block *blocks;
+	uint32_t size;
+	uLongf length;
+	char *data;
+	int i, lru;
+
+	if (set->details_cache == NULL)
+		set->details_cache = zalloc(sizeof *set->details_cache);
+	cache = set->details_cache;
+
+	lru = 0;
+	for (i = 0; i < RAZOR_DETAILS_CACHE_SIZE; i++) {
+		if (cache->entries[i].data &&
+		    cache->entries[i].block == block) {
+			cache->entries[i].used = ++cache->clock;
+			return cache->entries[i].data;
+		}
+		if (cache->entries[i].used < cache->entries[lru].used)
+			lru = i;
 	}
 
-	if (epoch && *epoch && strcmp(epoch, "0") != 0) {
-		len = snprintf(evr_buf, size, "%s:", epoch);
-		evr_buf += len;
-		size -= len;
+	blocks = set->details_blocks.data;
+	size = blocks[block + 1].offset - blocks[block].offset;
+	free(cache->entries[lru].data);
+	cache->entries[lru].data = NULL;
+	if (blocks[block + 1].offset <= blocks[block].offset ||
+	    blocks[block + 1].compressed < blocks[block].compressed ||
+	    blocks[block + 1].compressed > set->details_string_pool.size)
+		goto corrupt;
+
+	/* The block has to come out at exactly the size the index
+	 * gives, and end with the terminator of its last string. */
+	data = malloc(size);
+	length = size;
+	if (uncompress((Bytef *) data, &length,
+		       (const Bytef *) set->details_string_pool.data +
+		       blocks[block].compressed,
+		       blocks[block + 1].compressed -
+		       blocks[block].compressed) != Z_OK ||
+	    length != size || data[size - 1] != '\0') {
+		free(data);
+		goto corrupt;
 	}
-	len = snprintf(evr_buf, size, "%s", version);
-	evr_buf += len;
-	size -= len;
-	if (release && *release)
-		snprintf(evr_buf, size, "-%s", release);
-}
 
-RAZOR_EXPORT int
-razor_versioncmp(const char *s1, const char *s2)
-{
-	const char *p1, *p2;
-	long n1, n2;
-	int res;
+	cache->entries[lru].data = data;
+	cache->entries[lru].block = block;
+	cache->entries[lru].used = ++cache->clock;
 
-	assert (s1 != NULL);
-	assert (s2 != NULL);
+	return cache->entries[lru].data;
 
-	n1 = strtol(s1, (char **) &p1, 10);
-	n2 = strtol(s2, (char **) &p2, 10);
+corrupt:
+	fprintf(stderr, "corrupt details block %u\n", block);
+	return NULL;
+}
 
-	/* Epoch; if one but not the other has an epoch set, default
-	 * the epoch-less version to 0. */
-	res = (*p1 == ':') - (*p2 == ':');
-	if (res < 0) {
-		n1 = 0;
-		p1 = s1;
-		p2++;
-	} else if (res > 0) {
-		p1++;
-		n2 = 0;
-		p2 = s2;
+static const char *
+razor_set_get_details_string(struct razor_set *set, uint32_t offset)
+{
+	struct razor_details_block *blocks;
+	uint32_t lo, hi, mid;
+	const char *data;
+
+	if (!(set->flags & RAZOR_SET_COMPRESSED_DETAILS))
+		return (const char *) set->details_string_pool.data + offset;
+
+	blocks = set->details_blocks.data;
+	lo = 0;
+	hi = set->details_blocks.size / sizeof *blocks;
+	if (hi < 2 || offset >= blocks[hi - 1].offset)
+		return "";
+
+	/* Find the last block starting at or before offset; the last
+	 * entry only marks the end of the pool. */
+	hi--;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (blocks[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid;
 	}
 
-	if (n1 != n2)
-		return n1 - n2;
-	while (*p1 && *p2) {
-		if (*p1 != *p2)
-			return *p1 - *p2;
-		p1++;
-		p2++;
-		if (isdigit(*p1) && isdigit(*p2))
-			return razor_versioncmp(p1, p2);
-	}
+	data = razor_set_read_details_block(set, lo);
+	if (data == NULL)
+		return "";
 
-	return *p1 - *p2;
+	return data + offset - blocks[lo].offset;
 }
 
 static const char *
@@ -367,7 +2301,20 @@ razor_package_get_details_type(struct razor_set *set,
 			       struct razor_package *package,
 			       enum razor_detail_type type)
 {
+	struct razor_package_details *details;
 	const char *pool;
+	size_t index;
+
+	details = NULL;
+	if (type >= RAZOR_DETAIL_SUMMARY) {
+		razor_set_bind_details(set);
+		index = package - (struct razor_package *) set->packages.data;
+		if ((index + 1) * sizeof *details <= set->package_details.size)
+			details = (struct razor_package_details *)
+				set->package_details.data + index;
+		else if (type <= RAZOR_DETAIL_LICENSE)
+			return "";
+	}
 
 	switch (type) {
 	case RAZOR_DETAIL_NAME:
@@ -383,20 +2330,16 @@ razor_package_get_details_type(struct razor_set *set,
 		return &pool[package->arch];
 
 	case RAZOR_DETAIL_SUMMARY:
-		pool = set->details_string_pool.data;
-		return &pool[package->summary];
+		return razor_set_get_details_string(set, details->summary);
 
 	case RAZOR_DETAIL_DESCRIPTION:
-		pool = set->details_string_pool.data;
-		return &pool[package->description];
+		return razor_set_get_details_string(set, details->description);
 
 	case RAZOR_DETAIL_URL:
-		pool = set->details_string_pool.data;
-		return &pool[package->url];
+		return razor_set_get_details_string(set, details->url);
 
 	case RAZOR_DETAIL_LICENSE:
-		pool = set->details_string_pool.data;
-		return &pool[package->license];
+		return razor_set_get_details_string(set, details->license);
 
 	default:
 		fprintf(stderr, "type %u not found\n", type);
@@ -419,6 +2362,7 @@ razor_package_get_details_varg(struct razor_set *set,
 	enum razor_detail_type type;
 	const char **data;
 
+	set = razor_set_get_package_layer(set, package);
 	for (i = 0;; i += 2) {
 		type = va_arg(args, enum razor_detail_type);
 		if (type == RAZOR_DETAIL_LAST)
@@ -499,43 +2443,206 @@ razor_property_type_to_string(struct razor_property *p)
 	}
 }
 
-RAZOR_EXPORT struct razor_entry *
-razor_set_find_entry(struct razor_set *set,
-		     struct razor_entry *dir, const char *pattern)
+void
+razor_file_name_cursor_init(struct razor_file_name_cursor *cursor,
+			    struct razor_set *set)
+{
+	cursor->set = set;
+	cursor->next = NULL;
+	cursor->index = ~0;
+	array_init(&cursor->name);
+}
+
+void
+razor_file_name_cursor_release(struct razor_file_name_cursor *cursor)
+{
+	array_release(&cursor->name);
+}
+
+/* Append the name at p to the first shared bytes of the current name
+ * and return the end of it.  The shared length comes from the file,
+ * so don't trust it to be within the current name. */
+static const char *
+set_cursor_name(struct razor_file_name_cursor *cursor,
+		const char *p, uint32_t shared)
+{
+	size_t len;
+
+	if (shared >= (uint32_t) cursor->name.size)
+		shared = cursor->name.size > 0 ? cursor->name.size - 1 : 0;
+
+	len = strlen(p);
+	cursor->name.size = shared;
+	memcpy(array_add(&cursor->name, len + 1), p, len + 1);
+
+	return p + len + 1;
+}
+
+/* Get the file name with the given name field.  The returned string
+ * is only valid until the next call. */
+const char *
+razor_file_name_cursor_get(struct razor_file_name_cursor *cursor,
+			   uint32_t name)
+{
+	struct razor_set *set = cursor->set;
+	const uint32_t *blocks;
+	const char *p;
+	uint32_t i, shared;
+
+	p = set->file_string_pool.data;
+	if (!(set->flags & RAZOR_SET_FRONT_CODED_FILES))
+		return p + name;
+
+	if (name == cursor->index)
+		return cursor->name.data;
+
+	if (name < cursor->index ||
+	    name / RAZOR_FILE_NAME_BLOCK != cursor->index / RAZOR_FILE_NAME_BLOCK) {
+		blocks = set->file_string_index.data;
+		p = set_cursor_name(cursor,
+				    p + blocks[name / RAZOR_FILE_NAME_BLOCK], 0);
+		i = name - name % RAZOR_FILE_NAME_BLOCK;
+	} else {
+		p = cursor->next;
+		i = cursor->index;
+	}
+
+	while (i < name) {
+		shared = *(const uint8_t *) p++;
+		p = set_cursor_name(cursor, p, shared);
+		i++;
+	}
+
+	cursor->index = name;
+	cursor->next = p;
+
+	return cursor->name.data;
+}
+
+static int
+compare_file_names(const void *p1, const void *p2, void *data)
+{
+	const uint32_t *n1 = p1, *n2 = p2;
+	const char *pool = data;
+
+	return strcmp(&pool[*n1], &pool[*n2]);
+}
+
+/* Replace the file string pool with the front coded pool described
+ * above razor_file_name_cursor_get(), and renumber the entry names.
+ * Like the list compaction, this has to run after everything else
+ * that reads the file names. */
+void
+razor_set_front_code_file_names(struct razor_set *set)
+{
+	struct razor_entry *entries;
+	struct array pool, index;
+	const char *old, *name, *last;
+	uint32_t *names, *map, *block, count, i, n, shared;
+	size_t len;
+	char *p;
+
+	entries = set->files.data;
+	count = set->files.size / sizeof *entries;
+	names = malloc(count * sizeof *names);
+	for (i = 0; i < count; i++)
+		names[i] = entries[i].name;
+
+	old = set->file_string_pool.data;
+	map = razor_sort_with_data(names, count, sizeof *names,
+				   compare_file_names, (void *) old);
+
+	array_init(&pool);
+	array_init(&index);
+	last = NULL;
+	n = 0;
+	for (i = 0; i < count; i++) {
+		name = &old[names[i]];
+		if (last && strcmp(last, name) == 0) {
+			entries[map[i]].name = n - 1;
+			continue;
+		}
+
+		len = strlen(name);
+		if (n % RAZOR_FILE_NAME_BLOCK == 0) {
+			block = array_add(&index, sizeof *block);
+			*block = pool.size;
+			p = array_add(&pool, len + 1);
+			memcpy(p, name, len + 1);
+		} else {
+			for (shared = 0; shared < 255 &&
+				     last[shared] == name[shared] &&
+				     name[shared]; shared++)
+				;
+			p = array_add(&pool, len - shared + 2);
+			*p = shared;
+			memcpy(p + 1, name + shared, len - shared + 1);
+		}
+
+		entries[map[i]].name = n++;
+		last = name;
+	}
+
+	free(names);
+	free(map);
+	array_release(&set->file_string_pool);
+	set->file_string_pool = pool;
+	array_release(&set->file_string_index);
+	set->file_string_index = index;
+	set->flags |= RAZOR_SET_FRONT_CODED_FILES;
+}
+
+static struct razor_entry *
+find_entry(struct razor_set *set, struct razor_file_name_cursor *cursor,
+	   struct razor_entry *dir, const char *pattern)
 {
 	struct razor_entry *e;
-	const char *n, *pool = set->file_string_pool.data;
+	const char *n;
 	int len;
 
-	assert (set != NULL);
-	assert (dir != NULL);
-	assert (pattern != NULL);
-
 	e = (struct razor_entry *) set->files.data + dir->start;
 	do {
-		n = pool + e->name;
+		n = razor_file_name_cursor_get(cursor, e->name);
 		if (strcmp(pattern + 1, n) == 0)
 			return e;
 		len = strlen(n);
 		if (e->start != 0 && strncmp(pattern + 1, n, len) == 0 &&
 		    pattern[len + 1] == '/') {
-			return razor_set_find_entry(set, e, pattern + len + 1);
+			return find_entry(set, cursor, e, pattern + len + 1);
 		}
 	} while (!((e++)->flags & RAZOR_ENTRY_LAST));
 
 	return NULL;
 }
 
+RAZOR_EXPORT struct razor_entry *
+razor_set_find_entry(struct razor_set *set,
+		     struct razor_entry *dir, const char *pattern)
+{
+	struct razor_file_name_cursor cursor;
+	struct razor_entry *e;
+
+	assert (set != NULL);
+	assert (dir != NULL);
+	assert (pattern != NULL);
+
+	razor_file_name_cursor_init(&cursor, set);
+	e = find_entry(set, &cursor, dir, pattern);
+	razor_file_name_cursor_release(&cursor);
+
+	return e;
+}
+
 static void
-list_dir(struct razor_set *set, struct razor_entry *dir,
-	 char *prefix, const char *pattern)
+list_dir(struct razor_set *set, struct razor_file_name_cursor *cursor,
+	 struct razor_entry *dir, char *prefix, const char *pattern)
 {
 	struct razor_entry *e;
-	const char *n, *pool = set->file_string_pool.data;
+	const char *n;
 
 	e = (struct razor_entry *) set->files.data + dir->start;
 	do {
-		n = pool + e->name;
+		n = razor_file_name_cursor_get(cursor, e->name);
 		if (pattern && pattern[0] && fnmatch(pattern, n, 0) != 0)
 			continue;
 		printf("%s/%s\n", prefix, n);
@@ -543,7 +2650,7 @@ list_dir(struct razor_set *set, struct razor_entry *dir,
 			char *sub = prefix + strlen (prefix);
 			*sub = '/';
 			strcpy (sub + 1, n);
-			list_dir(set, e, prefix, pattern);
+			list_dir(set, cursor, e, prefix, pattern);
 			*sub = '\0';
 		}
 	} while (!((e++)->flags & RAZOR_ENTRY_LAST));
@@ -552,14 +2659,19 @@ list_dir(struct razor_set *set, struct razor_entry *dir,
 RAZOR_EXPORT void
 razor_set_list_files(struct razor_set *set, const char *pattern)
 {
+	struct razor_file_name_cursor cursor;
 	struct razor_entry *e;
-	char buffer[512], *p, *base;
+	char buffer[PATH_MAX], *p, *base;
 
 	assert (set != NULL);
 
+	if (razor_set_bind_files(set) < 0)
+		return;
+	razor_file_name_cursor_init(&cursor, set);
 	if (pattern == NULL || !strcmp (pattern, "/")) {
 		buffer[0] = '\0';
-		list_dir(set, set->files.data, buffer, NULL);
+		list_dir(set, &cursor, set->files.data, buffer, NULL);
+		razor_file_name_cursor_release(&cursor);
 		return;
 	}
 
@@ -578,34 +2690,35 @@ razor_set_list_files(struct razor_set *set, const char *pattern)
 	}
 	e = razor_set_find_entry(set, set->files.data, buffer);
 	if (e && e->start != 0)
-		list_dir(set, e, buffer, base);
+		list_dir(set, &cursor, e, buffer, base);
+	razor_file_name_cursor_release(&cursor);
 }
 
-static struct list *
-list_package_files(struct razor_set *set, struct list *r,
-		   struct razor_entry *dir, uint32_t end,
-		   char *prefix)
+static int
+list_package_files(struct razor_set *set,
+		   struct razor_file_name_cursor *cursor,
+		   struct list_iterator *li, uint32_t *file,
+		   struct razor_entry *dir, uint32_t end, char *prefix)
 {
 	struct razor_entry *e, *f, *entries;
-	uint32_t next, file;
-	char *pool;
-	int len;
+	uint32_t next;
+	int len, valid;
 
 	entries = (struct razor_entry *) set->files.data;
-	pool = set->file_string_pool.data;
 
 	e = entries + dir->start;
 	do {
-		if (entries + r->data == e) {
-			printf("%s/%s\n", prefix, pool + e->name);
-			r = list_next(r);
-			if (!r)
-				return NULL;
-			if (r->data >= end)
-				return r;
+		if (entries + *file == e) {
+			printf("%s/%s\n", prefix,
+			       razor_file_name_cursor_get(cursor, e->name));
+			if (!list_iterator_next(li, file))
+				return 0;
+			if (*file >= end)
+				return 1;
 		}
 	} while (!((e++)->flags & RAZOR_ENTRY_LAST));
 
+	valid = 1;
 	e = entries + dir->start;
 	do {
 		if (e->start == 0)
@@ -623,34 +2736,44 @@ list_package_files(struct razor_set *set, struct list *r,
 				next = f->start;
 		}
 
-		file = r->data;
-		if (e->start <= file && file < next) {
+		if (e->start <= *file && *file < next) {
 			len = strlen(prefix);
 			prefix[len] = '/';
-			strcpy(prefix + len + 1, pool + e->name);
-			r = list_package_files(set, r, e, next, prefix);
+			strcpy(prefix + len + 1,
+			       razor_file_name_cursor_get(cursor, e->name));
+			valid = list_package_files(set, cursor, li, file,
+						   e, next, prefix);
 			prefix[len] = '\0';
 		}
-	} while (!((e++)->flags & RAZOR_ENTRY_LAST) && r != NULL);
+	} while (!((e++)->flags & RAZOR_ENTRY_LAST) && valid);
 
-	return r;
+	return valid;
 }
 
 RAZOR_EXPORT void
 razor_set_list_package_files(struct razor_set *set,
 			     struct razor_package *package)
 {
-	struct list *r;
-	uint32_t end;
-	char buffer[512];
+	struct razor_file_name_cursor cursor;
+	struct list_iterator li;
+	uint32_t file, end;
+	char buffer[PATH_MAX];
 
 	assert (set != NULL);
 	assert (package != NULL);
 
-	r = list_first(&package->files, &set->file_pool);
+	set = razor_set_get_package_layer(set, package);
+	if (razor_set_bind_files(set) < 0)
+		return;
+	list_iterator_init(&li, &package->files, &set->file_pool);
+	if (!list_iterator_next(&li, &file))
+		return;
 	end = set->files.size / sizeof (struct razor_entry);
 	buffer[0] = '\0';
-	list_package_files(set, r, set->files.data, end, buffer);
+	razor_file_name_cursor_init(&cursor, set);
+	list_package_files(set, &cursor, &li, &file,
+			   set->files.data, end, buffer);
+	razor_file_name_cursor_release(&cursor);
 }
 
 /* The diff order matters.  We should sort the packages so that a
@@ -658,18 +2781,42 @@ razor_set_list_package_files(struct razor_set *set,
  * requires for a package have been installed before the package.
  **/
 
+/* Compare the versions of p1 from set1 and p2 from set2, by their
+ * version keys if both sets have them. */
+static int
+compare_package_versions(struct razor_version_cache *versions,
+			 struct razor_set *set1, struct razor_package *p1,
+			 struct razor_set *set2, struct razor_package *p2)
+{
+	const char *key1, *key2;
+	size_t size1, size2;
+
+	key1 = razor_set_version_key(set1, razor_set_package_rank(set1, p1),
+				     &size1);
+	key2 = razor_set_version_key(set2, razor_set_package_rank(set2, p2),
+				     &size2);
+	if (key1 != NULL && key2 != NULL)
+		return razor_version_key_compare(key1, size1, key2, size2);
+
+	return razor_version_cache_compare(versions,
+					   p1->version, p2->version);
+}
+
 RAZOR_EXPORT void
 razor_set_diff(struct razor_set *set, struct razor_set *upstream,
 	       razor_diff_callback_t callback, void *data)
 {
  	struct razor_package_iterator *pi1, *pi2;
  	struct razor_package *p1, *p2;
+	struct razor_version_cache *versions;
 	const char *name1, *name2, *version1, *version2, *arch1, *arch2;
 	int res;
 
 	assert (set != NULL);
 	assert (upstream != NULL);
 
+	versions = malloc(sizeof *versions);
+	razor_version_cache_init(versions, set, upstream);
 	pi1 = razor_package_iterator_create(set);
 	pi2 = razor_package_iterator_create(upstream);
 
@@ -686,9 +2833,15 @@ razor_set_diff(struct razor_set *set, struct razor_set *upstream,
 
 	while (p1 || p2) {
 		if (p1 && p2) {
+			/* The versions of an overlay come from the
+			 * string pools of its layers. */
 			res = strcmp(name1, name2);
-			if (res == 0)
+			if (res == 0 && (set->layers || upstream->layers))
 				res = razor_versioncmp(version1, version2);
+			else if (res == 0)
+				res = compare_package_versions(versions,
+							       set, p1,
+							       upstream, p2);
 		} else {
 			res = 0;
 		}
@@ -716,6 +2869,7 @@ razor_set_diff(struct razor_set *set, struct razor_set *upstream,
 
 	razor_package_iterator_destroy(pi1);
 	razor_package_iterator_destroy(pi2);
+	free(versions);
 }
 
 struct install_action {
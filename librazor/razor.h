@@ -20,12 +20,14 @@
 #ifndef _RAZOR_H_
 #define _RAZOR_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 enum razor_repo_file_type {
 	RAZOR_REPO_FILE_MAIN,
 	RAZOR_REPO_FILE_DETAILS,
-	RAZOR_REPO_FILE_FILES
+	RAZOR_REPO_FILE_FILES,
+	RAZOR_REPO_FILE_ALL
 };
 
 enum razor_detail_type {
@@ -60,6 +62,23 @@ enum razor_property_flags {
 	RAZOR_PROPERTY_POSTUN		= 1 << 8
 };
 
+enum razor_set_flags {
+	RAZOR_SET_SORTED_STRING_POOL	= 1 << 0,
+	RAZOR_SET_HUGE_PAGE_ALIGNED	= 1 << 1,
+	RAZOR_SET_PACKED_LISTS		= 1 << 2,
+	RAZOR_SET_FRONT_CODED_FILES	= 1 << 3,
+	RAZOR_SET_COMPRESSED_DETAILS	= 1 << 4,
+	RAZOR_SET_DELTA			= 1 << 5,
+	RAZOR_SET_STRING_INDEX		= 1 << 6,
+	RAZOR_SET_VERSION_KEYS		= 1 << 7
+};
+
+enum razor_set_open_flags {
+	RAZOR_SET_OPEN_PREFAULT		= 1 << 0,
+	RAZOR_SET_OPEN_LAZY_STRINGS	= 1 << 1,
+	RAZOR_SET_OPEN_HUGE_PAGES	= 1 << 2
+};
+
 /**
  * SECTION:set
  * @title: Package Set
@@ -82,15 +101,50 @@ struct razor_property;
  **/
 struct razor_set *razor_set_create(void);
 struct razor_set *razor_set_open(const char *filename);
+
+/**
+ * razor_set_open_with_flags:
+ * @filename: the rzdb file to open
+ * @flags: %razor_set_open_flags
+ *
+ * Open a package set like razor_set_open(), with hints for how the
+ * file should be paged in.  %RAZOR_SET_OPEN_PREFAULT faults in the
+ * packages, properties and their lists up front.
+ * %RAZOR_SET_OPEN_LAZY_STRINGS disables readahead on the string
+ * pools, so only the pages that are used get read.
+ * %RAZOR_SET_OPEN_HUGE_PAGES maps the file at a 2 MiB boundary and
+ * asks for huge pages for the packages and properties; this only
+ * helps for sets written with %RAZOR_SET_HUGE_PAGE_ALIGNED.
+ *
+ * Returns: the new #razor_set object, or %NULL on error.
+ **/
+struct razor_set *razor_set_open_with_flags(const char *filename,
+					    uint32_t flags);
 void razor_set_destroy(struct razor_set *set);
 int razor_set_write_to_fd(struct razor_set *set, int fd,
 			  enum razor_repo_file_type type);
 int razor_set_write(struct razor_set *set, const char *filename,
 		    enum razor_repo_file_type type);
+struct razor_set *razor_set_move_to_file(struct razor_set *set,
+					 const char *filename);
 
 int razor_set_open_details(struct razor_set *set, const char *filename);
 int razor_set_open_files(struct razor_set *set, const char *filename);
 
+/**
+ * razor_set_verify:
+ * @set: a %razor_set
+ *
+ * Check every section of the files @set was opened from against the
+ * checksums stored in the section table.  Sections are also checked
+ * when they are first used, but only those that are actually needed;
+ * this reads all of them.  Files written before checksums were added
+ * are only checked for truncation.
+ *
+ * Returns: 0 if all sections are intact, -1 otherwise.
+ **/
+int razor_set_verify(struct razor_set *set);
+
 struct razor_package *
 razor_set_get_package(struct razor_set *set, const char *package);
 
@@ -145,6 +199,20 @@ struct razor_package_iterator *
 razor_package_iterator_create_for_file(struct razor_set *set,
 				       const char *filename);
 
+/**
+ * razor_package_iterator_create_for_name:
+ *
+ * Create a new #razor_package_iterator object for the packages whose
+ * name matches the given name or glob pattern.  The packages are
+ * looked up by binary search, so exact names and patterns with a
+ * literal prefix (such as "kernel*") don't scan the whole set.
+ *
+ * Returns: the new #razor_package_iterator object.
+ **/
+struct razor_package_iterator *
+razor_package_iterator_create_for_name(struct razor_set *set,
+				       const char *pattern);
+
 int razor_package_iterator_next(struct razor_package_iterator *pi,
 				struct razor_package **package, ...);
 void razor_package_iterator_destroy(struct razor_package_iterator *pi);
@@ -164,11 +232,34 @@ struct razor_property_iterator;
 struct razor_property_iterator *
 razor_property_iterator_create(struct razor_set *set,
 			       struct razor_package *package);
+/**
+ * razor_property_iterator_create_for_name:
+ *
+ * Create a new #razor_property_iterator object for the properties of
+ * the given name and type (one of %RAZOR_PROPERTY_REQUIRES,
+ * %RAZOR_PROPERTY_PROVIDES, %RAZOR_PROPERTY_CONFLICTS or
+ * %RAZOR_PROPERTY_OBSOLETES).
+ *
+ * Returns: the new #razor_property_iterator object.
+ **/
+struct razor_property_iterator *
+razor_property_iterator_create_for_name(struct razor_set *set,
+					const char *name, uint32_t type);
+
+struct razor_property_iterator *
+razor_property_iterator_create_for_sets(struct razor_set **sets, int count);
 int razor_property_iterator_next(struct razor_property_iterator *pi,
 				 struct razor_property **property,
 				 const char **name,
 				 uint32_t *flags,
 				 const char **version);
+int
+razor_property_iterator_next_with_set(struct razor_property_iterator *pi,
+				      int *set,
+				      struct razor_property **property,
+				      const char **name,
+				      uint32_t *flags,
+				      const char **version);
 void
 razor_property_iterator_destroy(struct razor_property_iterator *pi);
 
@@ -192,6 +283,16 @@ void
 razor_set_diff(struct razor_set *set, struct razor_set *upstream,
 	       razor_diff_callback_t callback, void *data);
 
+struct razor_set *razor_set_create_overlay(struct razor_set **sets,
+					   int count);
+struct razor_set *razor_set_compact_overlay(struct razor_set *overlay);
+
+uint32_t razor_set_get_checksum(struct razor_set *set);
+struct razor_set *razor_set_create_delta(struct razor_set *base,
+					 struct razor_set *target);
+struct razor_set *razor_set_apply_delta(struct razor_set *base,
+					struct razor_set *delta);
+
 struct razor_install_iterator;
 
 enum razor_install_action {
@@ -222,6 +323,10 @@ void razor_install_iterator_destroy(struct razor_install_iterator *ii);
 
 struct razor_transaction *
 razor_transaction_create(struct razor_set *system, struct razor_set *upstream);
+struct razor_transaction *
+razor_transaction_create_with_upstreams(struct razor_set *system,
+					struct razor_set **upstreams,
+					int count);
 void razor_transaction_install_package(struct razor_transaction *transaction,
 				       struct razor_package *package);
 void razor_transaction_remove_package(struct razor_transaction *transaction,
@@ -297,6 +402,8 @@ struct razor_importer;
 
 struct razor_importer *razor_importer_create(void);
 void razor_importer_destroy(struct razor_importer *importer);
+void razor_importer_set_flags(struct razor_importer *importer,
+			      uint32_t flags);
 void razor_importer_begin_package(struct razor_importer *importer,
 				  const char *name,
 				  const char *version,
@@ -337,7 +444,8 @@ struct razor_root *razor_root_open(const char *root);
 struct razor_set *razor_root_open_read_only(const char *root);
 struct razor_set *razor_root_get_system_set(struct razor_root *root);
 int razor_root_close(struct razor_root *root);
-void razor_root_update(struct razor_root *root, struct razor_set *next);
+struct razor_set *razor_root_update(struct razor_root *root,
+				   struct razor_set *next);
 int razor_root_commit(struct razor_root *root);
 
 
@@ -357,6 +465,7 @@ razor_property_type_to_string(struct razor_property *p);
 void razor_build_evr(char *evr_buf, int size, const char *epoch,
 		     const char *version, const char *release);
 int razor_versioncmp(const char *s1, const char *s2);
+size_t razor_version_key(const char *version, char *key, size_t size);
 
 
 #endif /* _RAZOR_H_ */
@@ -31,6 +31,10 @@
 #include "razor-internal.h"
 
 static const char system_repo_filename[] = "system.rzdb";
+
+/* Older roots keep the details and files sections in separate files
+ * next to system.rzdb.  We still read those, and remove them when
+ * the first update commits the single-file set. */
 static const char system_repo_details_filename[] = "system-details.rzdb";
 static const char system_repo_files_filename[] = "system-files.rzdb";
 
@@ -51,7 +55,7 @@ razor_root_create(const char *root)
 {
 	struct stat buf;
 	struct razor_set *set;
-	char path[PATH_MAX], details_path[PATH_MAX], files_path[PATH_MAX];
+	char path[PATH_MAX];
 
 	assert (root != NULL);
 
@@ -83,18 +87,12 @@ razor_root_create(const char *root)
 	set = razor_set_create();
 	snprintf(path, sizeof path, "%s%s/%s",
 		 root, razor_root_path, system_repo_filename);
-	snprintf(details_path, sizeof details_path, "%s%s/%s",
-		 root, razor_root_path, system_repo_details_filename);
-	snprintf(files_path, sizeof files_path, "%s%s/%s",
-		 root, razor_root_path, system_repo_files_filename);
 	if (stat(path, &buf) == 0) {
 		fprintf(stderr,
 			"a razor install root is already initialized\n");
 		return -1;
 	}
-	if (razor_set_write(set, path, RAZOR_REPO_FILE_MAIN) < 0 ||
-	    razor_set_write(set, details_path, RAZOR_REPO_FILE_DETAILS) < 0 ||
-	    razor_set_write(set, files_path, RAZOR_REPO_FILE_FILES) < 0 ) {
+	if (razor_set_write(set, path, RAZOR_REPO_FILE_ALL) < 0) {
 		fprintf(stderr, "could not write initial package set\n");
 		return -1;
 	}
@@ -103,11 +101,38 @@ razor_root_create(const char *root)
 	return 0;
 }
 
+static struct razor_set *
+open_system_set(const char *root, uint32_t flags)
+{
+	char path[PATH_MAX], details_path[PATH_MAX], files_path[PATH_MAX];
+	struct razor_set *set;
+
+	snprintf(path, sizeof path, "%s%s/%s",
+		 root, razor_root_path, system_repo_filename);
+	set = razor_set_open_with_flags(path, flags);
+	if (set == NULL)
+		return NULL;
+
+	if (razor_set_has_section(set, RAZOR_FILES))
+		return set;
+
+	snprintf(details_path, sizeof details_path,
+		 "%s%s/%s", root, razor_root_path, system_repo_details_filename);
+	snprintf(files_path, sizeof files_path,
+		 "%s%s/%s", root, razor_root_path, system_repo_files_filename);
+	if (razor_set_open_details(set, details_path) ||
+	    razor_set_open_files(set, files_path)) {
+		razor_set_destroy(set);
+		return NULL;
+	}
+
+	return set;
+}
+
 RAZOR_EXPORT struct razor_root *
 razor_root_open(const char *root)
 {
 	struct razor_root *image;
-	char details_path[PATH_MAX], files_path[PATH_MAX];
 
 	assert (root != NULL);
 
@@ -120,7 +145,7 @@ razor_root_open(const char *root)
 	snprintf(image->new_path, sizeof image->new_path,
 		 "%s%s/%s", root, razor_root_path, next_repo_filename);
 	image->fd = open(image->new_path,
-			 O_CREAT | O_WRONLY | O_TRUNC | O_EXCL, 0666);
+			 O_CREAT | O_RDWR | O_TRUNC | O_EXCL, 0666);
 	if (image->fd < 0) {
 		fprintf(stderr, "failed to get lock file, "
 			"maybe previous operation crashed?\n");
@@ -135,19 +160,17 @@ razor_root_open(const char *root)
 
 	snprintf(image->path, sizeof image->path,
 		 "%s%s/%s", root, razor_root_path, system_repo_filename);
-	snprintf(details_path, sizeof details_path,
-		 "%s%s/%s", root, razor_root_path, system_repo_details_filename);
-	snprintf(files_path, sizeof files_path,
-		 "%s%s/%s", root, razor_root_path, system_repo_files_filename);
 
-	/* FIXME: We store the root path to make the hack in
-	 * razor_root_update() work.  Need to get rid of this. */
+	/* We keep the root path so razor_root_commit() can remove the
+	 * details and files of an old three-file root. */
 	strcpy(image->root, root);
 
-	image->system = razor_set_open(image->path);
-	if (image->system == NULL ||
-	    razor_set_open_details(image->system, details_path) ||
-	    razor_set_open_files(image->system, files_path)) {
+	/* We're going to run a transaction against the system set,
+	 * which walks all the packages and properties. */
+	image->system = open_system_set(root,
+					RAZOR_SET_OPEN_PREFAULT |
+					RAZOR_SET_OPEN_LAZY_STRINGS);
+	if (image->system == NULL) {
 		unlink(image->new_path);
 		close(image->fd);
 		free(image);
@@ -160,30 +183,9 @@ razor_root_open(const char *root)
 RAZOR_EXPORT struct razor_set *
 razor_root_open_read_only(const char *root)
 {
-	char path[PATH_MAX], details_path[PATH_MAX], files_path[PATH_MAX];
-	struct razor_set *set;
-
 	assert (root != NULL);
 
-	snprintf(path, sizeof path, "%s%s/%s",
-		 root, razor_root_path, system_repo_filename);
-	snprintf(details_path, sizeof details_path,
-		 "%s%s/%s", root, razor_root_path, system_repo_details_filename);
-	snprintf(files_path, sizeof files_path,
-		 "%s%s/%s", root, razor_root_path, system_repo_files_filename);
-
-
-	set = razor_set_open(path);
-	if (set == NULL)
-		return NULL;
-
-	if (razor_set_open_details(set, details_path) ||
-	    razor_set_open_files(set, files_path)) {
-		razor_set_destroy(set);
-		return NULL;
-	}
-
-	return set;
+	return open_system_set(root, 0);
 }
 
 RAZOR_EXPORT struct razor_set *
@@ -207,43 +209,65 @@ razor_root_close(struct razor_root *root)
 	return 0;
 }
 
-RAZOR_EXPORT void
+/* Write next out as the new system set and return it as mapped from
+ * the new file.  next is destroyed, even on failure. */
+RAZOR_EXPORT struct razor_set *
 razor_root_update(struct razor_root *root, struct razor_set *next)
 {
-	char path[PATH_MAX];
+	int base_fd, status;
 
 	assert (root != NULL);
 	assert (next != NULL);
 
-	razor_set_write_to_fd(next, root->fd, RAZOR_REPO_FILE_MAIN);
-	root->next = next;
-
-	/* FIXME: This is a pretty bad hack that just overwrites the
-	 * system details and files rzdb files before the transaction
-	 * succeeds.  We need to fix this by merging the separate
-	 * details and files rzdb files back into the main rzdb
-	 * file. */
-	snprintf(path, sizeof path,
-		 "%s%s/%s", root->root, razor_root_path, system_repo_details_filename);
-	razor_set_write(next, path, RAZOR_REPO_FILE_DETAILS);
-	snprintf(path, sizeof path,
-		 "%s%s/%s", root->root, razor_root_path, system_repo_files_filename);
-	razor_set_write(next, path, RAZOR_REPO_FILE_FILES);
+	/* The details and files go in the same file as the main
+	 * sections, so the rename in razor_root_commit() switches
+	 * all of them at once.  Sections that the transaction didn't
+	 * touch are copied over from the current system set, and the
+	 * rest are moved into the file one at a time, so the new set
+	 * is never both on the heap and in the file. */
+	base_fd = open(root->path, O_RDONLY);
+	status = razor_set_move_to_fd_with_base(next, root->fd,
+						base_fd >= 0 ?
+						root->system : NULL,
+						base_fd);
+	if (base_fd >= 0)
+		close(base_fd);
 
 	/* Sync the new repo file so the new package set is on disk
-	 * before we start upgrading. */
-	fsync(root->fd);
+	 * before we start upgrading.  razor_root_commit() renames it
+	 * into place, so the data is all that needs to be synced. */
+	if (status == 0)
+		status = fdatasync(root->fd);
+	if (status < 0) {
+		fprintf(stderr, "failed to write %s\n", root->new_path);
+		return NULL;
+	}
 	printf("wrote %s\n", root->new_path);
+
+	root->next = razor_set_open(root->new_path);
+
+	return root->next;
 }
 
 RAZOR_EXPORT int
 razor_root_commit(struct razor_root *root)
 {
+	char path[PATH_MAX];
+
 	assert (root != NULL);
 
 	/* Make it so. */
 	rename(root->new_path, root->path);
+	razor_sync_directory(root->path);
 	printf("renamed %s to %s\n", root->new_path, root->path);
+
+	snprintf(path, sizeof path,
+		 "%s%s/%s", root->root, razor_root_path, system_repo_details_filename);
+	unlink(path);
+	snprintf(path, sizeof path,
+		 "%s%s/%s", root->root, razor_root_path, system_repo_files_filename);
+	unlink(path);
+
 	razor_set_destroy(root->system);
 	close(root->fd);
 	free(root);
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2008  Kristian Høgsberg <krh@redhat.com>
+ * Copyright (C) 2008  Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "razor-internal.h"
+
+/* Feed the same strings to an interner from several threads, each in
+ * its own order and mixed with strings only that thread sees, and
+ * check that every thread gets the same ids and that the final pool
+ * and offsets are the same as when one thread interns them all. */
+
+#define THREADS		8
+#define SHARED_STRINGS	20011
+#define PRIVATE_STRINGS	2000
+#define STRINGS		(SHARED_STRINGS + THREADS * PRIVATE_STRINGS)
+
+struct producer {
+	pthread_t thread;
+	struct razor_interner *interner;
+	int index;
+	uint32_t *ids;
+};
+
+static char *strings[STRINGS];
+
+static void
+make_strings(void)
+{
+	char buffer[64];
+	int i;
+
+	for (i = 0; i < STRINGS; i++) {
+		snprintf(buffer, sizeof buffer, "%s-%d.%d",
+			 i % 3 ? "lib" : "perl-Module", i / 7, i % 7);
+		strings[i] = strdup(buffer);
+	}
+}
+
+/* Tokenize the shared strings and the strings of the producer, in an
+ * order that depends on the producer, recording the id of each. */
+static void *
+produce(void *data)
+{
+	struct producer *producer = data;
+	struct razor_interner_stage *stage;
+	int i, j, round;
+
+	stage = razor_interner_stage_create(producer->interner);
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < SHARED_STRINGS; i++) {
+			j = (i * (2 * producer->index + 1) + round * 101) %
+				SHARED_STRINGS;
+			producer->ids[j] =
+				razor_interner_stage_tokenize(stage,
+							      strings[j]);
+		}
+		for (i = 0; i < PRIVATE_STRINGS; i++) {
+			j = SHARED_STRINGS +
+				producer->index * PRIVATE_STRINGS + i;
+			producer->ids[j] =
+				razor_interner_stage_tokenize(stage,
+							      strings[j]);
+		}
+	}
+	razor_interner_stage_destroy(stage);
+
+	return NULL;
+}
+
+static int
+compare_strings(const void *p1, const void *p2)
+{
+	const char * const *s1 = p1, * const *s2 = p2;
+
+	return strcmp(*s1, *s2);
+}
+
+static int
+check_offsets(struct razor_interner *interner, uint32_t *ids,
+	      struct array *pool, struct array *serial_pool,
+	      uint32_t *serial_offsets, const char *name)
+{
+	uint32_t offset;
+	int i, errors = 0;
+
+	if (pool->size != serial_pool->size ||
+	    memcmp(pool->data, serial_pool->data, pool->size) != 0) {
+		fprintf(stderr, "%s: string pool differs from serial pool\n",
+			name);
+		errors++;
+	}
+
+	for (i = 0; i < STRINGS; i++) {
+		offset = razor_interner_get_offset(interner, ids[i]);
+		if (offset != serial_offsets[i]) {
+			fprintf(stderr, "%s: \"%s\" at offset %u, "
+				"serial offset %u\n",
+				name, strings[i], offset, serial_offsets[i]);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	struct producer producers[THREADS];
+	struct razor_interner *interner;
+	struct razor_interner_stage *stage;
+	struct hashtable table, serial_table;
+	struct array pool, serial_pool;
+	uint32_t *serial_offsets, *ids;
+	char *sorted[STRINGS];
+	int i, j, errors = 0;
+
+	make_strings();
+
+	/* The reference: every string tokenized into a plain string
+	 * pool in sorted order by one thread. */
+	memcpy(sorted, strings, sizeof sorted);
+	qsort(sorted, STRINGS, sizeof sorted[0], compare_strings);
+	array_init(&serial_pool);
+	hashtable_init(&serial_table, &serial_pool);
+	hashtable_tokenize(&serial_table, "");
+	for (i = 0; i < STRINGS; i++)
+		hashtable_tokenize(&serial_table, sorted[i]);
+	serial_offsets = zalloc(STRINGS * sizeof *serial_offsets);
+	for (i = 0; i < STRINGS; i++)
+		serial_offsets[i] = hashtable_lookup(&serial_table,
+						     strings[i]);
+	ids = zalloc(STRINGS * sizeof *ids);
+
+	interner = razor_interner_create();
+	stage = razor_interner_stage_create(interner);
+	for (i = 0; i < STRINGS; i++)
+		ids[i] = razor_interner_stage_tokenize(stage, strings[i]);
+	razor_interner_stage_destroy(stage);
+	array_init(&pool);
+	hashtable_init(&table, &pool);
+	hashtable_tokenize(&table, "");
+	razor_interner_finish(interner, &table);
+	errors += check_offsets(interner, ids, &pool, &serial_pool,
+				serial_offsets, "one thread");
+	hashtable_release(&table);
+	array_release(&pool);
+	razor_interner_destroy(interner);
+
+	/* Now the same strings from several threads at once. */
+	interner = razor_interner_create();
+	for (i = 0; i < THREADS; i++) {
+		producers[i].interner = interner;
+		producers[i].index = i;
+		producers[i].ids = zalloc(STRINGS * sizeof *ids);
+		if (pthread_create(&producers[i].thread, NULL,
+				   produce, &producers[i]) != 0) {
+			fprintf(stderr, "failed to create thread\n");
+			exit(-1);
+		}
+	}
+	for (i = 0; i < THREADS; i++)
+		pthread_join(producers[i].thread, NULL);
+
+	for (i = 0; i < STRINGS; i++) {
+		if (i < SHARED_STRINGS) {
+			ids[i] = producers[0].ids[i];
+			for (j = 1; j < THREADS; j++) {
+				if (producers[j].ids[i] == ids[i])
+					continue;
+				fprintf(stderr, "\"%s\" has id %u in thread 0, "
+					"%u in thread %d\n", strings[i],
+					ids[i], producers[j].ids[i], j);
+				errors++;
+			}
+		} else {
+			j = (i - SHARED_STRINGS) / PRIVATE_STRINGS;
+			ids[i] = producers[j].ids[i];
+		}
+	}
+
+	array_init(&pool);
+	hashtable_init(&table, &pool);
+	hashtable_tokenize(&table, "");
+	razor_interner_finish(interner, &table);
+	errors += check_offsets(interner, ids, &pool, &serial_pool,
+				serial_offsets, "threads");
+	hashtable_release(&table);
+	array_release(&pool);
+	razor_interner_destroy(interner);
+
+	for (i = 0; i < THREADS; i++)
+		free(producers[i].ids);
+	free(ids);
+	free(serial_offsets);
+	hashtable_release(&serial_table);
+	array_release(&serial_pool);
+	for (i = 0; i < STRINGS; i++)
+		free(strings[i]);
+
+	if (errors) {
+		fprintf(stderr, "\n%d errors\n", errors);
+		return 1;
+	} else
+		return 0;
+}
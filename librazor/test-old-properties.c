@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2008  Kristian Høgsberg <krh@redhat.com>
+ * Copyright (C) 2008  Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "razor-internal.h"
+
+/* Sets written before the property name index was added have the
+ * properties of a name sorted by all of their flags rather than by
+ * type first, so a requires with %RAZOR_PROPERTY_PRE comes after the
+ * provides and conflicts of the same name.  Lay an imported set out
+ * like that, drop the sections such sets don't have, and check that
+ * looking up the properties of a name by type still finds them all,
+ * in the set, in the file written from it and in an overlay of it. */
+
+static const char filename[] = "test-old-properties.rzdb";
+
+static struct razor_set *
+import_set(void)
+{
+	struct razor_importer *importer;
+
+	importer = razor_importer_create();
+
+	razor_importer_begin_package(importer, "bash", "1-1", "i386");
+	razor_importer_add_property(importer, "sh",
+				    RAZOR_PROPERTY_PROVIDES |
+				    RAZOR_PROPERTY_EQUAL, "1-1");
+	razor_importer_finish_package(importer);
+
+	razor_importer_begin_package(importer, "zsh", "1-1", "i386");
+	razor_importer_add_property(importer, "sh",
+				    RAZOR_PROPERTY_REQUIRES |
+				    RAZOR_PROPERTY_PRE, "");
+	razor_importer_add_property(importer, "sh",
+				    RAZOR_PROPERTY_REQUIRES |
+				    RAZOR_PROPERTY_GREATER, "0-1");
+	razor_importer_add_property(importer, "sh",
+				    RAZOR_PROPERTY_PROVIDES |
+				    RAZOR_PROPERTY_EQUAL, "1-1");
+	razor_importer_add_property(importer, "sh",
+				    RAZOR_PROPERTY_CONFLICTS |
+				    RAZOR_PROPERTY_LESS, "1-1");
+	razor_importer_finish_package(importer);
+
+	return razor_importer_finish(importer);
+}
+
+static int
+compare_old_properties(const void *p1, const void *p2, void *data)
+{
+	const struct razor_property *prop1 = p1, *prop2 = p2;
+	struct razor_set *set = data;
+	const char *pool = set->string_pool.data;
+	int d;
+
+	d = strcmp(&pool[prop1->name], &pool[prop2->name]);
+	if (d != 0)
+		return d;
+	else if (prop1->flags != prop2->flags)
+		return prop1->flags < prop2->flags ? -1 : 1;
+	else
+		return strcmp(&pool[prop1->version], &pool[prop2->version]);
+}
+
+/* Reorder the properties the way the importer used to sort them and
+ * drop the sections indexed by the new order. */
+static void
+make_old_layout(struct razor_set *set)
+{
+	struct razor_package *pkg, *pkg_end;
+	uint32_t *map, *rmap;
+	int i, count;
+
+	count = set->properties.size / sizeof (struct razor_property);
+	map = razor_sort_with_data(set->properties.data, count,
+				   sizeof (struct razor_property),
+				   compare_old_properties, set);
+	rmap = malloc(count * sizeof *rmap);
+	for (i = 0; i < count; i++)
+		rmap[map[i]] = i;
+
+	list_remap_pool(&set->property_pool, rmap);
+	pkg_end = set->packages.data + set->packages.size;
+	for (pkg = set->packages.data; pkg < pkg_end; pkg++)
+		list_remap_head(&pkg->properties, rmap);
+	free(map);
+	free(rmap);
+
+	array_release(&set->property_names);
+	array_init(&set->property_names);
+	array_release(&set->property_version_ranks);
+	array_init(&set->property_version_ranks);
+}
+
+static int
+check_type(struct razor_set *set, const char *what,
+	   uint32_t type, int expected, uint32_t expected_flags)
+{
+	struct razor_property_iterator *pi;
+	struct razor_property *property;
+	const char *name, *version;
+	uint32_t flags, all = 0;
+	int count = 0, errors = 0;
+
+	pi = razor_property_iterator_create_for_name(set, "sh", type);
+	while (razor_property_iterator_next(pi, &property,
+					    &name, &flags, &version)) {
+		if ((flags & RAZOR_PROPERTY_TYPE_MASK) != type) {
+			fprintf(stderr, "%s: sh with flags 0x%x in type 0x%x\n",
+				what, flags, type);
+			errors++;
+		}
+		all |= flags;
+		count++;
+	}
+	razor_property_iterator_destroy(pi);
+
+	if (count != expected) {
+		fprintf(stderr, "%s: %d properties of type 0x%x, expected %d\n",
+			what, count, type, expected);
+		errors++;
+	}
+	if ((all & expected_flags) != expected_flags) {
+		fprintf(stderr, "%s: flags 0x%x of type 0x%x, missing 0x%x\n",
+			what, all, type, expected_flags & ~all);
+		errors++;
+	}
+
+	return errors;
+}
+
+static int
+check_set(struct razor_set *set, const char *what)
+{
+	int errors = 0;
+
+	errors += check_type(set, what, RAZOR_PROPERTY_REQUIRES, 2,
+			     RAZOR_PROPERTY_PRE);
+	errors += check_type(set, what, RAZOR_PROPERTY_PROVIDES, 1, 0);
+	errors += check_type(set, what, RAZOR_PROPERTY_CONFLICTS, 1, 0);
+	errors += check_type(set, what, RAZOR_PROPERTY_OBSOLETES, 0, 0);
+
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	struct razor_set *set, *file_set, *overlay;
+	int errors = 0;
+
+	set = import_set();
+	errors += check_set(set, "imported");
+
+	make_old_layout(set);
+	errors += check_set(set, "old layout");
+
+	if (razor_set_write(set, filename, RAZOR_REPO_FILE_MAIN) < 0) {
+		fprintf(stderr, "failed to write %s\n", filename);
+		exit(-1);
+	}
+	file_set = razor_set_open(filename);
+	if (file_set == NULL) {
+		fprintf(stderr, "failed to open %s\n", filename);
+		exit(-1);
+	}
+	if (file_set->property_names.size > 0) {
+		fprintf(stderr, "%s has a property name index\n", filename);
+		errors++;
+	}
+	errors += check_set(file_set, filename);
+
+	overlay = razor_set_create_overlay(&file_set, 1);
+	errors += check_set(overlay, "overlay");
+
+	razor_set_destroy(overlay);
+	razor_set_destroy(file_set);
+	razor_set_destroy(set);
+	unlink(filename);
+
+	if (errors) {
+		fprintf(stderr, "\n%d errors\n", errors);
+		return 1;
+	} else
+		return 0;
+}
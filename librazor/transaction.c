@@ -37,14 +37,133 @@
 #include "razor-internal.h"
 #include "razor.h"
 
+#define TRANS_PACKAGE_PRESENT		1
+#define TRANS_PACKAGE_UPDATE		2
+#define TRANS_PROPERTY_SATISFIED	0x80000000
+
+struct transaction_set {
+	struct razor_set *set;
+	uint32_t *packages;
+	uint32_t *properties;
+	uint32_t *keys;
+	int sorted;
+};
+
+/* A transaction updates the system set from any number of upstream
+ * sets, in order of preference.  versions has a version cache for
+ * each upstream set against the system set. */
+struct razor_transaction {
+	int package_count, errors;
+	struct transaction_set system, *upstream;
+	int upstream_count;
+	struct razor_set **sets;
+	int changes;
+	struct razor_version_cache *versions;
+};
+
+static void
+transaction_set_init(struct transaction_set *ts, struct razor_set *set)
+{
+	int count;
+
+	ts->set = set;
+	count = set->packages.size / sizeof (struct razor_package);
+	ts->packages = zalloc(count * sizeof *ts->packages);
+	count = set->properties.size / sizeof (struct razor_property);
+	ts->properties = zalloc(count * sizeof *ts->properties);
+}
+
+static void
+transaction_set_release(struct transaction_set *ts)
+{
+	free(ts->packages);
+	free(ts->properties);
+	free(ts->keys);
+}
+
+/* Compare a name from the string pool of one set with a name from
+ * another.  If both pools are sorted, this is an integer compare,
+ * unless both sets have keys: keys only order strings against the
+ * pool they were mapped into, not against each other. */
 static int
-provider_satisfies_requirement(struct razor_property *provider,
-			       const char *provider_strings,
+compare_names(struct transaction_set *ts1, uint32_t name1,
+	      struct transaction_set *ts2, uint32_t name2)
+{
+	const char *pool1, *pool2;
+	uint32_t key1, key2;
+
+	if (!ts1->sorted || (ts1->keys && ts2->keys)) {
+		pool1 = ts1->set->string_pool.data;
+		pool2 = ts2->set->string_pool.data;
+		return strcmp(&pool1[name1], &pool2[name2]);
+	}
+
+	if (ts1 == ts2) {
+		key1 = name1;
+		key2 = name2;
+	} else {
+		key1 = razor_string_key(ts1->keys, name1);
+		key2 = razor_string_key(ts2->keys, name2);
+	}
+
+	return key1 < key2 ? -1 : key1 > key2;
+}
+
+/* Compare two versions from the string pools of the transaction
+ * sets.  Within a set that has version ranks this is an integer
+ * compare.  Across two sets that have version keys it compares the
+ * keys, and otherwise it goes through the version cache. */
+static int
+compare_versions(struct razor_transaction *trans,
+		 struct transaction_set *ts1, uint32_t version1, uint32_t rank1,
+		 struct transaction_set *ts2, uint32_t version2, uint32_t rank2)
+{
+	const char *pool, *key1, *key2;
+	size_t size1, size2;
+
+	if (ts1 == ts2) {
+		if (version1 == version2)
+			return 0;
+		if (rank1 != RAZOR_NO_RANK && rank2 != RAZOR_NO_RANK)
+			return rank1 < rank2 ? -1 : rank1 > rank2;
+		pool = ts1->set->string_pool.data;
+		return razor_versioncmp(&pool[version1], &pool[version2]);
+	}
+
+	key1 = razor_set_version_key(ts1->set, rank1, &size1);
+	key2 = razor_set_version_key(ts2->set, rank2, &size2);
+	if (key1 != NULL && key2 != NULL)
+		return razor_version_key_compare(key1, size1, key2, size2);
+
+	if (ts1 == &trans->system)
+		return razor_version_cache_compare(&trans->versions[ts2 - trans->upstream],
+						   version1, version2);
+	else if (ts2 == &trans->system)
+		return -razor_version_cache_compare(&trans->versions[ts1 - trans->upstream],
+						    version2, version1);
+
+	return razor_versioncmp((const char *) ts1->set->string_pool.data +
+				version1,
+				(const char *) ts2->set->string_pool.data +
+				version2);
+}
+
+/* Check whether provider, a property in pts, satisfies a requirement
+ * with the given relation flags on version from the string pool of
+ * rts.  rank is the rank of version in rts, or RAZOR_NO_RANK. */
+static int
+provider_satisfies_requirement(struct razor_transaction *trans,
+			       struct transaction_set *pts,
+			       struct razor_property *provider,
 			       uint32_t flags,
-			       const char *required)
+			       struct transaction_set *rts,
+			       uint32_t version, uint32_t rank)
 {
 	int cmp, len;
-	const char *provided = &provider_strings[provider->version];
+	const char *provided, *required;
+
+	provided = (const char *) pts->set->string_pool.data + provider->version;
+	required = (const char *) rts->set->string_pool.data + version;
 
 	if (!*required)
 		return 1;
@@ -55,7 +174,10 @@ provider_satisfies_requirement(struct razor_property *provider,
 			return 1;
 	}
 
-	cmp = razor_versioncmp(provided, required);
+	cmp = compare_versions(trans,
+			       pts, provider->version,
+			       razor_set_property_rank(pts->set, provider),
+			       rts, version, rank);
 
 	switch (flags & RAZOR_PROPERTY_RELATION_MASK) {
 	case RAZOR_PROPERTY_LESS:
@@ -87,41 +209,6 @@ provider_satisfies_requirement(struct razor_property *provider,
 	return 0;
 }
 
-#define TRANS_PACKAGE_PRESENT		1
-#define TRANS_PACKAGE_UPDATE		2
-#define TRANS_PROPERTY_SATISFIED	0x80000000
-
-struct transaction_set {
-	struct razor_set *set;
-	uint32_t *packages;
-	uint32_t *properties;
-};
-
-struct razor_transaction {
-	int package_count, errors;
-	struct transaction_set system, upstream;
-	int changes;
-};
-
-static void
-transaction_set_init(struct transaction_set *ts, struct razor_set *set)
-{
-	int count;
-
-	ts->set = set;
-	count = set->packages.size / sizeof (struct razor_package);
-	ts->packages = zalloc(count * sizeof *ts->packages);
-	count = set->properties.size / sizeof (struct razor_property);
-	ts->properties = zalloc(count * sizeof *ts->properties);
-}
-
-static void
-transaction_set_release(struct transaction_set *ts)
-{
-	free(ts->packages);
-	free(ts->properties);
-}
-
 static void
 transaction_set_install_package(struct transaction_set *ts,
 				struct razor_package *package)
@@ -166,15 +253,78 @@ transaction_set_remove_package(struct transaction_set *ts,
 	}
 }
 
+/* If all string pools are sorted, map the strings of all the other
+ * pools into the offset space of the biggest one, so that comparing
+ * names across sets only compares integers. */
+static void
+transaction_map_keys(struct razor_transaction *trans)
+{
+	struct transaction_set *ts, *base;
+	uint32_t flags;
+	int i;
+
+	flags = trans->system.set->flags;
+	base = &trans->system;
+	for (i = 0; i < trans->upstream_count; i++) {
+		ts = &trans->upstream[i];
+		flags &= ts->set->flags;
+		if (ts->set->string_pool.size > base->set->string_pool.size)
+			base = ts;
+	}
+
+	if (!(flags & RAZOR_SET_SORTED_STRING_POOL))
+		return;
+
+	for (i = -1; i < trans->upstream_count; i++) {
+		ts = i < 0 ? &trans->system : &trans->upstream[i];
+		ts->sorted = 1;
+		if (ts != base)
+			ts->keys =
+				razor_string_pool_map_keys(&ts->set->string_pool,
+							   &base->set->string_pool);
+	}
+}
+
+/**
+ * razor_transaction_create_with_upstreams:
+ * @system: the %razor_set to update
+ * @upstreams: the sets to take new packages from, in order of
+ * preference
+ * @count: the number of upstream sets
+ *
+ * Create a transaction that resolves against several upstream sets
+ * at once, without merging them first.
+ *
+ * Returns: the new #razor_transaction.
+ **/
 RAZOR_EXPORT struct razor_transaction *
-razor_transaction_create(struct razor_set *system, struct razor_set *upstream)
+razor_transaction_create_with_upstreams(struct razor_set *system,
+					struct razor_set **upstreams,
+					int count)
 {
 	struct razor_transaction *trans;
 	struct razor_package *p, *spkgs, *pend;
+	int i;
+
+	assert (system != NULL);
+	assert (upstreams != NULL);
+	assert (count > 0);
 
 	trans = zalloc(sizeof *trans);
+	trans->upstream_count = count;
+	trans->upstream = zalloc(count * sizeof *trans->upstream);
+	trans->versions = malloc(count * sizeof *trans->versions);
+	trans->sets = malloc((count + 1) * sizeof *trans->sets);
 	transaction_set_init(&trans->system, system);
-	transaction_set_init(&trans->upstream, upstream);
+	trans->sets[0] = system;
+	for (i = 0; i < count; i++) {
+		transaction_set_init(&trans->upstream[i], upstreams[i]);
+		razor_version_cache_init(&trans->versions[i],
+					 system, upstreams[i]);
+		trans->sets[i + 1] = upstreams[i];
+	}
+
+	transaction_map_keys(trans);
 
 	spkgs = trans->system.set->packages.data;
 	pend = trans->system.set->packages.data +
@@ -185,14 +335,43 @@ razor_transaction_create(struct razor_set *system, struct razor_set *upstream)
 	return trans;
 }
 
+RAZOR_EXPORT struct razor_transaction *
+razor_transaction_create(struct razor_set *system, struct razor_set *upstream)
+{
+	return razor_transaction_create_with_upstreams(system, &upstream, 1);
+}
+
+/* Find the transaction set that package belongs to. */
+static struct transaction_set *
+transaction_find_set(struct razor_transaction *trans,
+		     struct razor_package *package)
+{
+	struct transaction_set *ts;
+	int i;
+
+	for (i = -1; i < trans->upstream_count; i++) {
+		ts = i < 0 ? &trans->system : &trans->upstream[i];
+		if (ts->set->packages.data <= (void *) package &&
+		    (void *) package <
+		    ts->set->packages.data + ts->set->packages.size)
+			return ts;
+	}
+
+	return NULL;
+}
+
 RAZOR_EXPORT void
 razor_transaction_install_package(struct razor_transaction *trans,
 				  struct razor_package *package)
 {
+	struct transaction_set *ts;
+
 	assert (trans != NULL);
 	assert (package != NULL);
 
-	transaction_set_install_package(&trans->upstream, package);
+	ts = transaction_find_set(trans, package);
+	assert (ts != NULL && ts != &trans->system);
+	transaction_set_install_package(ts, package);
 	trans->changes++;
 }
 
@@ -211,23 +390,23 @@ RAZOR_EXPORT void
 razor_transaction_update_package(struct razor_transaction *trans,
 				  struct razor_package *package)
 {
-	struct razor_package *spkgs, *upkgs, *end;
+	struct transaction_set *ts;
+	struct razor_package *pkgs;
 
 	assert (trans != NULL);
 	assert (package != NULL);
 
-	spkgs = trans->system.set->packages.data;
-	upkgs = trans->upstream.set->packages.data;
-	end = trans->system.set->packages.data +
-		trans->system.set->packages.size;
-	if (spkgs <= package && package < end)
-		trans->system.packages[package - spkgs] |= TRANS_PACKAGE_UPDATE;
-	else
-		trans->upstream.packages[package - upkgs] |= TRANS_PACKAGE_UPDATE;
+	ts = transaction_find_set(trans, package);
+	assert (ts != NULL);
+	pkgs = ts->set->packages.data;
+	ts->packages[package - pkgs] |= TRANS_PACKAGE_UPDATE;
 }
 
 struct prop_iter {
 	struct razor_property *p, *start, *end;
+	struct razor_property_name *name, *name_end;
+	struct razor_set *set;
+	struct transaction_set *ts;
 	const char *pool;
 	uint32_t *present;
 };
@@ -238,6 +417,11 @@ prop_iter_init(struct prop_iter *pi, struct transaction_set *ts)
 	pi->p = ts->set->properties.data;
 	pi->start = ts->set->properties.data;
 	pi->end = ts->set->properties.data + ts->set->properties.size;
+	pi->name = ts->set->property_names.data;
+	pi->name_end = ts->set->property_names.data +
+		ts->set->property_names.size;
+	pi->set = ts->set;
+	pi->ts = ts;
 	pi->pool = ts->set->string_pool.data;
 	pi->present = ts->properties;
 }
@@ -257,16 +441,76 @@ prop_iter_next(struct prop_iter *pi, uint32_t flags, struct razor_property **p)
 	return 0;
 }
 
+/* Seek forward in the property name index.  The names we seek to
+ * are increasing, so gallop from the current position to bracket
+ * the match and then binary search the bracket.  A seek costs
+ * O(log d) string compares, where d is the distance skipped. */
+static struct razor_property *
+prop_iter_seek_to_name(struct prop_iter *pi, uint32_t flags,
+		       struct transaction_set *ts, uint32_t match)
+{
+	struct razor_property_name *lo, *hi, *mid;
+	struct razor_property *start, *end;
+	size_t step;
+
+	lo = pi->name;
+	if (lo < pi->name_end &&
+	    compare_names(pi->ts, lo->name, ts, match) < 0) {
+		step = 1;
+		hi = lo + 1;
+		while (hi < pi->name_end &&
+		       compare_names(pi->ts, hi->name, ts, match) < 0) {
+			lo = hi;
+			step *= 2;
+			hi = step < pi->name_end - lo ? lo + step : pi->name_end;
+		}
+
+		lo++;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (compare_names(pi->ts, mid->name, ts, match) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	pi->name = lo;
+	if (lo == pi->name_end) {
+		pi->p = pi->end;
+		return NULL;
+	}
+
+	if (compare_names(pi->ts, lo->name, ts, match) != 0) {
+		pi->p = pi->start + lo->start[0];
+		return NULL;
+	}
+
+	razor_property_name_get_range(pi->set, lo, flags, &start, &end);
+	pi->p = start;
+	if (start == end)
+		return NULL;
+
+	return pi->p;
+}
+
+/* Seek to the properties of the given type with the name that has
+ * offset match in the string pool of ts. */
 static struct razor_property *
-prop_iter_seek_to(struct prop_iter *pi,
-		  uint32_t flags, const char *match)
+prop_iter_seek_to(struct prop_iter *pi, uint32_t flags,
+		  struct transaction_set *ts, uint32_t match)
 {
 	uint32_t name;
 
-	while (pi->p < pi->end && strcmp(&pi->pool[pi->p->name], match) < 0)
+	if (pi->name < pi->name_end)
+		return prop_iter_seek_to_name(pi, flags, ts, match);
+
+	while (pi->p < pi->end &&
+	       compare_names(pi->ts, pi->p->name, ts, match) < 0)
 		pi->p++;
 
-	if (pi->p == pi->end || strcmp(&pi->pool[pi->p->name], match) > 0)
+	if (pi->p == pi->end ||
+	    compare_names(pi->ts, pi->p->name, ts, match) > 0)
 		return NULL;
 
 	name = pi->p->name;
@@ -288,7 +532,8 @@ static void
 remove_matching_providers(struct razor_transaction *trans,
 			  struct prop_iter *ppi,
 			  uint32_t flags,
-			  const char *version)
+			  struct transaction_set *rts,
+			  uint32_t version, uint32_t rank)
 {
 	struct razor_property *p;
 	struct razor_package *pkg, *pkgs;
@@ -297,11 +542,7 @@ remove_matching_providers(struct razor_transaction *trans,
 	const char *n, *v;
 	uint32_t type;
 
-	if (ppi->present == trans->system.properties)
-		set = trans->system.set;
-	else
-		set = trans->upstream.set;
-
+	set = ppi->set;
 	pkgs = (struct razor_package *) set->packages.data;
 	type = ppi->p->flags & RAZOR_PROPERTY_TYPE_MASK;
 	for (p = ppi->p;
@@ -311,8 +552,8 @@ remove_matching_providers(struct razor_transaction *trans,
 	     p++) {
 		if (!ppi->present[p - ppi->start])
 			continue;
-		if (!provider_satisfies_requirement(p, ppi->pool,
-						    flags, version))
+		if (!provider_satisfies_requirement(trans, ppi->ts, p, flags,
+						    rts, version, rank))
 			continue;
 
 		razor_package_iterator_init_for_property(&pkg_iter, set, p);
@@ -340,13 +581,8 @@ flag_matching_providers(struct razor_transaction *trans,
 	const char *name, *version;
 	uint32_t *flags, type;
 
-	if (ppi->present == trans->system.properties) {
-		set = trans->system.set;
-		flags = trans->system.packages;
-	} else {
-		set = trans->upstream.set;
-		flags = trans->upstream.packages;
-	}
+	set = ppi->set;
+	flags = ppi->ts->packages;
 
 	pkgs = (struct razor_package *) set->packages.data;
 	type = ppi->p->flags & RAZOR_PROPERTY_TYPE_MASK;
@@ -357,9 +593,10 @@ flag_matching_providers(struct razor_transaction *trans,
 	     p++) {
 		if (!ppi->present[p - ppi->start])
 			continue;
-		if (!provider_satisfies_requirement(p, ppi->pool,
-						    r->flags,
-						    &rpi->pool[r->version]))
+		if (!provider_satisfies_requirement(trans, ppi->ts, p,
+						    r->flags, rpi->ts,
+						    r->version,
+						    razor_set_property_rank(rpi->set, r)))
 			continue;
 
 		razor_package_iterator_init_for_property(&pkg_iter, set, p);
@@ -379,15 +616,17 @@ flag_matching_providers(struct razor_transaction *trans,
 }
 
 static struct razor_package *
-pick_matching_provider(struct razor_set *set,
+pick_matching_provider(struct razor_transaction *trans,
 		       struct prop_iter *ppi,
 		       uint32_t flags,
-		       const char *version)
+		       struct transaction_set *rts,
+		       uint32_t version, uint32_t rank)
 {
+	struct razor_set *set = ppi->set;
 	struct razor_property *p;
 	struct razor_package *pkgs;
-	struct list *i;
-	uint32_t type;
+	struct list_iterator li;
+	uint32_t i, type;
 
 	/* This is where we decide which pkgs to pull in to satisfy a
 	 * requirement.  There may be several different providers
@@ -403,13 +642,15 @@ pick_matching_provider(struct razor_set *set,
 		     (p->flags & RAZOR_PROPERTY_TYPE_MASK) == type &&
 		     ppi->present[p - ppi->start] == 0;
 	     p++) {
-		if (!provider_satisfies_requirement(p, ppi->pool,
-						    flags, version))
+		if (!provider_satisfies_requirement(trans, ppi->ts, p, flags,
+						    rts, version, rank))
 			continue;
 
-		i = list_first(&p->packages, &set->package_pool);
+		list_iterator_init(&li, &p->packages, &set->package_pool);
+		if (!list_iterator_next(&li, &i))
+			continue;
 
-		return &pkgs[i->data];
+		return &pkgs[i];
 	}
 
 	return NULL;
@@ -419,26 +660,32 @@ static void
 remove_obsoleted_packages(struct razor_transaction *trans)
 {
 	struct razor_property *up;
-	struct razor_package *spkgs;
+	struct transaction_set *uts;
 	struct prop_iter spi, upi;
+	int i;
 
-	spkgs = trans->system.set->packages.data;
-	prop_iter_init(&spi, &trans->system);
-	prop_iter_init(&upi, &trans->upstream);
-
-	while (prop_iter_next(&upi, RAZOR_PROPERTY_OBSOLETES, &up)) {
-		if (!prop_iter_seek_to(&spi, RAZOR_PROPERTY_PROVIDES,
-				       &upi.pool[up->name]))
-			continue;
-		remove_matching_providers(trans, &spi, up->flags,
-					  &upi.pool[up->version]);
+	for (i = 0; i < trans->upstream_count; i++) {
+		uts = &trans->upstream[i];
+		prop_iter_init(&spi, &trans->system);
+		prop_iter_init(&upi, uts);
+
+		while (prop_iter_next(&upi, RAZOR_PROPERTY_OBSOLETES, &up)) {
+			if (!prop_iter_seek_to(&spi, RAZOR_PROPERTY_PROVIDES,
+					       uts, up->name))
+				continue;
+			remove_matching_providers(trans, &spi, up->flags,
+						  uts, up->version,
+						  razor_set_property_rank(upi.set, up));
+		}
 	}
 }
 
 static int
-any_provider_satisfies_requirement(struct prop_iter *ppi,
+any_provider_satisfies_requirement(struct razor_transaction *trans,
+				   struct prop_iter *ppi,
 				   uint32_t flags,
-				   const char *version)
+				   struct transaction_set *rts,
+				   uint32_t version, uint32_t rank)
 {
 	struct razor_property *p;
 	uint32_t type;
@@ -450,8 +697,8 @@ any_provider_satisfies_requirement(struct prop_iter *ppi,
 		     (p->flags & RAZOR_PROPERTY_TYPE_MASK) == type;
 	     p++) {
 		if (ppi->present[p - ppi->start] > 0 &&
-		    provider_satisfies_requirement(p, ppi->pool,
-						   flags, version))
+		    provider_satisfies_requirement(trans, ppi->ts, p, flags,
+						   rts, version, rank))
 			return 1;
 	}
 
@@ -475,37 +722,97 @@ clear_requires_flags(struct transaction_set *ts)
 	}
 }
 
+struct group_entry {
+	struct transaction_set *ts;
+	struct razor_property *property;
+};
+
+static uint32_t *
+group_entry_present(struct group_entry *e)
+{
+	struct razor_property *properties = e->ts->set->properties.data;
+
+	return &e->ts->properties[e->property - properties];
+}
+
+/* Mark the present requires in a group of requires and provides of
+ * the same name, from all the sets, that a present provide in the
+ * group satisfies. */
 static void
-mark_satisfied_requires(struct razor_transaction *trans,
-			struct transaction_set *rts,
-			struct transaction_set *pts)
+mark_satisfied_group(struct razor_transaction *trans, struct array *group)
 {
-	struct prop_iter rpi, ppi;
+	struct group_entry *r, *p, *end;
 	struct razor_property *rp;
+	uint32_t *present;
 
-	prop_iter_init(&rpi, rts);
-	prop_iter_init(&ppi, pts);
-
-	while (prop_iter_next(&rpi, RAZOR_PROPERTY_REQUIRES, &rp)) {
-		if (!prop_iter_seek_to(&ppi, RAZOR_PROPERTY_PROVIDES,
-				       &rpi.pool[rp->name]))
+	end = group->data + group->size;
+	for (r = group->data; r < end; r++) {
+		rp = r->property;
+		present = group_entry_present(r);
+		if ((rp->flags & RAZOR_PROPERTY_TYPE_MASK) !=
+		    RAZOR_PROPERTY_REQUIRES ||
+		    !(*present & ~TRANS_PROPERTY_SATISFIED))
 			continue;
 
-		if (any_provider_satisfies_requirement(&ppi, rp->flags,
-						       &rpi.pool[rp->version]))
-			rpi.present[rp - rpi.start] |= TRANS_PROPERTY_SATISFIED;
+		for (p = group->data; p < end; p++) {
+			if ((p->property->flags & RAZOR_PROPERTY_TYPE_MASK) !=
+			    RAZOR_PROPERTY_PROVIDES ||
+			    *group_entry_present(p) == 0)
+				continue;
+			if (provider_satisfies_requirement(trans, p->ts,
+							   p->property,
+							   rp->flags, r->ts,
+							   rp->version,
+							   razor_set_property_rank(r->ts->set, rp))) {
+				*present |= TRANS_PROPERTY_SATISFIED;
+				break;
+			}
+		}
 	}
+
+	group->size = 0;
 }
 
+/* Go through the properties of all the sets at once, in name order,
+ * and match up the requires and provides of each name. */
 static void
 mark_all_satisfied_requires(struct razor_transaction *trans)
 {
+	struct razor_property_iterator *pi;
+	struct razor_property *property;
+	struct group_entry *e;
+	struct array group;
+	const char *name, *version, *group_name;
+	uint32_t flags;
+	int i;
+
 	clear_requires_flags(&trans->system);
-	clear_requires_flags(&trans->upstream);
-	mark_satisfied_requires(trans, &trans->system, &trans->system);
-	mark_satisfied_requires(trans, &trans->system, &trans->upstream);
-	mark_satisfied_requires(trans, &trans->upstream, &trans->system);
-	mark_satisfied_requires(trans, &trans->upstream, &trans->upstream);
+	for (i = 0; i < trans->upstream_count; i++)
+		clear_requires_flags(&trans->upstream[i]);
+
+	array_init(&group);
+	group_name = NULL;
+	pi = razor_property_iterator_create_for_sets(trans->sets,
+						     trans->upstream_count + 1);
+	while (razor_property_iterator_next_with_set(pi, &i, &property,
+						     &name, &flags, &version)) {
+		if (group_name && strcmp(group_name, name) != 0)
+			mark_satisfied_group(trans, &group);
+		group_name = name;
+
+		flags &= RAZOR_PROPERTY_TYPE_MASK;
+		if (flags != RAZOR_PROPERTY_REQUIRES &&
+		    flags != RAZOR_PROPERTY_PROVIDES)
+			continue;
+
+		e = array_add(&group, sizeof *e);
+		e->ts = i == 0 ? &trans->system : &trans->upstream[i - 1];
+		e->property = property;
+	}
+	mark_satisfied_group(trans, &group);
+
+	razor_property_iterator_destroy(pi);
+	array_release(&group);
 }
 
 static void
@@ -554,8 +861,12 @@ razor_transaction_update_all(struct razor_transaction *trans)
 		trans->system.packages[i] |= TRANS_PACKAGE_UPDATE;
 }
 
+/* Update the system packages that conflict with what the upstream
+ * set provides, and flag the upstream packages that conflict with
+ * system packages for update. */
 static void
-update_conflicted_packages(struct razor_transaction *trans)
+update_conflicted_packages_for(struct razor_transaction *trans,
+			       struct transaction_set *uts)
 {
 	struct razor_package *pkg, *spkgs;
 	struct razor_property *up, *sp;
@@ -565,15 +876,17 @@ update_conflicted_packages(struct razor_transaction *trans)
 
 	spkgs = trans->system.set->packages.data;
 	prop_iter_init(&spi, &trans->system);
-	prop_iter_init(&upi, &trans->upstream);
+	prop_iter_init(&upi, uts);
 
 	while (prop_iter_next(&spi, RAZOR_PROPERTY_CONFLICTS, &sp)) {
 		if (!prop_iter_seek_to(&upi, RAZOR_PROPERTY_PROVIDES,
-				       &spi.pool[sp->name]))
+				       &trans->system, sp->name))
 			continue;
 
-		if (!any_provider_satisfies_requirement(&upi, sp->flags,
-							&spi.pool[sp->version]))
+		if (!any_provider_satisfies_requirement(trans, &upi, sp->flags,
+							&trans->system,
+							sp->version,
+							razor_set_property_rank(spi.set, sp)))
 			continue;
 
 		razor_package_iterator_init_for_property(&pkg_iter,
@@ -592,11 +905,11 @@ update_conflicted_packages(struct razor_transaction *trans)
 	}
 
 	prop_iter_init(&spi, &trans->system);
-	prop_iter_init(&upi, &trans->upstream);
+	prop_iter_init(&upi, uts);
 
 	while (prop_iter_next(&upi, RAZOR_PROPERTY_CONFLICTS, &up)) {
 		sp = prop_iter_seek_to(&spi, RAZOR_PROPERTY_PROVIDES,
-				       &upi.pool[upi.p->name]);
+				       uts, upi.p->name);
 
 		if (sp)
 			flag_matching_providers(trans, &spi, up, &upi,
@@ -605,57 +918,130 @@ update_conflicted_packages(struct razor_transaction *trans)
 }
 
 static void
-pull_in_requirements(struct razor_transaction *trans,
-		     struct prop_iter *rpi, struct prop_iter *ppi)
+update_conflicted_packages(struct razor_transaction *trans)
 {
-	struct razor_property *rp, *pp;
-	struct razor_package *pkg, *upkgs;
+	int i;
 
-	upkgs = trans->upstream.set->packages.data;
-	while (prop_iter_next(rpi, RAZOR_PROPERTY_REQUIRES, &rp)) {
-		if (rpi->present[rp - rpi->start] & TRANS_PROPERTY_SATISFIED)
-			continue;
+	for (i = 0; i < trans->upstream_count; i++)
+		update_conflicted_packages_for(trans, &trans->upstream[i]);
+}
 
-		pp = prop_iter_seek_to(ppi, RAZOR_PROPERTY_PROVIDES,
-				       &rpi->pool[rp->name]);
+/* Pull in a provider for the requirement rp of rts from the first
+ * upstream set that has one.  providers has the first provide of the
+ * name of rp in each set, or NULL. */
+static void
+pull_in_requirement(struct razor_transaction *trans,
+		    struct transaction_set *rts, struct razor_property *rp,
+		    struct razor_property **providers)
+{
+	struct razor_property *pp, *rproperties;
+	struct razor_package *pkg, *upkgs;
+	struct prop_iter ppi;
+	const char *rpool;
+	int i;
+
+	rproperties = rts->set->properties.data;
+	rpool = rts->set->string_pool.data;
+	for (i = 0; i < trans->upstream_count; i++) {
+		pp = providers[i + 1];
 		if (pp == NULL)
 			continue;
-		pkg = pick_matching_provider(trans->upstream.set,
-					     ppi, rp->flags,
-					     &rpi->pool[rp->version]);
+
+		prop_iter_init(&ppi, &trans->upstream[i]);
+		ppi.p = pp;
+		pkg = pick_matching_provider(trans, &ppi, rp->flags,
+					     rts, rp->version,
+					     razor_set_property_rank(rts->set, rp));
 		if (pkg == NULL)
 			continue;
 
-		rpi->present[rp - rpi->start] |= TRANS_PROPERTY_SATISFIED;
+		rts->properties[rp - rproperties] |= TRANS_PROPERTY_SATISFIED;
 
 		fprintf(stderr, "pulling in %s-%s.%s which provides %s %s %s "
 			"to satisfy %s %s %s\n",
-			ppi->pool + pkg->name,
-			ppi->pool + pkg->version,
-			ppi->pool + pkg->arch,
-			ppi->pool + pp->name,
+			ppi.pool + pkg->name,
+			ppi.pool + pkg->version,
+			ppi.pool + pkg->arch,
+			ppi.pool + pp->name,
 			razor_property_relation_to_string(pp),
-			ppi->pool + pp->version,
-			&rpi->pool[rp->name],
+			ppi.pool + pp->version,
+			&rpool[rp->name],
 			razor_property_relation_to_string(rp),
-			&rpi->pool[rp->version]);
+			&rpool[rp->version]);
 
-		trans->upstream.packages[pkg - upkgs] |= TRANS_PACKAGE_UPDATE;
+		upkgs = ppi.set->packages.data;
+		ppi.ts->packages[pkg - upkgs] |= TRANS_PACKAGE_UPDATE;
+		return;
 	}
 }
 
+/* Pull in providers for the unsatisfied requires in a group of
+ * properties of the same name, from all the sets. */
+static void
+pull_in_group(struct razor_transaction *trans, struct array *group,
+	      struct razor_property **providers)
+{
+	struct group_entry *r, *end;
+
+	end = group->data + group->size;
+	for (r = group->data; r < end; r++)
+		pull_in_requirement(trans, r->ts, r->property, providers);
+
+	group->size = 0;
+	memset(providers, 0,
+	       (trans->upstream_count + 1) * sizeof *providers);
+}
+
+/* Go through the properties of all the sets at once, in name order,
+ * and pull in a provider for each present requirement that isn't
+ * satisfied yet.  Earlier upstream sets get the first pick. */
 static void
 pull_in_all_requirements(struct razor_transaction *trans)
 {
-	struct prop_iter rpi, ppi;
+	struct razor_property_iterator *pi;
+	struct razor_property *property, *properties, **providers;
+	struct group_entry *e;
+	struct transaction_set *ts;
+	struct array group;
+	const char *name, *version, *group_name;
+	uint32_t flags, present;
+	int i;
 
-	prop_iter_init(&rpi, &trans->system);
-	prop_iter_init(&ppi, &trans->upstream);
-	pull_in_requirements(trans, &rpi, &ppi);
+	array_init(&group);
+	providers = zalloc((trans->upstream_count + 1) * sizeof *providers);
+	group_name = NULL;
+	pi = razor_property_iterator_create_for_sets(trans->sets,
+						     trans->upstream_count + 1);
+	while (razor_property_iterator_next_with_set(pi, &i, &property,
+						     &name, &flags, &version)) {
+		if (group_name && strcmp(group_name, name) != 0)
+			pull_in_group(trans, &group, providers);
+		group_name = name;
+
+		ts = i == 0 ? &trans->system : &trans->upstream[i - 1];
+		flags &= RAZOR_PROPERTY_TYPE_MASK;
+		if (flags == RAZOR_PROPERTY_PROVIDES) {
+			if (providers[i] == NULL)
+				providers[i] = property;
+			continue;
+		}
+
+		properties = ts->set->properties.data;
+		present = ts->properties[property - properties];
+		if (flags != RAZOR_PROPERTY_REQUIRES ||
+		    !(present & ~TRANS_PROPERTY_SATISFIED) ||
+		    (present & TRANS_PROPERTY_SATISFIED))
+			continue;
+
+		e = array_add(&group, sizeof *e);
+		e->ts = ts;
+		e->property = property;
+	}
+	pull_in_group(trans, &group, providers);
 
-	prop_iter_init(&rpi, &trans->upstream);
-	prop_iter_init(&ppi, &trans->upstream);
-	pull_in_requirements(trans, &rpi, &ppi);
+	razor_property_iterator_destroy(pi);
+	free(providers);
+	array_release(&group);
 }
 
 static void
@@ -663,12 +1049,15 @@ flush_scheduled_system_updates(struct razor_transaction *trans)
 {
  	struct razor_package_iterator *pi;
  	struct razor_package *p, *pkg, *spkgs;
-	struct prop_iter ppi;
+	struct prop_iter *ppi, *upi;
 	const char *name, *version;
+	int i;
 
 	spkgs = trans->system.set->packages.data;
 	pi = razor_package_iterator_create(trans->system.set);
-	prop_iter_init(&ppi, &trans->upstream);
+	upi = malloc(trans->upstream_count * sizeof *upi);
+	for (i = 0; i < trans->upstream_count; i++)
+		prop_iter_init(&upi[i], &trans->upstream[i]);
 
 	while (razor_package_iterator_next(pi, &p,
 					   RAZOR_DETAIL_NAME, &name,
@@ -677,54 +1066,77 @@ flush_scheduled_system_updates(struct razor_transaction *trans)
 		if (!(trans->system.packages[p - spkgs] & TRANS_PACKAGE_UPDATE))
 			continue;
 
-		if (!prop_iter_seek_to(&ppi, RAZOR_PROPERTY_PROVIDES, name))
-			continue;
-
-		pkg = pick_matching_provider(trans->upstream.set, &ppi,
-					     RAZOR_PROPERTY_GREATER, version);
+		/* Take the update from the first upstream set that
+		 * has one. */
+		pkg = NULL;
+		for (i = 0; i < trans->upstream_count && pkg == NULL; i++) {
+			ppi = &upi[i];
+			if (!prop_iter_seek_to(ppi, RAZOR_PROPERTY_PROVIDES,
+					       &trans->system, p->name))
+				continue;
+
+			pkg = pick_matching_provider(trans, ppi,
+						     RAZOR_PROPERTY_GREATER,
+						     &trans->system, p->version,
+						     razor_set_package_rank(trans->system.set, p));
+		}
 		if (pkg == NULL)
 			continue;
 
 		fprintf(stderr, "updating %s-%s to %s-%s\n",
 			name, version,
-			&ppi.pool[pkg->name], &ppi.pool[pkg->version]);
+			&ppi->pool[pkg->name], &ppi->pool[pkg->version]);
 
 		razor_transaction_remove_package(trans, p);
 		razor_transaction_install_package(trans, pkg);
 	}
 
 	razor_package_iterator_destroy(pi);
+	free(upi);
 }
 
 static void
-flush_scheduled_upstream_updates(struct razor_transaction *trans)
+flush_scheduled_upstream_updates_for(struct razor_transaction *trans,
+				     struct transaction_set *uts)
 {
  	struct razor_package_iterator *pi;
  	struct razor_package *p, *upkgs;
 	struct prop_iter spi;
 	const char *name, *version;
 
-	upkgs = trans->upstream.set->packages.data;
-	pi = razor_package_iterator_create(trans->upstream.set);
+	upkgs = uts->set->packages.data;
+	pi = razor_package_iterator_create(uts->set);
 	prop_iter_init(&spi, &trans->system);
 
 	while (razor_package_iterator_next(pi, &p,
 					   RAZOR_DETAIL_NAME, &name,
 					   RAZOR_DETAIL_VERSION, &version,
 					   RAZOR_DETAIL_LAST)) {
-		if (!(trans->upstream.packages[p - upkgs] & TRANS_PACKAGE_UPDATE))
+		if (!(uts->packages[p - upkgs] & TRANS_PACKAGE_UPDATE))
 			continue;
 
-		if (prop_iter_seek_to(&spi, RAZOR_PROPERTY_PROVIDES, name))
+		if (prop_iter_seek_to(&spi, RAZOR_PROPERTY_PROVIDES,
+				      uts, p->name))
 			remove_matching_providers(trans,
 						  &spi,
 						  RAZOR_PROPERTY_LESS,
-						  version);
+						  uts, p->version,
+						  razor_set_package_rank(uts->set, p));
 		razor_transaction_install_package(trans, p);
 		fprintf(stderr, "installing %s-%s\n", name, version);
 	}
 }
 
+static void
+flush_scheduled_upstream_updates(struct razor_transaction *trans)
+{
+	int i;
+
+	for (i = 0; i < trans->upstream_count; i++)
+		flush_scheduled_upstream_updates_for(trans,
+						     &trans->upstream[i]);
+}
+
 RAZOR_EXPORT int
 razor_transaction_resolve(struct razor_transaction *trans)
 {
@@ -785,7 +1197,7 @@ razor_transaction_describe(struct razor_transaction *trans)
 {
 	struct prop_iter rpi;
 	struct razor_property *rp;
-	int unsatisfied;
+	int i, unsatisfied;
 
 	flush_scheduled_system_updates(trans);
 	flush_scheduled_upstream_updates(trans);
@@ -800,11 +1212,13 @@ razor_transaction_describe(struct razor_transaction *trans)
 		}
 	}
 
-	prop_iter_init(&rpi, &trans->upstream);
-	while (prop_iter_next(&rpi, RAZOR_PROPERTY_REQUIRES, &rp)) {
-		if (!(rpi.present[rp - rpi.start] & TRANS_PROPERTY_SATISFIED)) {
-			describe_unsatisfied(trans->upstream.set, rp);
-			unsatisfied++;
+	for (i = 0; i < trans->upstream_count; i++) {
+		prop_iter_init(&rpi, &trans->upstream[i]);
+		while (prop_iter_next(&rpi, RAZOR_PROPERTY_REQUIRES, &rp)) {
+			if (!(rpi.present[rp - rpi.start] & TRANS_PROPERTY_SATISFIED)) {
+				describe_unsatisfied(rpi.ts->set, rp);
+				unsatisfied++;
+			}
 		}
 	}
 
@@ -819,6 +1233,7 @@ razor_transaction_unsatisfied_property(struct razor_transaction *trans,
 {
 	struct prop_iter pi;
 	struct razor_property *p;
+	int i;
 
 	prop_iter_init(&pi, &trans->system);
 	while (prop_iter_next(&pi, flags & RAZOR_PROPERTY_TYPE_MASK, &p)) {
@@ -830,78 +1245,106 @@ razor_transaction_unsatisfied_property(struct razor_transaction *trans,
 			return 1;
 	}
 
-	prop_iter_init(&pi, &trans->upstream);
-	while (prop_iter_next(&pi, flags & RAZOR_PROPERTY_TYPE_MASK, &p)) {
-		if (!(trans->upstream.properties[p - pi.start] & TRANS_PROPERTY_SATISFIED) &&
-		    p->flags == flags &&
-		    strcmp(&pi.pool[p->name], name) == 0 &&
-		    strcmp(&pi.pool[p->version], version) == 0)
+	for (i = 0; i < trans->upstream_count; i++) {
+		prop_iter_init(&pi, &trans->upstream[i]);
+		while (prop_iter_next(&pi, flags & RAZOR_PROPERTY_TYPE_MASK, &p)) {
+			if (!(pi.present[p - pi.start] & TRANS_PROPERTY_SATISFIED) &&
+			    p->flags == flags &&
+			    strcmp(&pi.pool[p->name], name) == 0 &&
+			    strcmp(&pi.pool[p->version], version) == 0)
 
-			return 1;
+				return 1;
+		}
 	}
 
 	return 0;
 }
 
+/* Merge the present packages of all the sets in one pass.  Each
+ * step takes the package with the lowest name and, for a name that
+ * is in more than one set, the lowest version, so the new set is
+ * sorted the same way a set from the importer is.  On a tie the
+ * system set wins, then the upstream sets in order. */
 RAZOR_EXPORT struct razor_set *
 razor_transaction_finish(struct razor_transaction *trans)
 {
 	struct razor_merger *merger;
-	struct razor_package *u, *uend, *upkgs, *s, *send, *spkgs;
-	char *upool, *spool;
-	int cmp;
+	struct razor_package **heads, **ends, *pkgs, *p, *min_p;
+	struct transaction_set *ts, *min;
+	struct razor_set *set;
+	int i, min_i, count, cmp;
 
-	s = trans->system.set->packages.data;
-	spkgs = trans->system.set->packages.data;
-	send = trans->system.set->packages.data +
-		trans->system.set->packages.size;
-	spool = trans->system.set->string_pool.data;
-
-	u = trans->upstream.set->packages.data;
-	upkgs = trans->upstream.set->packages.data;
-	uend = trans->upstream.set->packages.data +
-		trans->upstream.set->packages.size;
-	upool = trans->upstream.set->string_pool.data;
-
-	merger = razor_merger_create(trans->system.set, trans->upstream.set);
-	while (s < send || u < uend) {
-		if (s < send && u < uend)
-			cmp = strcmp(&spool[s->name], &upool[u->name]);
-		else if (s < send)
-			cmp = -1;
-		else
-			cmp = 1;
-
-		if (cmp < 0) {
-			if (trans->system.packages[s - spkgs] & TRANS_PACKAGE_PRESENT)
-				razor_merger_add_package(merger, s);
-			s++;
-		} else if (cmp == 0) {
-			if (trans->system.packages[s - spkgs] & TRANS_PACKAGE_PRESENT)
-				razor_merger_add_package(merger, s);
-			if (trans->upstream.packages[u - upkgs] & TRANS_PACKAGE_PRESENT)
-				razor_merger_add_package(merger, u);
-
-			s++;
-			u++;
-		} else {
-			if (trans->upstream.packages[u - upkgs] & TRANS_PACKAGE_PRESENT)
-				razor_merger_add_package(merger, u);
-			u++;
+	count = trans->upstream_count + 1;
+	heads = zalloc(count * sizeof *heads);
+	ends = zalloc(count * sizeof *ends);
+	for (i = 0; i < count; i++) {
+		ts = i == 0 ? &trans->system : &trans->upstream[i - 1];
+		heads[i] = ts->set->packages.data;
+		ends[i] = ts->set->packages.data + ts->set->packages.size;
+	}
+
+	merger = razor_merger_create_for_sets(trans->sets, count);
+	for (;;) {
+		min = NULL;
+		min_p = NULL;
+		min_i = 0;
+		for (i = 0; i < count; i++) {
+			ts = i == 0 ? &trans->system : &trans->upstream[i - 1];
+			pkgs = ts->set->packages.data;
+			while (heads[i] < ends[i] &&
+			       !(ts->packages[heads[i] - pkgs] &
+				 TRANS_PACKAGE_PRESENT))
+				heads[i]++;
+			if (heads[i] == ends[i])
+				continue;
+
+			p = heads[i];
+			if (min == NULL) {
+				cmp = -1;
+			} else {
+				cmp = compare_names(ts, p->name,
+						    min, min_p->name);
+				if (cmp == 0)
+					cmp = compare_versions(trans,
+							       ts, p->version,
+							       razor_set_package_rank(ts->set, p),
+							       min, min_p->version,
+							       razor_set_package_rank(min->set, min_p));
+			}
+			if (cmp < 0) {
+				min = ts;
+				min_p = p;
+				min_i = i;
+			}
 		}
+		if (min == NULL)
+			break;
+
+		razor_merger_add_package(merger, min_p);
+		heads[min_i]++;
 	}
 
+	set = razor_merger_finish(merger);
+	free(heads);
+	free(ends);
+
 	razor_transaction_destroy(trans);
 
-	return razor_merger_finish(merger);
+	return set;
 }
 
 RAZOR_EXPORT void
 razor_transaction_destroy(struct razor_transaction *trans)
 {
+	int i;
+
 	assert (trans != NULL);
 
 	transaction_set_release(&trans->system);
-	transaction_set_release(&trans->upstream);
+	for (i = 0; i < trans->upstream_count; i++)
+		transaction_set_release(&trans->upstream[i]);
+	free(trans->upstream);
+	free(trans->versions);
+	free(trans->sets);
 	free(trans);
 }
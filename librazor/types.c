@@ -19,6 +19,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "razor-internal.h"
 
@@ -62,16 +67,15 @@ array_add(struct array *array, int size)
 	return p;
 }
 
-/* RAZOR_IMMEDIATE and RAZOR_ENTRY_LAST must have the same value */
-#define RAZOR_ENTRY_LAST 0x80
-#define RAZOR_IMMEDIATE  0x80
-#define RAZOR_EMPTY_LIST 0xff
+/* RAZOR_IMMEDIATE and RAZOR_LIST_LAST must have the same value */
+#define RAZOR_IMMEDIATE  0x01
+#define RAZOR_EMPTY_LIST 0x7fffffff
 
 void
 list_set_empty(struct list_head *head)
 {
-	head->list_ptr = ~0;
-	head->flags = RAZOR_EMPTY_LIST;
+	head->list_ptr = RAZOR_EMPTY_LIST;
+	head->flags = RAZOR_IMMEDIATE;
 }
 
 void
@@ -100,14 +104,15 @@ list_set_array(struct list_head *head, struct array *pool,
 
 	p = array_add(pool, items->size);
 	memcpy(p, items->data, items->size);
-	p[items->size / sizeof *p - 1].flags = RAZOR_ENTRY_LAST;
+	p[items->size / sizeof *p - 1].flags = RAZOR_LIST_LAST;
 	list_set_ptr(head, p - (struct list *) pool->data);
 }
 
 struct list *
 list_first(struct list_head *head, struct array *pool)
 {
-	if (head->flags == RAZOR_EMPTY_LIST)
+	if (head->flags == RAZOR_IMMEDIATE &&
+	    head->list_ptr == RAZOR_EMPTY_LIST)
 		return NULL;
 	else if (head->flags == RAZOR_IMMEDIATE)
 		return (struct list *) head;
@@ -123,6 +128,264 @@ list_next(struct list *list)
 	return ++list;
 }
 
+static inline uint32_t
+zigzag_encode(uint32_t delta)
+{
+	return (delta << 1) ^ -(delta >> 31);
+}
+
+static inline uint32_t
+zigzag_decode(uint32_t value)
+{
+	return (value >> 1) ^ -(value & 1);
+}
+
+static inline uint32_t
+packed_length(uint32_t value)
+{
+	if (value < 1 << 8)
+		return 1;
+	else if (value < 1 << 16)
+		return 2;
+	else if (value < 1 << 24)
+		return 3;
+	else
+		return 4;
+}
+
+/* Store the list in items packed if that is shorter than a plain
+ * list.  Short lists are never packed, the immediate and empty
+ * encodings are better and plain lists are faster to walk. */
+void
+list_set_packed(struct list_head *head, struct array *pool,
+		struct array *items)
+{
+	uint32_t *p, *end, count, groups, size, last, value, length, i;
+	uint8_t *block, *control, *data;
+
+	count = items->size / sizeof *p;
+	if (count < RAZOR_PACKED_LIST_MIN) {
+		list_set_array(head, pool, items, 0);
+		return;
+	}
+
+	groups = (count + 3) / 4;
+	size = 0;
+	last = 0;
+	end = items->data + items->size;
+	for (p = items->data; p < end; p++) {
+		size += packed_length(zigzag_encode(*p - last));
+		last = *p;
+	}
+
+	/* Three bytes of slack at the end, so the decoder can always
+	 * load a full word. */
+	size = ALIGN(sizeof count + groups + size + 3, sizeof count);
+	if (size >= items->size) {
+		list_set_array(head, pool, items, 0);
+		return;
+	}
+
+	block = array_add(pool, size);
+	memset(block, 0, size);
+	memcpy(block, &count, sizeof count);
+	control = block + sizeof count;
+	data = control + groups;
+	last = 0;
+	for (i = 0, p = items->data; p < end; i++, p++) {
+		value = zigzag_encode(*p - last);
+		length = packed_length(value);
+		control[i / 4] |= (length - 1) << (i % 4 * 2);
+		while (length--) {
+			*data++ = value;
+			value >>= 8;
+		}
+		last = *p;
+	}
+
+	list_set_ptr(head, RAZOR_PACKED_LIST |
+		     (block - (uint8_t *) pool->data) / sizeof (struct list));
+}
+
+void
+list_iterator_init(struct list_iterator *li, struct list_head *head,
+		   struct array *pool)
+{
+	const uint8_t *block;
+
+	memset(li, 0, sizeof *li);
+	if (head->flags == RAZOR_IMMEDIATE &&
+	    head->list_ptr == RAZOR_EMPTY_LIST)
+		return;
+	else if (head->flags == RAZOR_IMMEDIATE) {
+		li->buffer[0] = head->list_ptr;
+		li->count = 1;
+	} else if (head->list_ptr & RAZOR_PACKED_LIST) {
+		block = (const uint8_t *) pool->data + sizeof (struct list) *
+			(head->list_ptr & ~RAZOR_PACKED_LIST);
+		memcpy(&li->remaining, block, sizeof li->remaining);
+		li->control = block + sizeof li->remaining;
+		li->data = li->control + (li->remaining + 3) / 4;
+	} else
+		li->list = (struct list *) pool->data + head->list_ptr;
+}
+
+void
+list_iterator_init_list(struct list_iterator *li, struct list *list)
+{
+	memset(li, 0, sizeof *li);
+	li->list = list;
+}
+
+static inline uint32_t
+load_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* Expand the next batch of a packed list into the buffer, four
+ * entries per control byte. */
+uint32_t
+list_iterator_decode(struct list_iterator *li)
+{
+	static const uint32_t mask[4] = {
+		0xff, 0xffff, 0xffffff, 0xffffffff
+	};
+	const uint8_t *data;
+	uint32_t count, last, control, length, i;
+
+	count = li->remaining;
+	if (count > RAZOR_LIST_BATCH)
+		count = RAZOR_LIST_BATCH;
+
+	data = li->data;
+	last = li->last;
+	control = 0;
+	for (i = 0; i < count; i++) {
+		if (i % 4 == 0)
+			control = *li->control++;
+		length = control & 3;
+		control >>= 2;
+		last += zigzag_decode(load_le32(data) & mask[length]);
+		li->buffer[i] = last;
+		data += length + 1;
+	}
+
+	li->data = data;
+	li->last = last;
+	li->remaining -= count;
+	li->index = 0;
+	li->count = count;
+
+	return count;
+}
+
+void
+list_table_init(struct list_table *table, struct array *pool)
+{
+	memset(table, 0, sizeof *table);
+	table->pool = pool;
+}
+
+void
+list_table_release(struct list_table *table)
+{
+	free(table->buckets);
+}
+
+static uint32_t
+hash_list(struct array *items)
+{
+	uint32_t *p, *end, hash = 2166136261u;
+
+	end = items->data + items->size;
+	for (p = items->data; p < end; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	return hash;
+}
+
+static int
+list_equal(struct list_head *head, struct array *pool, struct array *items)
+{
+	struct list_iterator li;
+	uint32_t *p, *end, data;
+
+	list_iterator_init(&li, head, pool);
+	end = items->data + items->size;
+	for (p = items->data; p < end; p++)
+		if (!list_iterator_next(&li, &data) || data != *p)
+			return 0;
+
+	return !list_iterator_next(&li, &data);
+}
+
+/* Unused buckets hold the empty list, which is never stored in the
+ * table, just like immediate lists. */
+static void
+list_table_grow(struct list_table *table)
+{
+	struct list_bucket *buckets, *b, *end;
+	uint32_t size, i;
+
+	buckets = table->buckets;
+	size = table->size;
+	table->size = size > 0 ? size * 2 : 256;
+	table->buckets = malloc(table->size * sizeof *table->buckets);
+	for (i = 0; i < table->size; i++)
+		list_set_empty(&table->buckets[i].head);
+
+	end = buckets + size;
+	for (b = buckets; b < end; b++) {
+		if (b->head.flags == RAZOR_IMMEDIATE)
+			continue;
+		i = b->hash & (table->size - 1);
+		while (table->buckets[i].head.flags != RAZOR_IMMEDIATE)
+			i = (i + 1) & (table->size - 1);
+		table->buckets[i] = *b;
+	}
+	free(buckets);
+}
+
+/* Like list_set_array(), but point the head at an equal list if the
+ * pool already has one, and pack the list if packed is set. */
+void
+list_table_set_array(struct list_table *table, struct list_head *head,
+		     struct array *items, int packed)
+{
+	struct list_bucket *b;
+	uint32_t hash, mask, i;
+
+	if (items->size <= (int) sizeof (uint32_t)) {
+		list_set_array(head, table->pool, items, 0);
+		return;
+	}
+
+	if (2 * (table->count + 1) > table->size)
+		list_table_grow(table);
+
+	hash = hash_list(items);
+	mask = table->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		b = &table->buckets[i];
+		if (b->head.flags == RAZOR_IMMEDIATE)
+			break;
+		if (b->hash == hash && list_equal(&b->head, table->pool, items)) {
+			*head = b->head;
+			return;
+		}
+	}
+
+	if (packed)
+		list_set_packed(head, table->pool, items);
+	else
+		list_set_array(head, table->pool, items, 0);
+
+	b->hash = hash;
+	b->head = *head;
+	table->count++;
+}
+
 void
 list_remap_pool(struct array *pool, uint32_t *map)
 {
@@ -136,115 +399,296 @@ list_remap_pool(struct array *pool, uint32_t *map)
 void
 list_remap_head(struct list_head *head, uint32_t *map)
 {
-	if (head->flags == RAZOR_IMMEDIATE)
+	if (head->flags == RAZOR_IMMEDIATE &&
+	    head->list_ptr != RAZOR_EMPTY_LIST)
 		head->list_ptr = map[head->list_ptr];
 }
 
 
+/* The string table is a Swiss table.  Each slot holds the full hash
+ * and the pool offset of a string, and a separate array holds a tag
+ * byte per slot: 7 bits of the hash, or HASHTABLE_EMPTY.  A lookup
+ * compares the tags of a group of 16 slots in one go and only looks
+ * at the slots whose tag matches, and only calls strcmp() when the
+ * whole hash matches.  Keeping the hash also means that growing the
+ * table never reads the strings again.  The tags and the slots are
+ * one allocation, which is also the layout of the string index
+ * section. */
+#define HASHTABLE_GROUP		16
+#define HASHTABLE_EMPTY		0x80
+#define HASHTABLE_TAG(hash)	((hash) & 0x7f)
+
+#if defined(__SSE2__)
+
+static inline uint32_t
+group_match(const uint8_t *tags, uint8_t tag)
+{
+	__m128i group;
+
+	group = _mm_loadu_si128((const __m128i *) tags);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
+
+#elif defined(__aarch64__)
+
+static inline uint32_t
+group_match(const uint8_t *tags, uint8_t tag)
+{
+	static const uint8_t bits[HASHTABLE_GROUP] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t match;
+
+	match = vandq_u8(vceqq_u8(vld1q_u8(tags), vdupq_n_u8(tag)),
+			 vld1q_u8(bits));
+
+	return vaddv_u8(vget_low_u8(match)) |
+		vaddv_u8(vget_high_u8(match)) << 8;
+}
+
+#else
+
+static inline uint32_t
+group_match(const uint8_t *tags, uint8_t tag)
+{
+	uint32_t mask;
+	int i;
+
+	mask = 0;
+	for (i = 0; i < HASHTABLE_GROUP; i++)
+		if (tags[i] == tag)
+			mask |= 1 << i;
+
+	return mask;
+}
+
+#endif
+
+uint32_t
+hashtable_hash_string(const char *key, size_t length)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ull;
+	uint64_t hash, word;
+
+	hash = length * k;
+	while (length >= sizeof word) {
+		memcpy(&word, key, sizeof word);
+		hash = (hash ^ word) * k;
+		hash ^= hash >> 32;
+		key += sizeof word;
+		length -= sizeof word;
+	}
+
+	word = 0;
+	memcpy(&word, key, length);
+	hash = (hash ^ word) * k;
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
 void
 hashtable_init(struct hashtable *table, struct array *pool)
 {
-	array_init(&table->buckets);
+	memset(table, 0, sizeof *table);
 	table->pool = pool;
 }
 
 void
 hashtable_release(struct hashtable *table)
 {
-	array_release(&table->buckets);
+	free(table->tags);
 }
 
-static unsigned int
-hash_string(const char *key)
+uint32_t
+hashtable_lookup_with_hash(struct hashtable *table, const char *key,
+			   uint32_t hash)
 {
-	const char *p;
-	unsigned int hash = 0;
+	struct hashtable_slot *slot;
+	const uint8_t *tags;
+	const char *pool;
+	uint32_t mask, group, match;
 
-	for (p = key; *p; p++)
-		hash = (hash * 617) ^ *p;
+	if (table->size == 0)
+		return 0;
 
-	return hash;
+	pool = table->pool->data;
+	mask = table->size / HASHTABLE_GROUP - 1;
+	group = (hash >> 7) & mask;
+	for (;;) {
+		tags = table->tags + group * HASHTABLE_GROUP;
+		match = group_match(tags, HASHTABLE_TAG(hash));
+		while (match) {
+			slot = &table->slots[group * HASHTABLE_GROUP +
+					     __builtin_ctz(match)];
+			if (slot->hash == hash &&
+			    strcmp(key, &pool[slot->value]) == 0)
+				return slot->value;
+			match &= match - 1;
+		}
+
+		/* The table is never full, so we get to a group with
+		 * a free slot eventually. */
+		if (group_match(tags, HASHTABLE_EMPTY))
+			return 0;
+		group = (group + 1) & mask;
+	}
 }
 
 uint32_t
 hashtable_lookup(struct hashtable *table, const char *key)
 {
-	unsigned int mask, start, i;
-	uint32_t *b;
-	char *pool;
+	return hashtable_lookup_with_hash(table, key,
+					  hashtable_hash_string(key, strlen(key)));
+}
 
-	pool = table->pool->data;
-	mask = table->buckets.alloc - 1;
-	start = hash_string(key) * sizeof(uint32_t);
+static void
+do_insert(struct hashtable *table, uint32_t hash, uint32_t value)
+{
+	struct hashtable_slot *slot;
+	uint32_t mask, group, match, i;
+
+	mask = table->size / HASHTABLE_GROUP - 1;
+	group = (hash >> 7) & mask;
+	for (;;) {
+		match = group_match(table->tags + group * HASHTABLE_GROUP,
+				    HASHTABLE_EMPTY);
+		if (match) {
+			i = group * HASHTABLE_GROUP + __builtin_ctz(match);
+			table->tags[i] = HASHTABLE_TAG(hash);
+			slot = &table->slots[i];
+			slot->hash = hash;
+			slot->value = value;
+			return;
+		}
+		group = (group + 1) & mask;
+	}
+}
 
-	for (i = 0; i < table->buckets.alloc; i += sizeof *b) {
-		b = table->buckets.data + ((start + i) & mask);
+static void
+hashtable_resize(struct hashtable *table, uint32_t size)
+{
+	struct hashtable_slot *slots;
+	uint8_t *tags;
+	uint32_t i, old_size;
 
-		if (*b == 0)
-			return 0;
+	tags = table->tags;
+	slots = table->slots;
+	old_size = table->size;
 
-		if (strcmp(key, &pool[*b]) == 0)
-			return *b;
-	}
+	table->size = size;
+	table->tags = malloc(size * (1 + sizeof *slots));
+	table->slots = (void *) table->tags + size;
+	memset(table->tags, HASHTABLE_EMPTY, size);
 
-	return 0;
+	for (i = 0; i < old_size; i++)
+		if (tags[i] != HASHTABLE_EMPTY)
+			do_insert(table, slots[i].hash, slots[i].value);
+
+	free(tags);
 }
 
-static void
-do_insert(struct hashtable *table, uint32_t value)
+/* Add the string at offset value, whose hash is already known.  The
+ * table is kept at most 7/8 full. */
+void
+hashtable_add_with_hash(struct hashtable *table, uint32_t hash, uint32_t value)
 {
-	unsigned int mask, start, i;
-	uint32_t *b;
-	const char *key;
+	if ((table->count + 1) * 8 > table->size * 7)
+		hashtable_resize(table, table->size > 0 ?
+				 table->size * 2 : 4 * HASHTABLE_GROUP);
 
-	key = (char *) table->pool->data + value;
-	mask = table->buckets.alloc - 1;
-	start = hash_string(key) * sizeof(uint32_t);
+	do_insert(table, hash, value);
+	table->count++;
+}
 
-	for (i = 0; i < table->buckets.alloc; i += sizeof *b) {
-		b = table->buckets.data + ((start + i) & mask);
-		if (*b == 0) {
-			*b = value;
-			break;
-		}
+/* Set up table to use index, the tags and slots of a table over pool
+ * as saved by hashtable_take_index(), instead of building it up by
+ * inserting all the strings again.  Returns -1 if index doesn't look
+ * like it belongs to pool. */
+int
+hashtable_init_with_index(struct hashtable *table, struct array *pool,
+			  struct array *index)
+{
+	struct hashtable_slot *slots;
+	const uint8_t *tags;
+	uint32_t size, count, i;
+
+	hashtable_init(table, pool);
+
+	size = index->size / (1 + sizeof *slots);
+	if (index->size % (1 + sizeof *slots) ||
+	    size < HASHTABLE_GROUP || (size & (size - 1)))
+		return -1;
+
+	tags = index->data;
+	slots = index->data + size;
+	count = 0;
+	for (i = 0; i < size; i++) {
+		if (tags[i] == HASHTABLE_EMPTY)
+			continue;
+		if (tags[i] != HASHTABLE_TAG(slots[i].hash) ||
+		    slots[i].value >= pool->size)
+			return -1;
+		count++;
 	}
+	if (count * 8 > size * 7)
+		return -1;
+
+	table->tags = malloc(index->size);
+	memcpy(table->tags, index->data, index->size);
+	table->slots = (void *) table->tags + size;
+	table->size = size;
+	table->count = count;
+
+	return 0;
+}
+
+/* Hand the tags and slots of table over to index, for writing out.
+ * The table is empty afterwards. */
+void
+hashtable_take_index(struct hashtable *table, struct array *index)
+{
+	index->data = table->tags;
+	index->size = table->size * (1 + sizeof *table->slots);
+	index->alloc = index->size;
+	hashtable_init(table, table->pool);
 }
 
 static uint32_t
-add_to_string_pool(struct hashtable *table, const char *key)
+add_to_string_pool(struct hashtable *table, const char *key, size_t length)
 {
-	int len;
 	char *p;
 
-	len = strlen(key) + 1;
-	p = array_add(table->pool, len);
-	memcpy(p, key, len);
+	p = array_add(table->pool, length + 1);
+	memcpy(p, key, length + 1);
 
 	return p - (char *) table->pool->data;
 }
 
+/* Add the string at offset value, which is already in the pool. */
+void
+hashtable_add(struct hashtable *table, uint32_t value)
+{
+	const char *key;
+
+	key = (const char *) table->pool->data + value;
+	hashtable_add_with_hash(table,
+				hashtable_hash_string(key, strlen(key)), value);
+}
+
 uint32_t
 hashtable_insert(struct hashtable *table, const char *key)
 {
-	uint32_t value, *buckets, *b, *end;
-	int alloc;
-
-	alloc = table->buckets.alloc;
-	array_add(&table->buckets, 4 * sizeof *buckets);
-	if (alloc != table->buckets.alloc) {
-		end = table->buckets.data + alloc;
-		memset(end, 0, table->buckets.alloc - alloc);
-		for (b = table->buckets.data; b < end; b++) {
-			value = *b;
-			if (value != 0) {
-				*b = 0;
-				do_insert(table, value);
-			}
-		}
-	}
+	uint32_t hash, value;
+	size_t length;
 
-	value = add_to_string_pool(table, key);
-	do_insert (table, value);
+	length = strlen(key);
+	hash = hashtable_hash_string(key, length);
+	value = add_to_string_pool(table, key, length);
+	hashtable_add_with_hash(table, hash, value);
 
 	return value;
 }
@@ -252,14 +696,58 @@ hashtable_insert(struct hashtable *table, const char *key)
 uint32_t
 hashtable_tokenize(struct hashtable *table, const char *string)
 {
-	uint32_t token;
+	uint32_t hash, token;
+	size_t length;
 
 	if (string == NULL)
 		string = "";
 
-	token = hashtable_lookup(table, string);
+	length = strlen(string);
+	hash = hashtable_hash_string(string, length);
+	token = hashtable_lookup_with_hash(table, string, hash);
 	if (token != 0)
 		return token;
 
-	return hashtable_insert(table, string);
+	token = add_to_string_pool(table, string, length);
+	hashtable_add_with_hash(table, hash, token);
+
+	return token;
+}
+
+/* Map each string offset in pool to a key in the offset space of
+ * base, such that comparing the key of a pool string with twice the
+ * offset of a base string orders them as strcmp would.  Both pools
+ * must be sorted.  A pool string that is also in base gets twice the
+ * offset of that string, and any other pool string gets one less
+ * than twice the offset of the first base string after it.  This is
+ * a single linear pass over both pools; afterwards, comparing
+ * strings across the two pools is an integer compare. */
+uint32_t *
+razor_string_pool_map_keys(struct array *pool, struct array *base)
+{
+	const char *p, *b;
+	uint32_t *keys, offset, base_offset;
+	int cmp;
+
+	keys = malloc(pool->size * sizeof *keys);
+	p = pool->data;
+	b = base->data;
+	base_offset = 0;
+	for (offset = 0; offset < pool->size;
+	     offset += strlen(&p[offset]) + 1) {
+		cmp = -1;
+		while (base_offset < base->size) {
+			cmp = strcmp(&b[base_offset], &p[offset]);
+			if (cmp >= 0)
+				break;
+			base_offset += strlen(&b[base_offset]) + 1;
+		}
+
+		if (cmp == 0)
+			keys[offset] = base_offset * 2;
+		else
+			keys[offset] = base_offset * 2 - 1;
+	}
+
+	return keys;
 }
@@ -17,6 +17,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <limits.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -24,6 +26,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "razor-internal.h"
 
@@ -92,95 +97,503 @@ razor_write(int fd, const void *data, size_t size)
 	return 0;
 }
 
-struct qsort_context {
+/* Write out iov, which is modified in the process, at offset or, if
+ * offset is negative, at the current position.  Short writes are
+ * restarted where they left off. */
+static int
+write_iovec(int fd, struct iovec *iov, int count, off_t offset)
+{
+	ssize_t written;
+	int n;
+
+	while (count > 0) {
+		n = count < IOV_MAX ? count : IOV_MAX;
+		if (offset < 0)
+			written = writev(fd, iov, n);
+		else
+			written = pwritev(fd, iov, n, offset);
+		if (written < 0) {
+			fprintf(stderr, "write error: %m\n");
+			return -1;
+		}
+		if (offset >= 0)
+			offset += written;
+
+		while (count > 0 && written >= (ssize_t) iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+int
+razor_writev(int fd, struct iovec *iov, int count)
+{
+	return write_iovec(fd, iov, count, -1);
+}
+
+/* Like razor_writev(), but write at offset and leave the file
+ * position alone. */
+int
+razor_pwritev(int fd, struct iovec *iov, int count, off_t offset)
+{
+	return write_iovec(fd, iov, count, offset);
+}
+
+/* Sync the directory that holds filename, so that a file just
+ * renamed into it stays there after a crash.  Some file systems
+ * can't sync directories, and there's nothing more to do then. */
+int
+razor_sync_directory(const char *filename)
+{
+	char path[PATH_MAX];
+	const char *slash;
+	int fd, status;
+
+	slash = strrchr(filename, '/');
+	if (slash == NULL)
+		snprintf(path, sizeof path, ".");
+	else if (slash == filename)
+		snprintf(path, sizeof path, "/");
+	else
+		snprintf(path, sizeof path, "%.*s",
+			 (int) (slash - filename), filename);
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+
+	status = fsync(fd);
+	if (status < 0 && errno == EINVAL)
+		status = 0;
+	close(fd);
+
+	return status;
+}
+
+/* CRC32C (Castagnoli), as computed by the SSE 4.2 and ARMv8 crc32c
+ * instructions.  Without those we fall back to slicing by 8. */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+
+static void
+crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+}
+
+static uint32_t
+crc32c_soft(uint32_t crc, const unsigned char *p, size_t size)
+{
+	uint32_t lo, hi;
+
+	while (size > 0 && ((uintptr_t) p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		size--;
+	}
+
+	while (size >= 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = crc32c_table[7][lo & 0xff] ^
+			crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^
+			crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^
+			crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^
+			crc32c_table[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+
+	while (size > 0) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		size--;
+	}
+
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#define HAVE_CRC32C_HW 1
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t size)
+{
+	uint64_t crc64, word;
+
+	while (size > 0 && ((uintptr_t) p & 7)) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		size--;
+	}
+
+	crc64 = crc;
+	while (size >= 8) {
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		p += 8;
+		size -= 8;
+	}
+	crc = crc64;
+
+	while (size > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		size--;
+	}
+
+	return crc;
+}
+
+static int
+crc32c_hw_available(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__)
+
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define HAVE_CRC32C_HW 1
+
+__attribute__((target("+crc")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t size)
+{
+	uint64_t word;
+
+	while (size > 0 && ((uintptr_t) p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		size--;
+	}
+
+	while (size >= 8) {
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+		p += 8;
+		size -= 8;
+	}
+
+	while (size > 0) {
+		crc = __crc32cb(crc, *p++);
+		size--;
+	}
+
+	return crc;
+}
+
+static int
+crc32c_hw_available(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#endif
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#ifdef HAVE_CRC32C_HW
+static int crc32c_hw_found;
+#endif
+
+/* Sets get verified from whatever thread first binds them, so the
+ * table and the CPU check are set up exactly once. */
+static void
+crc32c_init(void)
+{
+#ifdef HAVE_CRC32C_HW
+	crc32c_hw_found = crc32c_hw_available();
+	if (crc32c_hw_found)
+		return;
+#endif
+	crc32c_init_table();
+}
+
+uint32_t
+razor_crc32c(uint32_t crc, const void *data, size_t size)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+#ifdef HAVE_CRC32C_HW
+	if (crc32c_hw_found)
+		return ~crc32c_hw(~crc, data, size);
+#endif
+
+	return ~crc32c_soft(~crc, data, size);
+}
+
+/* The sorts below work on an array of record indexes, which becomes
+ * the map they return, and only move the records once the order is
+ * known.  The comparison sort is a merge sort, so records that
+ * compare equal keep their order.  Large arrays are split between
+ * threads, which means the compare function must not modify
+ * anything. */
+#define SORT_INSERTION_MAX	16
+#define SORT_PARALLEL_MIN	65536
+#define SORT_MAX_DEPTH		3
+
+struct sort_context {
+	void *base;
 	size_t size;
 	razor_compare_with_data_func_t compare;
 	void *data;
 };
 
+static inline int
+sort_compare(struct sort_context *ctx, uint32_t i1, uint32_t i2)
+{
+	return ctx->compare(ctx->base + i1 * ctx->size,
+			    ctx->base + i2 * ctx->size, ctx->data);
+}
+
+static void
+insertion_sort(uint32_t *map, size_t nelem, struct sort_context *ctx)
+{
+	uint32_t tmp;
+	size_t i, j;
+
+	for (i = 1; i < nelem; i++) {
+		tmp = map[i];
+		for (j = i; j > 0 && sort_compare(ctx, map[j - 1], tmp) > 0; j--)
+			map[j] = map[j - 1];
+		map[j] = tmp;
+	}
+}
+
+/* Merge the sorted halves of map, using tmp for the left half. */
+static void
+merge_halves(uint32_t *map, uint32_t *tmp, size_t half, size_t nelem,
+	     struct sort_context *ctx)
+{
+	uint32_t *left, *left_end, *right, *right_end, *out;
+
+	if (sort_compare(ctx, map[half - 1], map[half]) <= 0)
+		return;
+
+	memcpy(tmp, map, half * sizeof *map);
+	left = tmp;
+	left_end = tmp + half;
+	right = map + half;
+	right_end = map + nelem;
+	out = map;
+	while (left < left_end && right < right_end) {
+		if (sort_compare(ctx, *right, *left) < 0)
+			*out++ = *right++;
+		else
+			*out++ = *left++;
+	}
+	memcpy(out, left, (left_end - left) * sizeof *map);
+}
+
+struct sort_job {
+	uint32_t *map, *tmp;
+	size_t nelem;
+	int depth;
+	struct sort_context *ctx;
+};
+
 static void
-qsort_swap(void *p1, void *p2, size_t size)
+merge_sort(uint32_t *map, uint32_t *tmp, size_t nelem, int depth,
+	   struct sort_context *ctx);
+
+static void *
+run_sort_job(void *data)
 {
-	char buffer[size];
+	struct sort_job *job = data;
 
-	memcpy(buffer, p1, size);
-	memcpy(p1, p2, size);
-	memcpy(p2, buffer, size);
+	merge_sort(job->map, job->tmp, job->nelem, job->depth, job->ctx);
+
+	return NULL;
 }
 
+/* Sort the right half in a new thread while depth allows it and the
+ * array is large enough to be worth it. */
 static void
-__qsort_with_data(void *base, size_t nelem, uint32_t *map,
-		  struct qsort_context *ctx)
-{
-	void *p, *start, *end, *pivot;
-	uint32_t *mp, *mstart, *mend, tmp;
-	int left, right, result;
-	size_t size = ctx->size;
-
-	p = base;
-	start = base;
-	end = base + nelem * size;
-	mp = map;
-	mstart = map;
-	mend = map + nelem;
-	pivot = base + (random() % nelem) * size;
-
-	while (p < end) {
-		result = ctx->compare(p, pivot, ctx->data);
-		if (result < 0) {
-			qsort_swap(p, start, size);
-			tmp = *mp;
-			*mp = *mstart;
-			*mstart = tmp;
-			if (start == pivot)
-				pivot = p;
-			start += size;
-			mstart++;
-			p += size;
-			mp++;
-		} else if (result == 0) {
-			p += size;
-			mp++;
-		} else {
- 			end -= size;
-			mend--;
-			qsort_swap(p, end, size);
-			tmp = *mp;
-			*mp = *mend;
-			*mend = tmp;
-			if (end == pivot)
-				pivot = p;
-		}
+merge_sort(uint32_t *map, uint32_t *tmp, size_t nelem, int depth,
+	   struct sort_context *ctx)
+{
+	struct sort_job job;
+	pthread_t thread;
+	size_t half;
+	int threaded;
+
+	if (nelem <= SORT_INSERTION_MAX) {
+		insertion_sort(map, nelem, ctx);
+		return;
 	}
 
-	left = (start - base) / size;
-	right = (base + nelem * size - end) / size;
-	if (left > 1)
-		__qsort_with_data(base, left, map, ctx);
-	if (right > 1)
-		__qsort_with_data(end, right, mend, ctx);
+	half = nelem / 2;
+	job.map = map + half;
+	job.tmp = tmp + half;
+	job.nelem = nelem - half;
+	job.depth = depth - 1;
+	job.ctx = ctx;
+
+	threaded = depth > 0 && nelem >= SORT_PARALLEL_MIN &&
+		pthread_create(&thread, NULL, run_sort_job, &job) == 0;
+	if (!threaded)
+		run_sort_job(&job);
+	merge_sort(map, tmp, half, depth - 1, ctx);
+	if (threaded)
+		pthread_join(thread, NULL);
+
+	merge_halves(map, tmp, half, nelem, ctx);
+}
+
+static int
+sort_thread_depth(size_t nelem)
+{
+	long cpus;
+	int depth;
+
+	if (nelem < SORT_PARALLEL_MIN)
+		return 0;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (depth = 0; depth < SORT_MAX_DEPTH && (2l << depth) <= cpus; depth++)
+		;
+
+	return depth;
+}
+
+static void
+permute_records(void *base, size_t nelem, size_t size, uint32_t *map)
+{
+	char *sorted;
+	size_t i;
+
+	sorted = malloc(nelem * size);
+	for (i = 0; i < nelem; i++)
+		memcpy(sorted + i * size, base + map[i] * size, size);
+	memcpy(base, sorted, nelem * size);
+	free(sorted);
 }
 
+/* Sort the nelem records at base with compare.  Returns a map from
+ * the new position of each record to its old one, which the caller
+ * must free, or NULL if there are no records. */
 uint32_t *
-razor_qsort_with_data(void *base, size_t nelem, size_t size,
-		      razor_compare_with_data_func_t compare, void *data)
+razor_sort_with_data(void *base, size_t nelem, size_t size,
+		     razor_compare_with_data_func_t compare, void *data)
 {
-	struct qsort_context ctx;
-	uint32_t *map;
-	int i;
+	struct sort_context ctx;
+	uint32_t *map, *tmp;
+	size_t i;
 
 	if (nelem == 0)
 		return NULL;
 
+	ctx.base = base;
 	ctx.size = size;
 	ctx.compare = compare;
 	ctx.data = data;
 
-	map = malloc(nelem * sizeof (uint32_t));
+	map = malloc(nelem * sizeof *map);
 	for (i = 0; i < nelem; i++)
 		map[i] = i;
 
-	__qsort_with_data(base, nelem, map, &ctx);
+	tmp = malloc(nelem * sizeof *tmp);
+	merge_sort(map, tmp, nelem, sort_thread_depth(nelem), &ctx);
+	free(tmp);
+
+	permute_records(base, nelem, size, map);
+
+	return map;
+}
+
+struct sort_key {
+	uint64_t key;
+	uint32_t index;
+};
+
+/* Like razor_sort_with_data(), but order the records by keys, one per
+ * record, with a radix sort.  Records with equal keys keep their
+ * order.  Byte positions where all keys agree are skipped. */
+uint32_t *
+razor_sort_with_keys(void *base, size_t nelem, size_t size,
+		     const uint64_t *keys)
+{
+	struct sort_key *from, *to, *tmp;
+	size_t (*counts)[256], offset, count, i;
+	uint32_t *map;
+	int shift, byte;
+
+	if (nelem == 0)
+		return NULL;
+
+	counts = zalloc(8 * sizeof *counts);
+	for (i = 0; i < nelem; i++)
+		for (byte = 0; byte < 8; byte++)
+			counts[byte][(keys[i] >> (byte * 8)) & 0xff]++;
+
+	from = malloc(nelem * sizeof *from);
+	to = malloc(nelem * sizeof *to);
+	for (i = 0; i < nelem; i++) {
+		from[i].key = keys[i];
+		from[i].index = i;
+	}
+
+	for (byte = 0; byte < 8; byte++) {
+		shift = byte * 8;
+		if (counts[byte][(keys[0] >> shift) & 0xff] == nelem)
+			continue;
+
+		for (i = 0, offset = 0; i < 256; i++) {
+			count = counts[byte][i];
+			counts[byte][i] = offset;
+			offset += count;
+		}
+		for (i = 0; i < nelem; i++)
+			to[counts[byte][(from[i].key >> shift) & 0xff]++] =
+				from[i];
+
+		tmp = from;
+		from = to;
+		to = tmp;
+	}
+
+	map = malloc(nelem * sizeof *map);
+	for (i = 0; i < nelem; i++)
+		map[i] = from[i].index;
+
+	free(counts);
+	free(from);
+	free(to);
+
+	permute_records(base, nelem, size, map);
 
 	return map;
 }
@@ -100,6 +100,7 @@ razor_set_create_from_rpmdb(void)
 	}
 
 	importer = razor_importer_create();
+	razor_importer_set_flags(importer, RAZOR_SET_SORTED_STRING_POOL);
 
 	iter = rpmdbInitIterator(db, 0, NULL, 0);
 	while (h = rpmdbNextIterator(iter), h != NULL) {
@@ -296,6 +296,7 @@ razor_set_create_from_yum(void)
 	XML_ParsingStatus status;
 
 	ctx.importer = razor_importer_create();
+	razor_importer_set_flags(ctx.importer, RAZOR_SET_SORTED_STRING_POOL);
 	ctx.state = YUM_STATE_BEGIN;
 
 	ctx.primary_parser = XML_ParserCreate(NULL);
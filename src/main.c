@@ -36,6 +36,8 @@
 static const char system_repo_filename[] = "system.rzdb";
 static const char next_repo_filename[] = "system-next.rzdb";
 static const char rawhide_repo_filename[] = "rawhide.rzdb";
+static const char rawhide_details_filename[] = "rawhide-details.rzdb";
+static const char rawhide_files_filename[] = "rawhide-files.rzdb";
 static const char updated_repo_filename[] = "system-updated.rzdb";
 static const char *install_root = "";
 static const char *repo_filename = system_repo_filename;
@@ -43,6 +45,29 @@ static const char *yum_url;
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+/* Open the rawhide set.  The details and files are in the same file,
+ * except for sets imported by older versions, which keep them in
+ * files of their own. */
+static struct razor_set *
+open_rawhide_set(uint32_t flags)
+{
+	struct razor_set *set;
+
+	set = razor_set_open_with_flags(rawhide_repo_filename, flags);
+	if (set == NULL)
+		return NULL;
+
+	if ((access(rawhide_details_filename, F_OK) == 0 &&
+	     razor_set_open_details(set, rawhide_details_filename)) ||
+	    (access(rawhide_files_filename, F_OK) == 0 &&
+	     razor_set_open_files(set, rawhide_files_filename))) {
+		razor_set_destroy(set);
+		return NULL;
+	}
+
+	return set;
+}
+
 static struct razor_package_iterator *
 create_iterator_from_argv(struct razor_set *set, int argc, const char *argv[])
 {
@@ -58,15 +83,12 @@ create_iterator_from_argv(struct razor_set *set, int argc, const char *argv[])
 	query = razor_package_query_create(set);
 
 	for (i = 0; i < argc; i++) {
-		iter = razor_package_iterator_create(set);
 		pattern = argv[i];
+		iter = razor_package_iterator_create_for_name(set, pattern);
 		count = 0;
 		while (razor_package_iterator_next(iter, &package,
 						   RAZOR_DETAIL_NAME, &name,
 						   RAZOR_DETAIL_LAST)) {
-			if (fnmatch(pattern, name, 0) != 0)
-				continue;
-
 			razor_package_query_add_package(query, package);
 			count++;
 		}
@@ -220,9 +242,6 @@ command_list_files(int argc, const char *argv[])
 	if (set == NULL)
 		return 1;
 
-	if (razor_set_open_files(set, "system-files.rzdb"))
-		return 1;
-
 	razor_set_list_files(set, argv[0]);
 	razor_set_destroy(set);
 
@@ -293,17 +312,14 @@ list_property_packages(const char *ref_name,
 	if (set == NULL)
 		return 1;
 
-	prop_iter = razor_property_iterator_create(set, NULL);
+	prop_iter = razor_property_iterator_create_for_name(set, ref_name,
+							    type);
 	while (razor_property_iterator_next(prop_iter, &property,
 					    &name, &flags, &version)) {
-		if (strcmp(ref_name, name) != 0)
-			continue;
 		if (ref_version &&
 		    (flags & RAZOR_PROPERTY_RELATION_MASK) == RAZOR_PROPERTY_EQUAL &&
 		    strcmp(ref_version, version) != 0)
 			continue;
-		if ((flags & RAZOR_PROPERTY_TYPE_MASK) != type)
-			continue;
 
 		pkg_iter =
 			razor_package_iterator_create_for_property(set,
@@ -422,10 +438,14 @@ command_import_yum(int argc, const char *argv[])
 	set = razor_set_create_from_yum();
 	if (set == NULL)
 		return 1;
-	razor_set_write(set, rawhide_repo_filename, RAZOR_REPO_FILE_MAIN);
-	razor_set_write(set, "rawhide-details.rzdb", RAZOR_REPO_FILE_DETAILS);
-	razor_set_write(set, "rawhide-files.rzdb", RAZOR_REPO_FILE_FILES);
+	set = razor_set_move_to_file(set, rawhide_repo_filename);
+	if (set == NULL) {
+		fprintf(stderr, "couldn't write %s\n", rawhide_repo_filename);
+		return 1;
+	}
 	razor_set_destroy(set);
+	unlink(rawhide_details_filename);
+	unlink(rawhide_files_filename);
 	printf("wrote %s\n", rawhide_repo_filename);
 
 	return 0;
@@ -445,7 +465,12 @@ command_import_rpmdb(int argc, const char *argv[])
 	if (set == NULL)
 		return 1;
 
-	razor_root_update(root, set);
+	set = razor_root_update(root, set);
+	if (set == NULL) {
+		razor_root_close(root);
+		return 1;
+	}
+	razor_set_destroy(set);
 
 	return razor_root_commit(root);
 }
@@ -456,17 +481,16 @@ mark_packages_for_update(struct razor_transaction *trans,
 {
 	struct razor_package_iterator *pi;
 	struct razor_package *package;
-	const char *name;
 	int matches = 0;
 
-	pi = razor_package_iterator_create(set);
+	if (pattern == NULL)
+		return 0;
+
+	pi = razor_package_iterator_create_for_name(set, pattern);
 	while (razor_package_iterator_next(pi, &package,
-					   RAZOR_DETAIL_NAME, &name,
 					   RAZOR_DETAIL_LAST)) {
-		if (pattern && fnmatch(pattern, name, 0) == 0) {
-			razor_transaction_update_package(trans, package);
-			matches++;
-		}
+		razor_transaction_update_package(trans, package);
+		matches++;
 	}
 	razor_package_iterator_destroy(pi);
 
@@ -479,17 +503,16 @@ mark_packages_for_removal(struct razor_transaction *trans,
 {
 	struct razor_package_iterator *pi;
 	struct razor_package *package;
-	const char *name;
 	int matches = 0;
 
-	pi = razor_package_iterator_create(set);
+	if (pattern == NULL)
+		return 0;
+
+	pi = razor_package_iterator_create_for_name(set, pattern);
 	while (razor_package_iterator_next(pi, &package,
-					   RAZOR_DETAIL_NAME, &name,
 					   RAZOR_DETAIL_LAST)) {
-		if (pattern && fnmatch(pattern, name, 0) == 0) {
-			razor_transaction_remove_package(trans, package);
-			matches++;
-		}
+		razor_transaction_remove_package(trans, package);
+		matches++;
 	}
 	razor_package_iterator_destroy(pi);
 
@@ -507,10 +530,9 @@ command_update(int argc, const char *argv[])
 	if (set == NULL)
 		return 1;
 
-	upstream = razor_set_open(rawhide_repo_filename);
-	if (upstream == NULL ||
-	    razor_set_open_details(upstream, "rawhide-details.rzdb") ||
-	    razor_set_open_files(upstream, "rawhide-files.rzdb"))
+	upstream = open_rawhide_set(RAZOR_SET_OPEN_PREFAULT |
+				    RAZOR_SET_OPEN_LAZY_STRINGS);
+	if (upstream == NULL)
 		return 1;
 
 	trans = razor_transaction_create(set, upstream);
@@ -531,7 +553,15 @@ command_update(int argc, const char *argv[])
 	}
 
 	set = razor_transaction_finish(trans);
-	razor_set_write(set, updated_repo_filename, RAZOR_REPO_FILE_MAIN);
+	if (set == NULL) {
+		fprintf(stderr, "failed to merge package sets\n");
+		return 1;
+	}
+	set = razor_set_move_to_file(set, updated_repo_filename);
+	if (set == NULL) {
+		fprintf(stderr, "couldn't write %s\n", updated_repo_filename);
+		return 1;
+	}
 	razor_set_destroy(set);
 	razor_set_destroy(upstream);
 	printf("wrote system-updated.rzdb\n");
@@ -564,7 +594,15 @@ command_remove(int argc, const char *argv[])
 		return 1;
 
 	set = razor_transaction_finish(trans);
-	razor_set_write(set, updated_repo_filename, RAZOR_REPO_FILE_MAIN);
+	if (set == NULL) {
+		fprintf(stderr, "failed to merge package sets\n");
+		return 1;
+	}
+	set = razor_set_move_to_file(set, updated_repo_filename);
+	if (set == NULL) {
+		fprintf(stderr, "couldn't write %s\n", updated_repo_filename);
+		return 1;
+	}
 	razor_set_destroy(set);
 	razor_set_destroy(upstream);
 	printf("wrote system-updated.rzdb\n");
@@ -604,6 +642,77 @@ command_diff(int argc, const char *argv[])
 	return 0;
 }
 
+static int
+command_create_delta(int argc, const char *argv[])
+{
+	struct razor_set *base, *target, *delta;
+
+	if (argc != 3) {
+		fprintf(stderr,
+			"usage: razor create-delta BASE TARGET DELTA\n");
+		return -1;
+	}
+
+	base = razor_set_open(argv[0]);
+	target = razor_set_open(argv[1]);
+	if (base == NULL || target == NULL)
+		return 1;
+
+	delta = razor_set_create_delta(base, target);
+	if (delta == NULL) {
+		fprintf(stderr, "failed to create delta\n");
+		return 1;
+	}
+	delta = razor_set_move_to_file(delta, argv[2]);
+	if (delta == NULL) {
+		fprintf(stderr, "couldn't write %s\n", argv[2]);
+		return 1;
+	}
+	printf("wrote %s, from %08x to %08x\n", argv[2],
+	       razor_set_get_checksum(base), razor_set_get_checksum(target));
+
+	razor_set_destroy(delta);
+	razor_set_destroy(target);
+	razor_set_destroy(base);
+
+	return 0;
+}
+
+static int
+command_apply_delta(int argc, const char *argv[])
+{
+	struct razor_set *base, *delta, *set;
+
+	if (argc != 3) {
+		fprintf(stderr,
+			"usage: razor apply-delta BASE DELTA RESULT\n");
+		return -1;
+	}
+
+	base = razor_set_open(argv[0]);
+	delta = razor_set_open(argv[1]);
+	if (base == NULL || delta == NULL)
+		return 1;
+
+	set = razor_set_apply_delta(base, delta);
+	if (set == NULL) {
+		fprintf(stderr, "%s doesn't apply to %s\n", argv[1], argv[0]);
+		return 1;
+	}
+	set = razor_set_move_to_file(set, argv[2]);
+	if (set == NULL) {
+		fprintf(stderr, "couldn't write %s\n", argv[2]);
+		return 1;
+	}
+	printf("wrote %s\n", argv[2]);
+
+	razor_set_destroy(set);
+	razor_set_destroy(delta);
+	razor_set_destroy(base);
+
+	return 0;
+}
+
 static int
 command_import_rpms(int argc, const char *argv[])
 {
@@ -628,6 +737,7 @@ command_import_rpms(int argc, const char *argv[])
 	}
 
 	importer = razor_importer_create();
+	razor_importer_set_flags(importer, RAZOR_SET_SORTED_STRING_POOL);
 
 	while (de = readdir(dir), de != NULL) {
 		len = strlen(de->d_name);
@@ -659,9 +769,11 @@ command_import_rpms(int argc, const char *argv[])
 	printf("\nsaving\n");
 	set = razor_importer_finish(importer);
 
-	razor_set_write(set, repo_filename, RAZOR_REPO_FILE_MAIN);
-	razor_set_write(set, "system-details.rzdb", RAZOR_REPO_FILE_DETAILS);
-	razor_set_write(set, "system-files.rzdb", RAZOR_REPO_FILE_FILES);
+	set = razor_set_move_to_file(set, repo_filename);
+	if (set == NULL) {
+		fprintf(stderr, "couldn't write %s\n", repo_filename);
+		return 1;
+	}
 	razor_set_destroy(set);
 	printf("wrote %s\n", repo_filename);
 
@@ -790,10 +902,9 @@ command_install(int argc, const char *argv[])
 		return 1;
 
 	system = razor_root_get_system_set(root);
-	upstream = razor_set_open(rawhide_repo_filename);
-	if (upstream == NULL ||
-	    razor_set_open_details(upstream, "rawhide-details.rzdb") ||
-	    razor_set_open_files(upstream, "rawhide-files.rzdb")) {
+	upstream = open_rawhide_set(RAZOR_SET_OPEN_PREFAULT |
+				    RAZOR_SET_OPEN_LAZY_STRINGS);
+	if (upstream == NULL) {
 			fprintf(stderr, "couldn't open rawhide repo\n");
 			razor_root_close(root);
 			return 1;
@@ -818,8 +929,17 @@ command_install(int argc, const char *argv[])
 	}
 
 	next = razor_transaction_finish(trans);
+	if (next == NULL) {
+		fprintf(stderr, "failed to merge package sets\n");
+		razor_root_close(root);
+		return 1;
+	}
 
-	razor_root_update(root, next);
+	next = razor_root_update(root, next);
+	if (next == NULL) {
+		razor_root_close(root);
+		return 1;
+	}
 
 	if (mkdir("rpms", 0777) && errno != EEXIST) {
 		fprintf(stderr, "failed to create rpms directory.\n");
@@ -862,15 +982,15 @@ command_download(int argc, const char *argv[])
 	}
 
 	set = razor_set_open(rawhide_repo_filename);
-	pi = razor_package_iterator_create(set);
+	if (pattern)
+		pi = razor_package_iterator_create_for_name(set, pattern);
+	else
+		pi = razor_package_iterator_create(set);
 	while (razor_package_iterator_next(pi, &package,
 					   RAZOR_DETAIL_NAME, &name,
 					   RAZOR_DETAIL_VERSION, &version,
 					   RAZOR_DETAIL_ARCH, &arch,
 					   RAZOR_DETAIL_LAST)) {
-		if (pattern && fnmatch(pattern, name, 0) != 0)
-			continue;
-
 		matches++;
 		snprintf(url, sizeof url,
 			 "%s/Packages/%s-%s.%s.rpm",
@@ -905,15 +1025,15 @@ command_info(int argc, const char *argv[])
 	if (set == NULL)
 		return 1;
 
-	pi = razor_package_iterator_create(set);
+	if (pattern)
+		pi = razor_package_iterator_create_for_name(set, pattern);
+	else
+		pi = razor_package_iterator_create(set);
 	while (razor_package_iterator_next(pi, &package,
 					   RAZOR_DETAIL_NAME, &name,
 					   RAZOR_DETAIL_VERSION, &version,
 					   RAZOR_DETAIL_ARCH, &arch,
 					   RAZOR_DETAIL_LAST)) {
-		if (pattern && fnmatch(pattern, name, 0) != 0)
-			continue;
-
 		razor_package_get_details (set, package,
 					   RAZOR_DETAIL_SUMMARY, &summary,
 					   RAZOR_DETAIL_DESCRIPTION, &description,
@@ -956,13 +1076,10 @@ command_search(int argc, const char *argv[])
 
 	snprintf(pattern, sizeof pattern, "*%s*", argv[0]);
 
-	set = razor_set_open(rawhide_repo_filename);
+	set = open_rawhide_set(0);
 	if (set == NULL)
 		return 1;
 
-	if (razor_set_open_details(set, "rawhide-details.rzdb"))
-		return 1;
-
 	pi = razor_package_iterator_create(set);
 	while (razor_package_iterator_next(pi, &package,
 					   RAZOR_DETAIL_NAME, &name,
@@ -1006,6 +1123,8 @@ static struct {
 	{ "update", "update all or specified packages", command_update },
 	{ "remove", "remove specified packages", command_remove },
 	{ "diff", "show diff between two package sets", command_diff },
+	{ "create-delta", "create a delta between two package sets", command_create_delta },
+	{ "apply-delta", "apply a delta to a package set", command_apply_delta },
 	{ "install", "install rpm", command_install },
 	{ "init", "init razor root", command_init },
 	{ "download", "download packages", command_download },
@@ -268,17 +268,13 @@ add_property_packages(struct razor_set *set,
 	const char *name, *version;
 	uint32_t flags;
 
-	pi = razor_property_iterator_create(set, NULL);
+	pi = razor_property_iterator_create_for_name(set, ref_name, ref_type);
 	while (razor_property_iterator_next(pi, &property, &name,
 					    &flags, &version)) {
-		if (strcmp(ref_name, name) != 0)
-			continue;
 		if (ref_version &&
 		    (flags & RAZOR_PROPERTY_RELATION_MASK) == RAZOR_PROPERTY_EQUAL &&
 		    strcmp(ref_version, version) != 0)
 			continue;
-		if ((flags & RAZOR_PROPERTY_TYPE_MASK) != ref_type)
-			continue;
 
 		pkgi = razor_package_iterator_create_for_property(set,
 								  property);
@@ -290,46 +286,27 @@ add_property_packages(struct razor_set *set,
 	return property;
 }
 
-static int
-strcmpp(const void *p1, const void *p2)
-{
-	return strcmp(*(char * const *) p1, *(char * const *) p2);
-}
-
 static void
 add_command_line_packages(struct razor_set *set,
 			  struct razor_package_query *query,
 			  int argc, const char **argv)
 {
 	struct razor_package *package;
-	struct razor_package_iterator *pi;
-	const char *name;
-	int i, cmp, errors;
+	int i, errors;
 
-	qsort(argv, argc, sizeof(*argv), strcmpp);
-	i = 0;
 	errors = 0;
-
-	pi = razor_package_iterator_create(set);
-
-	while (razor_package_iterator_next(pi, &package,
-					   RAZOR_DETAIL_NAME, &name,
-					   RAZOR_DETAIL_LAST)) {
-		while (cmp = strcmp(argv[i], name), cmp < 0 && i < argc) {
+	for (i = 0; i < argc; i++) {
+		package = razor_set_get_package(set, argv[i]);
+		if (package == NULL) {
 			fprintf(stderr, "error: package %s is not installed\n",
 				argv[i]);
 			errors++;
-			i++;
+			continue;
 		}
 
-		if (cmp == 0) {
-			razor_package_query_add_package(query, package);
-			i++;
-		}
+		razor_package_query_add_package(query, package);
 	}
 
-	razor_package_iterator_destroy(pi);
-
 	if (errors)
 		exit(1);
 }
@@ -339,7 +316,6 @@ get_query_packages(struct razor_set *set, int argc, const char *argv[])
 {
 	struct razor_package_query *query;
 	struct razor_package_iterator *pi;
-	char *files;
 	int i;
 
 	if (option_all + option_whatprovides + option_whatrequires +
@@ -349,11 +325,6 @@ get_query_packages(struct razor_set *set, int argc, const char *argv[])
 		exit(1);
 	}
 
-	files = "install/var/lib/razor/system-files.rzdb";
-	if (option_file)
-		if (razor_set_open_files(set, files))
-			exit(1);
-
 	query = razor_package_query_create(set);
 
 	if (option_all) {
@@ -470,7 +441,7 @@ command_query(int argc, const char *argv[])
 	struct razor_set *set;
 	struct razor_package_iterator *pi;
 	struct razor_package *package;
-	const char *name, *version, *arch, *details, *files;
+	const char *name, *version, *arch;
 
 	if (option_package) {
 		set = create_set_from_command_line(argc, argv);
@@ -478,16 +449,8 @@ command_query(int argc, const char *argv[])
 		option_all = 1;
 	} else {
 		set = razor_root_open_read_only(option_root);
-
-		/* FIXME: We need to figure out how to do this right. */
-		details = "install/var/lib/razor/system-details.rzdb";
-		if (option_info)
-			if (razor_set_open_details(set, details))
-				return;
-		files = "install/var/lib/razor/system-files.rzdb";
-		if (option_list)
-			if (razor_set_open_files(set, files))
-				return;
+		if (set == NULL)
+			return;
 	}
 
 	pi = get_query_packages(set, argc, argv);
@@ -609,6 +572,10 @@ command_erase(int argc, const char *argv[])
 		exit(0);
 
 	next = razor_transaction_finish(trans);
+	if (next == NULL) {
+		printf("failed to merge package sets.\n");
+		exit(1);
+	}
 
 	if (!option_justdb)
 		razor_set_diff(set, next, update_package, NULL);
@@ -651,6 +618,10 @@ command_install(int argc, const char *argv[])
 		exit(0);
 
 	next = razor_transaction_finish(trans);
+	if (next == NULL) {
+		printf("failed to merge package sets.\n");
+		exit(1);
+	}
 
 	if (!option_justdb)
 		razor_set_diff(set, next, update_package, NULL);
@@ -693,6 +664,10 @@ command_update(int argc, const char *argv[])
 		exit(0);
 
 	next = razor_transaction_finish(trans);
+	if (next == NULL) {
+		printf("failed to merge package sets.\n");
+		exit(1);
+	}
 
 	if (!option_justdb)
 		razor_set_diff(set, next, update_package, NULL);
@@ -29,6 +29,8 @@
 
 #define XML_BUFFER_SIZE 4096
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 static void
 parse_xml_file(const char *filename,
 	       XML_StartElementHandler start,
@@ -72,7 +74,9 @@ parse_xml_file(const char *filename,
 }
 
 struct test_context {
-	struct razor_set *system_set, *repo_set, *result_set;
+	struct razor_set *system_set, *repo_sets[3], *result_set;
+	int n_repo_sets;
+	uint32_t flags;
 
 	struct razor_importer *importer;
 	struct razor_set **importer_set;
@@ -84,6 +88,7 @@ struct test_context {
 
 	int unsat;
 	int in_result;
+	char *package;
 
 	int debug, errors;
 };
@@ -142,10 +147,8 @@ end_test(struct test_context *ctx)
 		razor_set_destroy(ctx->system_set);
 		ctx->system_set = NULL;
 	}
-	if (ctx->repo_set) {
-		razor_set_destroy(ctx->repo_set);
-		ctx->repo_set = NULL;
-	}
+	while (ctx->n_repo_sets > 0)
+		razor_set_destroy(ctx->repo_sets[--ctx->n_repo_sets]);
 	if (ctx->result_set) {
 		razor_set_destroy(ctx->result_set);
 		ctx->result_set = NULL;
@@ -162,13 +165,15 @@ start_set(struct test_context *ctx, const char **atts)
 	const char *name = NULL;
 
 	ctx->importer = razor_importer_create();
+	razor_importer_set_flags(ctx->importer, ctx->flags);
 	get_atts(atts, "name", &name, NULL);
 	if (!name)
 		ctx->importer_set = &ctx->result_set;
 	else if (!strcmp(name, "system"))
 		ctx->importer_set = &ctx->system_set;
-	else if (!strcmp(name, "repo"))
-		ctx->importer_set = &ctx->repo_set;
+	else if (!strcmp(name, "repo") &&
+		 ctx->n_repo_sets < ARRAY_SIZE(ctx->repo_sets))
+		ctx->importer_set = &ctx->repo_sets[ctx->n_repo_sets++];
 	else {
 		fprintf(stderr, "  bad set name '%s'\n", name);
 		exit(1);
@@ -197,7 +202,9 @@ start_package(struct test_context *ctx, const char **atts)
 		exit(1);
 	}
 
+	ctx->package = strdup(name);
 	razor_importer_begin_package(ctx->importer, name, version, arch);
+	razor_importer_add_details(ctx->importer, name, "", "", "");
 	razor_importer_add_property(ctx->importer, name,
 				    RAZOR_PROPERTY_EQUAL | RAZOR_PROPERTY_PROVIDES,
 				    version);
@@ -207,6 +214,53 @@ static void
 end_package(struct test_context *ctx)
 {
 	razor_importer_finish_package(ctx->importer);
+	free(ctx->package);
+	ctx->package = NULL;
+}
+
+/* The system set is final by the time the result set is read, so
+ * check each file of the result against it as it comes.  The diff
+ * of the sets only compares package names and versions. */
+static void
+check_result_file(struct test_context *ctx, const char *name)
+{
+	struct razor_package_iterator *pi;
+	struct razor_package *package;
+	const char *package_name;
+	int found = 0;
+
+	if (!ctx->system_set)
+		return;
+
+	pi = razor_package_iterator_create_for_file(ctx->system_set, name);
+	while (razor_package_iterator_next(pi, &package,
+					   RAZOR_DETAIL_NAME, &package_name,
+					   RAZOR_DETAIL_LAST))
+		if (strcmp(package_name, ctx->package) == 0)
+			found = 1;
+	razor_package_iterator_destroy(pi);
+
+	if (!found) {
+		fprintf(stderr, "  result set should contain %s in %s\n",
+			name, ctx->package);
+		ctx->errors++;
+	}
+}
+
+static void
+start_file(struct test_context *ctx, const char **atts)
+{
+	const char *name = NULL;
+
+	get_atts(atts, "name", &name, NULL);
+	if (!name) {
+		fprintf(stderr, "  file with no name\n");
+		exit(1);
+	}
+
+	razor_importer_add_file(ctx->importer, name);
+	if (ctx->in_result)
+		check_result_file(ctx, name);
 }
 
 static void
@@ -285,41 +339,27 @@ start_transaction(struct test_context *ctx, const char **atts)
 	ctx->n_remove_pkgs = 0;
 }
 
-static struct razor_package *
-get_package(struct razor_set *set, const char *package)
-{
-	struct razor_package_iterator *pi;
-	struct razor_package *p;
-	const char *name, *version, *arch;
-
-	pi = razor_package_iterator_create(set);
-	while (razor_package_iterator_next(pi, &p, RAZOR_DETAIL_NAME, &name,
-					   RAZOR_DETAIL_VERSION, &version,
-					   RAZOR_DETAIL_ARCH, &arch,
-					   RAZOR_DETAIL_LAST)) {
-		if (strcmp(package, name) == 0)
-			break;
-	}
-	razor_package_iterator_destroy(pi);
-
-	return p;
-}
-
 static void
 end_transaction(struct test_context *ctx)
 {
 	struct razor_package *pkg;
-	int errors, i;
+	int errors, i, j;
 
-	ctx->trans = razor_transaction_create(ctx->system_set, ctx->repo_set);
+	ctx->trans = razor_transaction_create_with_upstreams(ctx->system_set,
+							     ctx->repo_sets,
+							     ctx->n_repo_sets);
 	for (i = 0; i < ctx->n_install_pkgs; i++) {
-		pkg = get_package(ctx->repo_set, ctx->install_pkgs[i]);
+		pkg = NULL;
+		for (j = 0; j < ctx->n_repo_sets && !pkg; j++)
+			pkg = razor_set_get_package(ctx->repo_sets[j],
+						    ctx->install_pkgs[i]);
 		razor_transaction_install_package(ctx->trans, pkg);
 	}
 	for (i = 0; i < ctx->n_remove_pkgs; i++) {
-		pkg = get_package(ctx->system_set, ctx->remove_pkgs[i]);
-		if (!pkg)
-			pkg = get_package(ctx->repo_set, ctx->remove_pkgs[i]);
+		pkg = razor_set_get_package(ctx->system_set, ctx->remove_pkgs[i]);
+		for (j = 0; j < ctx->n_repo_sets && !pkg; j++)
+			pkg = razor_set_get_package(ctx->repo_sets[j],
+						    ctx->remove_pkgs[i]);
 
 		razor_transaction_remove_package(ctx->trans, pkg);
 	}
@@ -408,6 +448,116 @@ end_result(struct test_context *ctx)
 	}
 }
 
+/* Replace the system set by applying the delta from it to the first
+ * repo set, written out and read back in. */
+static void
+start_delta(struct test_context *ctx, const char **atts)
+{
+	struct razor_set *delta, *set;
+
+	if (ctx->n_repo_sets == 0) {
+		fprintf(stderr, "  delta with no repo set\n");
+		exit(1);
+	}
+
+	delta = razor_set_create_delta(ctx->system_set, ctx->repo_sets[0]);
+	if (delta)
+		delta = razor_set_move_to_file(delta, "test-delta.rzdb");
+	if (!delta) {
+		fprintf(stderr, "  failed to create delta\n");
+		ctx->errors++;
+		return;
+	}
+
+	set = razor_set_apply_delta(ctx->system_set, delta);
+	razor_set_destroy(delta);
+	unlink("test-delta.rzdb");
+	if (!set) {
+		fprintf(stderr, "  delta doesn't apply\n");
+		ctx->errors++;
+		return;
+	}
+
+	razor_set_destroy(ctx->system_set);
+	ctx->system_set = set;
+}
+
+/* Replace the system set by the first repo set laid over it.  The
+ * overlay and the plain set it compacts to must agree. */
+static void
+start_overlay(struct test_context *ctx, const char **atts)
+{
+	struct razor_set *sets[2], *overlay, *set;
+
+	if (ctx->n_repo_sets == 0) {
+		fprintf(stderr, "  overlay with no repo set\n");
+		exit(1);
+	}
+
+	sets[0] = ctx->system_set;
+	sets[1] = ctx->repo_sets[0];
+	overlay = razor_set_create_overlay(sets, 2);
+	set = razor_set_compact_overlay(overlay);
+	if (!set) {
+		fprintf(stderr, "  failed to compact overlay\n");
+		ctx->errors++;
+		razor_set_destroy(overlay);
+		return;
+	}
+
+	razor_set_diff(set, overlay, diff_callback, ctx);
+	razor_set_destroy(overlay);
+	razor_set_destroy(ctx->system_set);
+	ctx->system_set = set;
+}
+
+/* Write the system set out and check that it reads back the same and
+ * verifies, and that it no longer does once a byte of it is flipped.
+ * The first section starts at the first page boundary. */
+static void
+start_verify(struct test_context *ctx, const char **atts)
+{
+	static const char filename[] = "test-verify.rzdb";
+	struct razor_set *set;
+	unsigned char c;
+	int fd;
+
+	if (razor_set_write(ctx->system_set, filename,
+			    RAZOR_REPO_FILE_ALL) < 0) {
+		fprintf(stderr, "  failed to write %s\n", filename);
+		ctx->errors++;
+		return;
+	}
+
+	set = razor_set_open(filename);
+	if (!set || razor_set_verify(set) < 0) {
+		fprintf(stderr, "  %s doesn't verify\n", filename);
+		ctx->errors++;
+	} else
+		razor_set_diff(set, ctx->system_set, diff_callback, ctx);
+	if (set)
+		razor_set_destroy(set);
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0 ||
+	    pread(fd, &c, 1, 4096) != 1 ||
+	    (c ^= 0xff, pwrite(fd, &c, 1, 4096)) != 1) {
+		fprintf(stderr, "  failed to corrupt %s\n", filename);
+		ctx->errors++;
+	} else {
+		set = razor_set_open(filename);
+		if (set && razor_set_verify(set) == 0) {
+			fprintf(stderr, "  corrupt %s verifies\n", filename);
+			ctx->errors++;
+		}
+		if (set)
+			razor_set_destroy(set);
+	}
+	if (fd >= 0)
+		close(fd);
+	unlink(filename);
+}
+
 static void
 start_unsatisfiable(struct test_context *ctx, const char **atts)
 {
@@ -448,8 +598,16 @@ start_test_element(void *data, const char *element, const char **atts)
 		start_result(ctx, atts);
 	} else if (strcmp(element, "unsatisfiable") == 0) {
 		start_unsatisfiable(ctx, atts);
+	} else if (strcmp(element, "delta") == 0) {
+		start_delta(ctx, atts);
+	} else if (strcmp(element, "overlay") == 0) {
+		start_overlay(ctx, atts);
+	} else if (strcmp(element, "verify") == 0) {
+		start_verify(ctx, atts);
 	} else if (strcmp(element, "package") == 0) {
 		start_package(ctx, atts);
+	} else if (strcmp(element, "file") == 0) {
+		start_file(ctx, atts);
 	} else if (strcmp(element, "requires") == 0) {
 		start_property(ctx, RAZOR_PROPERTY_REQUIRES, atts);
 	} else if (strcmp(element, "provides") == 0) {
@@ -484,10 +642,28 @@ end_test_element (void *data, const char *element)
 	}
 }
 
+/* Every test runs once for each of these sets of importer flags. */
+static const struct {
+	const char *name;
+	uint32_t flags;
+} variants[] = {
+	{ "default", 0 },
+	{ "sorted string pool", RAZOR_SET_SORTED_STRING_POOL },
+	{ "packed lists", RAZOR_SET_PACKED_LISTS },
+	{ "front coded files", RAZOR_SET_FRONT_CODED_FILES },
+	{ "compressed details", RAZOR_SET_COMPRESSED_DETAILS },
+	{ "string index", RAZOR_SET_STRING_INDEX },
+	{ "version keys", RAZOR_SET_VERSION_KEYS },
+	{ "all", RAZOR_SET_SORTED_STRING_POOL | RAZOR_SET_PACKED_LISTS |
+	  RAZOR_SET_FRONT_CODED_FILES | RAZOR_SET_COMPRESSED_DETAILS |
+	  RAZOR_SET_STRING_INDEX | RAZOR_SET_VERSION_KEYS }
+};
+
 int main(int argc, char *argv[])
 {
 	struct test_context ctx;
 	const char *test_file;
+	int i;
 
 	memset(&ctx, 0, sizeof ctx);
 
@@ -506,7 +682,12 @@ int main(int argc, char *argv[])
 	else
 		test_file = "test.xml";
 
-	parse_xml_file(test_file, start_test_element, end_test_element, &ctx);
+	for (i = 0; i < ARRAY_SIZE(variants); i++) {
+		printf("== %s\n", variants[i].name);
+		ctx.flags = variants[i].flags;
+		parse_xml_file(test_file, start_test_element,
+			       end_test_element, &ctx);
+	}
 
 	if (ctx.errors) {
 		fprintf(stderr, "\n%d errors\n", ctx.errors);